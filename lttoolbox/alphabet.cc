@@ -151,19 +151,26 @@ Alphabet::write(FILE *output)
 
 void
 Alphabet::read(FILE *input)
+{
+  CompressedInput in(input);
+  read(in);
+}
+
+void
+Alphabet::read(CompressedInput &input)
 {
   Alphabet a_new;
   a_new.spairinv.clear();
   a_new.spair.clear();
 
   // Reading of taglist
-  int32_t tam = Compression::multibyte_read(input);
+  int32_t tam = input.multibyte_read();
   std::map<int32_t, std::string> tmp;
   while(tam > 0)
   {
     tam--;
     UString mytag = "<"_u;
-    mytag += Compression::string_read(input);
+    mytag += input.string_read();
     mytag += ">"_u;
     a_new.slexicinv.push_back(mytag);
     a_new.slexic[mytag]= -a_new.slexicinv.size(); // ToDo: This does not turn the result negative due to unsigned semantics
@@ -171,12 +178,13 @@ Alphabet::read(FILE *input)
 
   // Reading of pairlist
   size_t bias = a_new.slexicinv.size();
-  tam = Compression::multibyte_read(input);
-  while(tam > 0)
+  tam = input.multibyte_read();
+  std::vector<unsigned int> pairs(2 * tam);
+  input.multibyte_read(pairs.data(), pairs.size());
+  for(int32_t i = 0; i < tam; i++)
   {
-    tam--;
-    int32_t first = Compression::multibyte_read(input);
-    int32_t second = Compression::multibyte_read(input);
+    int32_t first = pairs[2*i];
+    int32_t second = pairs[2*i+1];
     std::pair<int32_t, int32_t> tmp(first - bias, second - bias);
     int32_t spair_size = a_new.spair.size();
     a_new.spair[tmp] = spair_size;
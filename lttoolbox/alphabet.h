@@ -27,6 +27,8 @@
 
 using namespace icu;
 
+class CompressedInput;
+
 /**
  * Alphabet class.
  * Encodes pairs of symbols into an integer.
@@ -137,6 +139,12 @@ public:
    */
   void read(FILE *input);
 
+  /**
+   * Read method decoding from memory.
+   * @param input input bytes.
+   */
+  void read(CompressedInput &input);
+
   void serialise(std::ostream &serialised) const;
   void deserialise(std::istream &serialised);
 
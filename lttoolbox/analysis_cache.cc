@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lttoolbox/analysis_cache.h>
+
+AnalysisCache::AnalysisCache(size_t max)
+{
+  reset(max);
+}
+
+void
+AnalysisCache::reset(size_t max)
+{
+  entries.reset(max);
+  options.clear();
+  hit_count = 0;
+  miss_count = 0;
+}
+
+bool
+AnalysisCache::enabled() const
+{
+  return entries.maxEntries() != 0;
+}
+
+size_t
+AnalysisCache::maxEntries() const
+{
+  return entries.maxEntries();
+}
+
+void
+AnalysisCache::setOptions(std::vector<int> const &value)
+{
+  if(value != options)
+  {
+    entries.clear();
+    options = value;
+  }
+}
+
+UString const *
+AnalysisCache::find(UString const &key, bool &known)
+{
+  Analysis const *a = entries.find(key);
+  if(a == nullptr)
+  {
+    miss_count++;
+    return nullptr;
+  }
+  hit_count++;
+  known = a->known;
+  return &a->analysis;
+}
+
+void
+AnalysisCache::add(UString const &key, UString const &analysis, bool known)
+{
+  entries.add(key, Analysis{analysis, known});
+}
+
+size_t
+AnalysisCache::hits() const
+{
+  return hit_count;
+}
+
+size_t
+AnalysisCache::misses() const
+{
+  return miss_count;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _ANALYSIS_CACHE_
+#define _ANALYSIS_CACHE_
+
+#include <vector>
+
+#include <lttoolbox/clock_cache.h>
+#include <lttoolbox/ustring.h>
+
+/**
+ * Analyses of the word forms seen so far by FSTProcessor::analysis.  A
+ * key is a word form followed by the character that ended it, and is
+ * only stored when the transducers stopped on exactly that character,
+ * so that the analysis of the key does not depend on what follows it.
+ */
+class AnalysisCache
+{
+private:
+  /**
+   * The analysis of a word form, and whether it was analysed
+   */
+  struct Analysis
+  {
+    UString analysis;
+    bool known;
+  };
+  ClockCache<Analysis> entries;
+
+  /**
+   * Options of FSTProcessor the stored analyses were made with
+   */
+  std::vector<int> options;
+
+  size_t hit_count;
+  size_t miss_count;
+
+public:
+  /**
+   * Longest word form worth a lookup, in characters
+   */
+  static constexpr size_t MAX_KEY = 64;
+
+  /**
+   * Constructor
+   * @param max maximum number of entries, 0 to disable the cache
+   */
+  AnalysisCache(size_t max = 0);
+
+  /**
+   * Forget every entry and the counters, and change the maximum size
+   * @param max maximum number of entries, 0 to disable the cache
+   */
+  void reset(size_t max);
+
+  /**
+   * Whether the cache may be used
+   */
+  bool enabled() const;
+
+  /**
+   * Maximum number of entries, 0 if the cache is disabled
+   */
+  size_t maxEntries() const;
+
+  /**
+   * Forget every entry if the options of the analyses changed
+   * @param value the values of the options
+   */
+  void setOptions(std::vector<int> const &value);
+
+  /**
+   * Look up a key, counting a hit or a miss
+   * @param key the word form and the character after it
+   * @param known set to whether the word form was analysed; if not,
+   * the analysis returned is its compound analysis, or empty
+   * @return the analysis, or nullptr if the key is not stored
+   */
+  UString const * find(UString const &key, bool &known);
+
+  /**
+   * Store the analysis of a key
+   */
+  void add(UString const &key, UString const &analysis, bool known);
+
+  /**
+   * Number of lookups that found their key, and that did not
+   */
+  size_t hits() const;
+  size_t misses() const;
+};
+
+#endif
@@ -460,7 +460,7 @@ AttCompiler::write(FILE *output)
     temp["main@standard"_u] = extract_transducer(UNDECIDED);
   }
   writeTransducerSet(output, UString(letters.begin(), letters.end()),
-                     alphabet, temp);
+                     alphabet, temp, mmap_layout, index_layout);
 }
 
 void
@@ -474,3 +474,15 @@ AttCompiler::setSplitting(bool b)
 {
   splitting = b;
 }
+
+void
+AttCompiler::setMmapLayout(bool b)
+{
+  mmap_layout = b;
+}
+
+void
+AttCompiler::setIndexLayout(bool b)
+{
+  index_layout = b;
+}
@@ -85,11 +85,15 @@ public:
 
   void setHfstSymbols(bool b);
   void setSplitting(bool b);
+  void setMmapLayout(bool b);
+  void setIndexLayout(bool b);
 
 private:
 
   bool hfstSymbols = false;
   bool splitting = true;
+  bool mmap_layout = false;
+  bool index_layout = false;
 
   /** The final state(s). */
   std::map<int, double> finals;
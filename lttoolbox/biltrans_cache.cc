@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lttoolbox/biltrans_cache.h>
+
+BiltransCache::BiltransCache(size_t max)
+: max_entries(max), hit_count(0), miss_count(0)
+{
+  for(auto &s : shards)
+  {
+    s.entries.reset((max + SHARDS - 1) / SHARDS);
+  }
+}
+
+size_t
+BiltransCache::maxEntries() const
+{
+  return max_entries;
+}
+
+BiltransCache::Shard &
+BiltransCache::shard(UString const &key)
+{
+  // the low bits pick the bucket of the shard's own table
+  return shards[(std::hash<UString>()(key) >> 16) % SHARDS];
+}
+
+bool
+BiltransCache::find(UString const &key, UString &result, int &queue_length)
+{
+  Shard &s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  Result const *r = s.entries.find(key);
+  if(r == nullptr)
+  {
+    miss_count++;
+    return false;
+  }
+  hit_count++;
+  result = r->result;
+  queue_length = r->queue_length;
+  return true;
+}
+
+void
+BiltransCache::add(UString const &key, UString const &result, int queue_length)
+{
+  // a key another thread stored meanwhile is kept
+  Shard &s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.entries.add(key, Result{result, queue_length});
+}
+
+size_t
+BiltransCache::hits() const
+{
+  return hit_count;
+}
+
+size_t
+BiltransCache::misses() const
+{
+  return miss_count;
+}
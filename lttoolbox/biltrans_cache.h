@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _BILTRANS_CACHE_
+#define _BILTRANS_CACHE_
+
+#include <atomic>
+#include <mutex>
+
+#include <lttoolbox/clock_cache.h>
+#include <lttoolbox/ustring.h>
+
+/**
+ * Results of looking lexical units up in a bilingual dictionary, for
+ * FSTProcessor::bilingual and the biltrans functions.  It may be used
+ * by several threads at once: the entries are split among shards by
+ * the hash of their key, each with a lock of its own and replacing its
+ * entries in clock order once full.
+ */
+class BiltransCache
+{
+public:
+  /**
+   * The lookup a key is for, its first character
+   */
+  enum Kind
+  {
+    BILINGUAL,
+    BILTRANS,
+    BILTRANSFULL,
+    WITH_QUEUE,
+    WITHOUT_QUEUE
+  };
+
+private:
+  static constexpr size_t SHARDS = 16;
+
+  /**
+   * The result of a lookup, and the length of the tags that were copied
+   * to it without being looked up
+   */
+  struct Result
+  {
+    UString result;
+    int queue_length;
+  };
+
+  struct Shard
+  {
+    std::mutex mutex;
+    ClockCache<Result> entries;
+  };
+  Shard shards[SHARDS];
+
+  /**
+   * Maximum number of entries
+   */
+  size_t max_entries;
+
+  std::atomic<size_t> hit_count;
+  std::atomic<size_t> miss_count;
+
+  Shard & shard(UString const &key);
+
+public:
+  /**
+   * Constructor
+   * @param max maximum number of entries
+   */
+  explicit BiltransCache(size_t max);
+
+  /**
+   * Maximum number of entries
+   */
+  size_t maxEntries() const;
+
+  /**
+   * Look up a key, counting a hit or a miss
+   * @param key the kind of lookup, its options and the lexical unit
+   * @param result set to the stored result
+   * @param queue_length set to the length of the tags that were copied
+   * to the result without being looked up
+   * @return whether the key was stored
+   */
+  bool find(UString const &key, UString &result, int &queue_length);
+
+  /**
+   * Store the result of a lookup
+   */
+  void add(UString const &key, UString const &result, int queue_length);
+
+  /**
+   * Number of lookups that found their key, and that did not
+   */
+  size_t hits() const;
+  size_t misses() const;
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LT_CLOCK_CACHE_H_
+#define _LT_CLOCK_CACHE_H_
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include <lttoolbox/ustring.h>
+
+/**
+ * Values stored by string key, up to a maximum number of them.  Once
+ * full, the entries not looked up since the clock hand last passed
+ * them are replaced first.  Not thread-safe.
+ */
+template<typename V>
+class ClockCache
+{
+private:
+  /**
+   * Maximum number of entries, 0 to store nothing
+   */
+  size_t max_entries;
+
+  /**
+   * Entries in the order the clock hand visits them
+   */
+  struct Entry
+  {
+    UString const *key;
+    V value;
+    bool referenced;
+  };
+  std::vector<Entry> entries;
+  size_t hand;
+
+  /**
+   * Positions in 'entries' by key
+   */
+  std::unordered_map<UString, size_t> index;
+
+public:
+  /**
+   * Constructor
+   * @param max maximum number of entries, 0 to store nothing
+   */
+  explicit ClockCache(size_t max = 0)
+  {
+    reset(max);
+  }
+
+  /**
+   * Forget every entry and change the maximum number of them
+   * @param max maximum number of entries, 0 to store nothing
+   */
+  void reset(size_t max)
+  {
+    max_entries = max;
+    clear();
+  }
+
+  /**
+   * Forget every entry
+   */
+  void clear()
+  {
+    entries.clear();
+    index.clear();
+    hand = 0;
+  }
+
+  /**
+   * Maximum number of entries
+   */
+  size_t maxEntries() const
+  {
+    return max_entries;
+  }
+
+  /**
+   * Look up a key
+   * @return the value, or nullptr if the key is not stored; valid
+   * until the next add() or clear()
+   */
+  V const * find(UString const &key)
+  {
+    auto it = index.find(key);
+    if(it == index.end())
+    {
+      return nullptr;
+    }
+    Entry &e = entries[it->second];
+    e.referenced = true;
+    return &e.value;
+  }
+
+  /**
+   * Store the value of a key, unless it is stored already
+   */
+  void add(UString const &key, V const &value)
+  {
+    if(max_entries == 0 || index.find(key) != index.end())
+    {
+      return;
+    }
+
+    size_t pos;
+    if(entries.size() < max_entries)
+    {
+      pos = entries.size();
+      entries.push_back(Entry());
+    }
+    else
+    {
+      // give the entries looked up since the last round a second chance
+      while(entries[hand].referenced)
+      {
+        entries[hand].referenced = false;
+        hand = (hand + 1) % entries.size();
+      }
+      pos = hand;
+      hand = (hand + 1) % entries.size();
+      index.erase(*entries[pos].key);
+    }
+
+    Entry &e = entries[pos];
+    e.key = &index.emplace(key, pos).first->first;
+    e.value = value;
+    e.referenced = false;
+  }
+};
+
+#endif
@@ -1052,7 +1052,8 @@ Compiler::procRegexp()
 void
 Compiler::write(FILE *output)
 {
-  writeTransducerSet(output, letters, alphabet, sections);
+  writeTransducerSet(output, letters, alphabet, sections, mmap_layout,
+                     index_layout);
 }
 
 void
@@ -1091,6 +1092,18 @@ Compiler::setJobs(bool j)
   jobs = j;
 }
 
+void
+Compiler::setMmapLayout(bool m)
+{
+  mmap_layout = m;
+}
+
+void
+Compiler::setIndexLayout(bool i)
+{
+  index_layout = i;
+}
+
 void
 Compiler::setMaxSectionEntries(size_t m)
 {
@@ -127,6 +127,16 @@ private:
    */
   bool jobs = false;
 
+  /**
+   * Write the sections in the layout used at runtime
+   */
+  bool mmap_layout = false;
+
+  /**
+   * Write a directory of the sections before them
+   */
+  bool index_layout = false;
+
   /**
    * Are we compiling an LSX dictionary
    */
@@ -416,6 +426,18 @@ public:
    */
   void setJobs(bool jobs);
 
+  /**
+   * Set whether to write the sections in the layout used at runtime,
+   * which lt-proc maps instead of decoding
+   */
+  void setMmapLayout(bool mmap_layout);
+
+  /**
+   * Set whether to write a directory of the sections, which lets them be
+   * decoded in parallel
+   */
+  void setIndexLayout(bool index_layout);
+
   /**
    * Set how many top-level entries to allow in a section before starting a new one automatically
    */
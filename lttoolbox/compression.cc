@@ -17,7 +17,9 @@
 #include <lttoolbox/compression.h>
 
 #include <cstdlib>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <iostream>
 #include <utf8.h>
@@ -440,3 +442,153 @@ Compression::long_multibyte_read(std::istream &input)
 
   return result;
 }
+
+CompressedInput::CompressedInput(FILE *input) :
+input(input),
+p(nullptr),
+end(nullptr)
+{
+  // ftell fails on pipes and terminals, whose bytes cannot be put back
+  seekable = ftell(input) >= 0;
+}
+
+CompressedInput::CompressedInput(char const *begin, char const *end) :
+input(nullptr),
+seekable(false),
+p(reinterpret_cast<unsigned char const *>(begin)),
+end(reinterpret_cast<unsigned char const *>(end))
+{
+}
+
+CompressedInput::~CompressedInput()
+{
+  if(input != nullptr && seekable && p != end)
+  {
+    fseek(input, -static_cast<long>(end - p), SEEK_CUR);
+  }
+}
+
+bool
+CompressedInput::fill(size_t n)
+{
+  size_t const left = end - p;
+  if(left >= n)
+  {
+    return true;
+  }
+  if(input == nullptr)
+  {
+    return false;
+  }
+  std::vector<unsigned char> next(seekable ? std::max(n, BLOCK_SIZE) : n);
+  std::copy(p, end, next.begin());
+  size_t const got = fread_unlocked(next.data() + left, 1, next.size() - left, input);
+  next.resize(left + got);
+  buffer.swap(next);
+  p = buffer.data();
+  end = p + buffer.size();
+  return left + got >= n;
+}
+
+char const *
+CompressedInput::position() const
+{
+  return reinterpret_cast<char const *>(p);
+}
+
+bool
+CompressedInput::header(char const *header)
+{
+  if((input != nullptr && !seekable) || !fill(4) || memcmp(p, header, 4) != 0)
+  {
+    return false;
+  }
+  p += 4;
+  return true;
+}
+
+uint64_t
+CompressedInput::read_u64_le()
+{
+  if(!fill(8))
+  {
+    throw std::runtime_error("Failed to read uint64_t");
+  }
+  // the bytes as read_u64_le() sees them, whatever the byte order
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  p += 8;
+  v =
+    ((v & 0xFF00000000000000) >> 56) |
+    ((v & 0xFF000000000000) >> 40) |
+    ((v & 0xFF0000000000) >> 24) |
+    ((v & 0xFF00000000) >> 8) |
+    ((v & 0xFF000000) << 8) |
+    ((v & 0xFF0000) << 24) |
+    ((v & 0xFF00) << 40) |
+    ((v & 0xFF) << 56)
+  ;
+  return v;
+}
+
+unsigned int
+CompressedInput::multibyte_read_slow()
+{
+  unsigned int const length = (fill(1) ? (p[0] >> 6) : 0) + 1;
+  fill(length);
+  unsigned int result = 0;
+  for(unsigned int i = 0; i != length; i++)
+  {
+    // missing bytes read as 0, like Compression::readByte
+    result = (result << 8) | (p != end ? *p++ : 0);
+  }
+  return result & ((1u << (8 * length - 2)) - 1);
+}
+
+void
+CompressedInput::multibyte_read(unsigned int *values, size_t count)
+{
+  if(input != nullptr && seekable)
+  {
+    // at most four bytes each
+    fill(std::min(4 * count, BLOCK_SIZE));
+  }
+  for(size_t i = 0; i != count; i++)
+  {
+    values[i] = multibyte_read();
+  }
+}
+
+double
+CompressedInput::long_multibyte_read()
+{
+  unsigned int mantissa = multibyte_read();
+  if(mantissa >= 0x04000000)
+  {
+    mantissa = ((mantissa & 0x03ffffff) << 26) | multibyte_read();
+  }
+  unsigned int exponent = multibyte_read();
+  if(exponent >= 0x04000000)
+  {
+    exponent = ((exponent & 0x03ffffff) << 26) | multibyte_read();
+  }
+
+  double value = static_cast<double>(static_cast<int>(mantissa)) / 0x40000000;
+  return ldexp(value, static_cast<int>(exponent));
+}
+
+UString
+CompressedInput::string_read()
+{
+  unsigned int const limit = multibyte_read();
+  std::vector<unsigned int> chars(limit);
+  multibyte_read(chars.data(), limit);
+
+  UString retval;
+  retval.reserve(limit);
+  for(auto c : chars)
+  {
+    retval += static_cast<UChar32>(c);
+  }
+  return retval;
+}
@@ -21,13 +21,18 @@
 #include <cstdint>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
 #include <lttoolbox/ustring.h>
 #include <lttoolbox/my_stdio.h>
 
 // Global lttoolbox features
 constexpr char HEADER_LTTOOLBOX[4]{'L', 'T', 'T', 'B'};
 enum LT_FEATURES : uint64_t {
-  LTF_UNKNOWN = (1ull << 0), // Features >= this are unknown, so throw an error; Inc this if more features are added
+  LTF_MMAP = (1ull << 0), // Sections are stored in the layout of TransExe::writeRaw, so they can be mapped
+  LTF_INDEX = (1ull << 1), // A directory of section names and byte lengths precedes the sections, so they can be skipped or decoded in parallel
+  LTF_INDICES = (1ull << 2), // Mapped sections are followed by their transition, case and epsilon indices, so they are not computed at load time
+  LTF_NODES = (1ull << 3), // Mapped sections also hold their node table after the indices, so they are used without linking at load time
+  LTF_UNKNOWN = (1ull << 4), // Features >= this are unknown, so throw an error; Inc this if more features are added
   LTF_RESERVED = (1ull << 63), // If we ever reach this many feature flags, we need a flag to know how to extend beyond 64 bits
 };
 
@@ -223,4 +228,114 @@ public:
   static double long_multibyte_read(std::istream &is);
 };
 
+/**
+ * Decoder of the values written by Compression from bytes in memory:
+ * either a given span, or a stream read ahead in blocks when it is
+ * seekable and byte by byte otherwise.  The bytes read ahead and not
+ * decoded are given back to the stream by the destructor.
+ */
+class CompressedInput
+{
+private:
+  static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+  /**
+   * The stream, nullptr when decoding a span
+   */
+  FILE *input;
+
+  /**
+   * Whether bytes may be read ahead from the stream
+   */
+  bool seekable;
+
+  /**
+   * The bytes not decoded yet are [p, end), in buffer for a stream
+   */
+  std::vector<unsigned char> buffer;
+  unsigned char const *p;
+  unsigned char const *end;
+
+  /**
+   * Make n bytes available if the stream still has them
+   * @return whether they are available
+   */
+  bool fill(size_t n);
+
+  /**
+   * multibyte_read() near the end of the bytes available
+   */
+  unsigned int multibyte_read_slow();
+
+  CompressedInput(CompressedInput const &) = delete;
+  CompressedInput & operator =(CompressedInput const &) = delete;
+
+public:
+  /**
+   * Decode the values that follow in a stream
+   */
+  explicit CompressedInput(FILE *input);
+
+  /**
+   * Decode the values in [begin, end)
+   */
+  CompressedInput(char const *begin, char const *end);
+
+  ~CompressedInput();
+
+  /**
+   * Start of the bytes not decoded yet, when decoding a span
+   */
+  char const * position() const;
+
+  /**
+   * Consume a header if it is next, only looking for it where bytes can
+   * be put back, as the stream functions used to do with fsetpos
+   * @param header the four bytes of the header
+   * @return whether the header was there
+   */
+  bool header(char const *header);
+
+  /**
+   * Read a 64 bit integer as read_le does
+   */
+  uint64_t read_u64_le();
+
+  /**
+   * @see Compression::multibyte_read(), which gives 0 for missing
+   * bytes in the same way
+   */
+  unsigned int multibyte_read()
+  {
+    if(end - p < 4)
+    {
+      return multibyte_read_slow();
+    }
+    // the top two bits of the first byte give the length, the value
+    // is then the rest of those bytes read as big-endian
+    unsigned int const length = (p[0] >> 6) + 1;
+    uint32_t const word = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+                          (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    p += length;
+    return (word >> (32 - 8 * length)) & ((1u << (8 * length - 2)) - 1);
+  }
+
+  /**
+   * Decode a run of values
+   * @param values where to store them
+   * @param count the number of values
+   */
+  void multibyte_read(unsigned int *values, size_t count);
+
+  /**
+   * @see Compression::long_multibyte_read()
+   */
+  double long_multibyte_read();
+
+  /**
+   * @see Compression::string_read()
+   */
+  UString string_read();
+};
+
 #endif
@@ -131,13 +131,15 @@ integer_type int_deserialise(std::istream &Stream_) {
     if (!Stream_)
       throw DeserialisationException("can't deserialise size");
 
-    for (; SerialisedTypeSize != 0;) {
-      SerialisedType_ +=
-          static_cast<integer_type>(Stream_.get())
-          << std::numeric_limits<unsigned char>::digits * --SerialisedTypeSize;
+    // the bytes follow most significant first, read them in one go
+    unsigned char bytes[std::numeric_limits<unsigned char>::max()];
+    if (!Stream_.read(reinterpret_cast<char *>(bytes), SerialisedTypeSize))
+      throw DeserialisationException("can't deserialise byte");
 
-      if (!Stream_)
-        throw DeserialisationException("can't deserialise byte");
+    for (unsigned char i = 0; i != SerialisedTypeSize; i++) {
+      SerialisedType_ +=
+          static_cast<integer_type>(bytes[i])
+          << std::numeric_limits<unsigned char>::digits * (SerialisedTypeSize - 1 - i);
     }
 
     return SerialisedType_;
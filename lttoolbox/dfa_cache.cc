@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lttoolbox/dfa_cache.h>
+#include <lttoolbox/string_utils.h>
+
+#include <algorithm>
+#include <set>
+
+DFACache::DFACache(size_t max)
+{
+  reset(max);
+}
+
+void
+DFACache::reset(size_t max)
+{
+  max_subsets = max;
+  subset_offset.assign(1, 0);
+  subset_nodes.clear();
+  subset_final.clear();
+  subset_ids.clear();
+  steps.assign(max == 0 ? 0 : 64, {EMPTY, -1});
+  step_count = 0;
+}
+
+bool
+DFACache::enabled() const
+{
+  return max_subsets != 0;
+}
+
+size_t
+DFACache::maxSubsets() const
+{
+  return max_subsets;
+}
+
+int
+DFACache::symbols(UChar32 val, bool caseSensitive, int *symbols)
+{
+  symbols[0] = val;
+  if(!caseSensitive && StringUtils::isupper(val) && StringUtils::tolower(val) != val)
+  {
+    symbols[1] = StringUtils::tolower(val);
+    return 2;
+  }
+  return 1;
+}
+
+uint64_t
+DFACache::key(int subset, int const *symbols, int count)
+{
+  return (static_cast<uint64_t>(subset) << 33) |
+         (static_cast<uint64_t>(static_cast<uint32_t>(symbols[0])) << 1) |
+         (count == 2 ? 1 : 0);
+}
+
+size_t
+DFACache::slot(uint64_t k) const
+{
+  size_t const mask = steps.size() - 1;
+  size_t i = ((k * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  while(steps[i].key != k && steps[i].key != EMPTY)
+  {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void
+DFACache::addStep(uint64_t k, int subset)
+{
+  // bound the number of steps as well, every subset may have many
+  if(step_count >= 16 * max_subsets)
+  {
+    return;
+  }
+  if(2 * (step_count + 1) > steps.size())
+  {
+    std::vector<Step> old(2 * steps.size(), {EMPTY, -1});
+    old.swap(steps);
+    for(auto& it : old)
+    {
+      if(it.key != EMPTY)
+      {
+        steps[slot(it.key)] = it;
+      }
+    }
+  }
+  steps[slot(k)] = {k, subset};
+  step_count++;
+}
+
+void
+DFACache::close()
+{
+  size_t const direct = scratch.size();
+  for(size_t i = 0; i != direct; i++)
+  {
+    Node *n = scratch[i];
+    if(n->closure_levels > 0)
+    {
+      RelPtr<Node> const *dest = n->closure->dest;
+      scratch.insert(scratch.end(), dest, dest + n->closure->level[n->closure_levels]);
+    }
+    else if(n->closure_levels < 0)
+    {
+      // no precomputed closure, walk the epsilon transitions
+      std::set<Node *> seen;
+      std::vector<Node *> pending(1, n);
+      while(!pending.empty())
+      {
+        Node *m = pending.back();
+        pending.pop_back();
+        int j;
+        int const limit = m->findTransitions(0, j);
+        for(; j != limit; j++)
+        {
+          if(seen.insert(m->arc_dest[j]).second)
+          {
+            scratch.push_back(m->arc_dest[j]);
+            pending.push_back(m->arc_dest[j]);
+          }
+        }
+      }
+    }
+  }
+}
+
+int
+DFACache::find(std::vector<Node *> &nodes)
+{
+  std::sort(nodes.begin(), nodes.end());
+  nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+  auto it = subset_ids.find(nodes);
+  if(it != subset_ids.end())
+  {
+    return it->second;
+  }
+  if(subset_ids.size() >= max_subsets)
+  {
+    return -1;
+  }
+
+  int const id = subset_ids.size();
+  subset_ids[nodes] = id;
+  subset_nodes.insert(subset_nodes.end(), nodes.begin(), nodes.end());
+  subset_offset.push_back(subset_nodes.size());
+  subset_final.push_back(-1);
+  return id;
+}
+
+int
+DFACache::next(int subset, UChar32 val, bool caseSensitive)
+{
+  int syms[2];
+  int const count = symbols(val, caseSensitive, syms);
+  uint64_t const k = key(subset, syms, count);
+
+  Step const &known = steps[slot(k)];
+  if(known.key == k)
+  {
+    return known.subset;
+  }
+
+  scratch.clear();
+  if(val != 0)
+  {
+    for(Node * const *n = begin(subset), * const *limit = end(subset); n != limit; n++)
+    {
+      RelPtr<Node> const *dest = (*n)->arc_dest;
+      if(count == 2)
+      {
+        int j, j_limit, k, k_limit;
+        (*n)->findCaseTransitions(syms[0], syms[1], j, j_limit, k, k_limit);
+        scratch.insert(scratch.end(), dest + j, dest + j_limit);
+        scratch.insert(scratch.end(), dest + k, dest + k_limit);
+      }
+      else
+      {
+        int j;
+        int const j_limit = (*n)->findTransitions(syms[0], j);
+        scratch.insert(scratch.end(), dest + j, dest + j_limit);
+      }
+    }
+    close();
+  }
+
+  int const result = find(scratch);
+  if(result >= 0)
+  {
+    addStep(k, result);
+  }
+  return result;
+}
+
+Node * const *
+DFACache::begin(int subset) const
+{
+  return subset_nodes.data() + subset_offset[subset];
+}
+
+Node * const *
+DFACache::end(int subset) const
+{
+  return subset_nodes.data() + subset_offset[subset+1];
+}
+
+bool
+DFACache::empty(int subset) const
+{
+  return subset_offset[subset] == subset_offset[subset+1];
+}
+
+unsigned int
+DFACache::finalClass(int subset)
+{
+  if(subset_final[subset] < 0)
+  {
+    unsigned int c = 0;
+    for(Node * const *n = begin(subset), * const *limit = end(subset); n != limit; n++)
+    {
+      c |= (*n)->final_class;
+    }
+    subset_final[subset] = c;
+  }
+  return subset_final[subset];
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _DFA_CACHE_
+#define _DFA_CACHE_
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <unicode/uchar.h>
+
+#include <lttoolbox/node.h>
+
+/**
+ * Lazily built subset construction of the input side of a set of
+ * transducers.  A subset is the set of nodes reached by the paths of
+ * a State; the cache maps (subset, input character, case mode) to the
+ * next subset, so that recognising a known prefix costs one lookup per
+ * character.  See State::setDFACache.
+ */
+class DFACache
+{
+private:
+  /**
+   * Maximum number of subsets, 0 to disable the cache
+   */
+  size_t max_subsets;
+
+  /**
+   * Nodes of each subset sorted by address: subset s is
+   * [subset_offset[s], subset_offset[s+1]) of subset_nodes
+   */
+  std::vector<unsigned int> subset_offset;
+  std::vector<Node *> subset_nodes;
+
+  /**
+   * Union of the final classes of the nodes of each subset, computed
+   * when it is first asked for
+   */
+  std::vector<int> subset_final;
+
+  /**
+   * Subset identifiers by their nodes
+   */
+  std::map<std::vector<Node *>, int> subset_ids;
+
+  /**
+   * Known steps in an open addressing table indexed by a hash of key(),
+   * with a key of EMPTY in the free slots
+   */
+  struct Step
+  {
+    uint64_t key;
+    int subset;
+  };
+  static constexpr uint64_t EMPTY = ~static_cast<uint64_t>(0);
+  std::vector<Step> steps;
+  size_t step_count;
+
+  /**
+   * Slot of a key in 'steps', either holding it or free
+   */
+  size_t slot(uint64_t k) const;
+
+  /**
+   * Remember a step, unless there are already too many
+   */
+  void addStep(uint64_t k, int subset);
+
+  /**
+   * Scratch space for the subset being built
+   */
+  std::vector<Node *> scratch;
+
+  /**
+   * Key of a step in 'steps'
+   */
+  static uint64_t key(int subset, int const *symbols, int count);
+
+  /**
+   * Add the nodes reachable by epsilon transitions from those in
+   * 'scratch'
+   */
+  void close();
+
+public:
+  /**
+   * Constructor
+   * @param max maximum number of subsets, 0 to disable the cache
+   */
+  DFACache(size_t max = 0);
+
+  /**
+   * Forget every subset and change the maximum size
+   * @param max maximum number of subsets, 0 to disable the cache
+   */
+  void reset(size_t max);
+
+  /**
+   * Whether the cache may be used
+   */
+  bool enabled() const;
+
+  /**
+   * Maximum number of subsets, 0 if the cache is disabled
+   */
+  size_t maxSubsets() const;
+
+  /**
+   * Input symbols State::step_case tries for a character
+   * @param val the character
+   * @param caseSensitive whether to ignore the lowercase version
+   * @param symbols array of two symbols to fill
+   * @return the number of symbols
+   */
+  static int symbols(UChar32 val, bool caseSensitive, int *symbols);
+
+  /**
+   * Identifier of a subset
+   * @param nodes the nodes of the subset, sorted and made unique in place
+   * @return the subset, or -1 if it is new and the cache is full
+   */
+  int find(std::vector<Node *> &nodes);
+
+  /**
+   * Subset reached from another one with State::step_case
+   * @param subset the subset stepped from
+   * @param val the input character
+   * @param caseSensitive the case mode of the step
+   * @return the subset, or -1 if it is new and the cache is full
+   */
+  int next(int subset, UChar32 val, bool caseSensitive);
+
+  /**
+   * Nodes of a subset, sorted by address
+   */
+  Node * const * begin(int subset) const;
+  Node * const * end(int subset) const;
+
+  /**
+   * Whether a subset has no nodes
+   */
+  bool empty(int subset) const;
+
+  /**
+   * Union of the final classes of the nodes of a subset
+   */
+  unsigned int finalClass(int subset);
+};
+
+#endif
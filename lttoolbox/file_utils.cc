@@ -18,7 +18,23 @@
 #include <lttoolbox/file_utils.h>
 #include <lttoolbox/compression.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// first word of the section block of LTF_MMAP files, to reject those
+// written with a different byte order
+static constexpr uint32_t MMAP_MAGIC = 0x4C544D4D;
 
 UFILE*
 openOutTextFile(const std::string& fname)
@@ -68,15 +84,96 @@ openInBinFile(const std::string& fname)
 void
 writeTransducerSet(FILE* output, const UString& letters,
                    Alphabet& alpha,
-                   std::map<UString, Transducer>& trans)
+                   std::map<UString, Transducer>& trans,
+                   bool mmap, bool index)
 {
   fwrite_unlocked(HEADER_LTTOOLBOX, 1, 4, output);
   uint64_t features = 0;
+  if (mmap) {
+    features |= LTF_MMAP | LTF_INDICES | LTF_NODES;
+  } else if (index && trans.size() > 1) {
+    features |= LTF_INDEX;
+  }
   write_le(output, features);
 
   Compression::string_write(letters, output);
   alpha.write(output);
+
+  if (mmap) {
+    // the block is a table of (name offset, name length, section
+    // offset), the names and the sections, each aligned to 8 bytes
+    std::vector<TransExe> exe(trans.size());
+    std::vector<uint64_t> table;
+    uint64_t size = 8 + 24 * trans.size();
+    size_t i = 0;
+    for (auto& it : trans) {
+      table.push_back(size);
+      table.push_back(it.first.size());
+      size += 2 * it.first.size();
+      size += (8 - size % 8) % 8;
+      exe[i++].read(it.second, alpha);
+    }
+    for (auto& it : exe) {
+      table.push_back(size);
+      size += it.rawSize(true, true);
+    }
+
+    // align the block in the file when the position is known
+    long const at = ftell(output);
+    uint8_t const pad = at < 0 ? 0 : (8 - (at + 1 + 8) % 8) % 8;
+    char const padding[8] = {};
+    fwrite_unlocked(&pad, 1, 1, output);
+    fwrite_unlocked(padding, 1, pad, output);
+    write_le(output, size);
+
+    uint32_t const head[2] = {MMAP_MAGIC, static_cast<uint32_t>(trans.size())};
+    fwrite_unlocked(head, 4, 2, output);
+    for (i = 0; i != trans.size(); i++) {
+      fwrite_unlocked(&table[2*i], 8, 2, output);
+      fwrite_unlocked(&table[2*trans.size() + i], 8, 1, output);
+    }
+    for (auto& it : trans) {
+      fwrite_unlocked(it.first.data(), 2, it.first.size(), output);
+      fwrite_unlocked(padding, 1, (8 - (2 * it.first.size()) % 8) % 8, output);
+    }
+    i = 0;
+    for (auto& it : trans) {
+      exe[i++].writeRaw(output, true, true);
+      std::cout << it.first << " " << it.second.size();
+      std::cout << " " << it.second.numberOfTransitions() << std::endl;
+    }
+    return;
+  }
+
   Compression::multibyte_write(trans.size(), output);
+  if (features & LTF_INDEX) {
+    // a directory of (name, length) goes before the sections, so
+    // encode them first to know their lengths
+    std::vector<FILE*> encoded;
+    for (auto& it : trans) {
+      FILE* tmp = tmpfile();
+      if (tmp == nullptr) {
+        throw std::runtime_error("Could not create a temporary file");
+      }
+      it.second.write(tmp);
+      Compression::string_write(it.first, output);
+      write_le(output, static_cast<uint64_t>(ftell(tmp)));
+      encoded.push_back(tmp);
+    }
+    size_t i = 0;
+    char buffer[1 << 14];
+    for (auto& it : trans) {
+      FILE* tmp = encoded[i++];
+      std::rewind(tmp);
+      for (size_t n; (n = fread_unlocked(buffer, 1, sizeof(buffer), tmp)) > 0; ) {
+        fwrite_unlocked(buffer, 1, n, output);
+      }
+      fclose(tmp);
+      std::cout << it.first << " " << it.second.size();
+      std::cout << " " << it.second.numberOfTransitions() << std::endl;
+    }
+    return;
+  }
   for (auto& it : trans) {
     Compression::string_write(it.first, output);
     it.second.write(output);
@@ -85,40 +182,238 @@ writeTransducerSet(FILE* output, const UString& letters,
   }
 }
 
-void
+uint64_t
 readShared(FILE* input, std::set<UChar32>& letters, Alphabet& alpha)
 {
-  fpos_t pos;
-  if (fgetpos(input, &pos) == 0) {
-    char header[4]{};
-    fread_unlocked(header, 1, 4, input);
-    if (strncmp(header, HEADER_LTTOOLBOX, 4) == 0) {
-      auto features = read_le<uint64_t>(input);
-      if (features >= LTF_UNKNOWN) {
-        throw std::runtime_error("FST has features that are unknown to this version of lttoolbox - upgrade!");
-      }
-    } else {
-      // Old binary format
-      fsetpos(input, &pos);
+  // gives back what it read ahead when it goes out of scope, so the
+  // sections can be read from input afterwards
+  CompressedInput in(input);
+  uint64_t features = 0;
+  if (in.header(HEADER_LTTOOLBOX)) {
+    features = in.read_u64_le();
+    if (features >= LTF_UNKNOWN) {
+      throw std::runtime_error("FST has features that are unknown to this version of lttoolbox - upgrade!");
+    }
+  }
+  // otherwise old binary format
+
+  for (int len = in.multibyte_read(); len > 0; len--) {
+    letters.insert(static_cast<UChar32>(in.multibyte_read()));
+  }
+
+  alpha.read(in);
+  return features;
+}
+
+/**
+ * Section block of an LTF_MMAP file, mapped if the file allows it and
+ * the block is aligned, read to memory otherwise.  The mapping is
+ * private and writable, since the final nodes of LTF_NODES sections
+ * are marked in place: processes mapping the same file share all the
+ * pages but the few this copies.
+ * @param size set to the number of bytes of the block
+ */
+static std::shared_ptr<char const>
+readBlock(FILE* input, bool map, uint64_t& size)
+{
+  uint8_t pad = 0;
+  char padding[8];
+  if (fread_unlocked(&pad, 1, 1, input) != 1 || pad >= 8 ||
+      fread_unlocked(padding, 1, pad, input) != pad) {
+    throw std::runtime_error("Could not read section block");
+  }
+  size = read_le<uint64_t>(input);
+  if (size < 8) {
+    throw std::runtime_error("Section block is corrupt");
+  }
+
+  std::shared_ptr<char const> block;
+#ifndef _MSC_VER
+  struct stat st;
+  long const at = ftell(input);
+  bool const regular = at >= 0 && fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode);
+  if (regular && static_cast<uint64_t>(st.st_size - at) < size) {
+    throw std::runtime_error("Section block is truncated");
+  }
+  if (map && regular && at % 8 == 0) {
+    void* m = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(input), 0);
+    if (m != MAP_FAILED) {
+      size_t const length = st.st_size;
+      block.reset(static_cast<char const*>(m) + at,
+                  [m, length](char const*) { munmap(m, length); });
+      fseek(input, at + size, SEEK_SET);
+    }
+  }
+#endif
+  if (!block) {
+    // a buffer of doubles, to be aligned like the mapping; the size of
+    // a block read from a stream cannot be checked beforehand
+    double* buffer = new (std::nothrow) double[size / 8 + 1];
+    if (buffer == nullptr) {
+      throw std::runtime_error("Could not read section block");
+    }
+    block.reset(reinterpret_cast<char const*>(buffer),
+                [](char const* p) { delete[] reinterpret_cast<double const*>(p); });
+    if (fread_unlocked(buffer, 1, size, input) != size) {
+      throw std::runtime_error("Could not read section block");
+    }
+  }
+
+  if (*reinterpret_cast<uint32_t const*>(block.get()) != MMAP_MAGIC) {
+    throw std::runtime_error("FST was written on a machine with a different byte order");
+  }
+  return block;
+}
+
+/**
+ * A section of a block read by readBlock: its name, its layout and the
+ * number of bytes up to the next section or the end of the block
+ */
+struct BlockSection
+{
+  UString name;
+  char const* data;
+  uint64_t size;
+};
+
+/**
+ * Sections of a block read by readBlock, checking that the table of
+ * sections, their names and their layouts lie within the block
+ */
+static std::vector<BlockSection>
+blockSections(char const* block, uint64_t size)
+{
+  std::vector<BlockSection> sections;
+  uint32_t const count = reinterpret_cast<uint32_t const*>(block)[1];
+  uint64_t const* table = reinterpret_cast<uint64_t const*>(block + 8);
+  if ((size - 8) / 24 < count) {
+    throw std::runtime_error("Section block is corrupt");
+  }
+  for (uint32_t i = 0; i != count; i++) {
+    uint64_t const name_at = table[3*i];
+    uint64_t const name_length = table[3*i + 1];
+    uint64_t const at = table[3*i + 2];
+    uint64_t const end = i + 1 == count ? size : table[3*(i+1) + 2];
+    if (name_at > size || (size - name_at) / 2 < name_length || name_at % 2 != 0 ||
+        at % 8 != 0 || at > end || end > size) {
+      throw std::runtime_error("Section block is corrupt");
     }
+    UChar const* name = reinterpret_cast<UChar const*>(block + name_at);
+    sections.push_back({UString(name, name_length), block + at, end - at});
   }
+  return sections;
+}
 
+/**
+ * Read the sections of an LTF_INDEX file, decoding them on as many
+ * threads as there are cores
+ * @param read decodes a section from its bytes
+ * @param wanted the sections to read, others are skipped undecoded
+ */
+template<typename T, typename Read>
+static void
+readIndexedSections(FILE* input, std::map<UString, T>& trans, Read read,
+                    SectionFilter const& wanted)
+{
+  std::vector<std::pair<UString, uint64_t>> directory;
   for (int len = Compression::multibyte_read(input); len > 0; len--) {
-    letters.insert(static_cast<UChar32>(Compression::multibyte_read(input)));
+    UString name = Compression::string_read(input);
+    directory.push_back(std::make_pair(name, read_le<uint64_t>(input)));
   }
 
-  alpha.read(input);
+  std::vector<std::vector<char>> bytes;
+  std::vector<T*> sections;
+  for (auto& it : directory) {
+    if (wanted && !wanted(it.first)) {
+      if (fseek(input, it.second, SEEK_CUR) == 0) {
+        continue;
+      }
+      // not seekable, read the section and drop it
+    }
+    std::vector<char> section(it.second);
+    if (fread_unlocked(section.data(), 1, section.size(), input) != section.size()) {
+      throw std::runtime_error("Could not read sections");
+    }
+    if (wanted && !wanted(it.first)) {
+      continue;
+    }
+    bytes.push_back(std::move(section));
+    sections.push_back(&trans[it.first]);
+  }
+  size_t const count = sections.size();
+
+  // an exception leaving a thread would terminate the program, so the
+  // first one stops the others and is thrown once they are joined
+  std::atomic<size_t> next(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto work = [&]() {
+    for (size_t i; (i = next++) < count; ) {
+      try {
+        CompressedInput in(bytes[i].data(), bytes[i].data() + bytes[i].size());
+        read(*sections[i], in);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        next = count;
+      }
+    }
+  };
+  size_t const threads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads; i++) {
+    try {
+      pool.push_back(std::thread(work));
+    } catch (std::system_error const&) {
+      // no more threads to be had, those started do the work
+      break;
+    }
+  }
+  work();
+  for (auto& it : pool) {
+    it.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
 }
 
 void
 readTransducerSet(FILE* input, std::set<UChar32>& letters,
                   Alphabet& alpha,
-                  std::map<UString, Transducer>& trans)
+                  std::map<UString, Transducer>& trans,
+                  SectionFilter const& wanted)
 {
-  readShared(input, letters, alpha);
+  uint64_t const features = readShared(input, letters, alpha);
+  if (features & LTF_MMAP) {
+    uint64_t size;
+    auto block = readBlock(input, false, size);
+    for (auto& it : blockSections(block.get(), size)) {
+      if (wanted && !wanted(it.name)) {
+        continue;
+      }
+      TransExe exe;
+      exe.readRaw(it.data, it.size, block, features & LTF_INDICES, features & LTF_NODES);
+      exe.buildTransducer(trans[it.name], alpha);
+    }
+    return;
+  }
+  if (features & LTF_INDEX) {
+    readIndexedSections(input, trans,
+                        [](Transducer& t, CompressedInput& in) { t.read(in); },
+                        wanted);
+    return;
+  }
 
   for (int len = Compression::multibyte_read(input); len > 0; len--) {
     UString name = Compression::string_read(input);
+    if (wanted && !wanted(name)) {
+      // the old layout has to be decoded to find the next section
+      Transducer().read(input);
+      continue;
+    }
     trans[name].read(input);
   }
 }
@@ -126,12 +421,35 @@ readTransducerSet(FILE* input, std::set<UChar32>& letters,
 void
 readTransducerSet(FILE* input, std::set<UChar32>& letters,
                   Alphabet& alpha,
-                  std::map<UString, TransExe>& trans)
+                  std::map<UString, TransExe>& trans,
+                  SectionFilter const& wanted)
 {
-  readShared(input, letters, alpha);
+  uint64_t const features = readShared(input, letters, alpha);
+  if (features & LTF_MMAP) {
+    uint64_t size;
+    auto block = readBlock(input, true, size);
+    for (auto& it : blockSections(block.get(), size)) {
+      if (wanted && !wanted(it.name)) {
+        continue;
+      }
+      trans[it.name].readRaw(it.data, it.size, block, features & LTF_INDICES, features & LTF_NODES);
+    }
+    return;
+  }
+  if (features & LTF_INDEX) {
+    readIndexedSections(input, trans,
+                        [&alpha](TransExe& t, CompressedInput& in) { t.read(in, alpha); },
+                        wanted);
+    return;
+  }
 
   for (int len = Compression::multibyte_read(input); len > 0; len--) {
     UString name = Compression::string_read(input);
+    if (wanted && !wanted(name)) {
+      // the old layout has to be decoded to find the next section
+      Transducer().read(input);
+      continue;
+    }
     trans[name].read(input, alpha);
   }
 }
@@ -16,25 +16,48 @@
  */
 
 #ifndef __FILE_UTILS_H__
+#define __FILE_UTILS_H__
 
 #include <lttoolbox/alphabet.h>
 #include <lttoolbox/transducer.h>
 #include <lttoolbox/trans_exe.h>
 
 #include <cstdio>
+#include <functional>
 
 UFILE* openOutTextFile(const std::string& fname);
 FILE* openOutBinFile(const std::string& fname);
 FILE* openInBinFile(const std::string& fname);
 
+/**
+ * Write a set of transducers
+ * @param mmap whether to store the sections in the layout used at
+ *        runtime, which readTransducerSet can map without decoding
+ * @param index whether to precede several sections with a directory of
+ *        them, which readTransducerSet uses to decode them in parallel
+ */
 void writeTransducerSet(FILE* output, const UString& letters,
                         Alphabet& alpha,
-                        std::map<UString, Transducer>& trans);
+                        std::map<UString, Transducer>& trans,
+                        bool mmap = false, bool index = false);
+/**
+ * Which sections readTransducerSet should load, by name
+ */
+typedef std::function<bool(UString const&)> SectionFilter;
+
+/**
+ * Read a set of transducers
+ * @param wanted if given, only the sections it accepts are loaded, and
+ *        the others are skipped without decoding where the file has a
+ *        directory of its sections
+ */
 void readTransducerSet(FILE* input, std::set<UChar32>& letters,
                        Alphabet& alpha,
-                       std::map<UString, Transducer>& trans);
+                       std::map<UString, Transducer>& trans,
+                       SectionFilter const& wanted = nullptr);
 void readTransducerSet(FILE* input, std::set<UChar32>& letters,
                        Alphabet& alpha,
-                       std::map<UString, TransExe>& trans);
+                       std::map<UString, TransExe>& trans,
+                       SectionFilter const& wanted = nullptr);
 
 #endif // __FILE_UTILS_H__
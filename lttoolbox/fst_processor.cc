@@ -24,6 +24,12 @@
 #include <iostream>
 #include <cerrno>
 #include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
 
 
 UString const FSTProcessor::XML_TEXT_NODE           = "#text"_u;
@@ -37,6 +43,7 @@ UString const FSTProcessor::WBLANK_FINAL            = "[[/]]"_u;
 
 
 FSTProcessor::FSTProcessor()
+  : model(std::make_shared<Model>())
 {
   // escaped_chars chars
   escaped_chars.insert('[');
@@ -50,6 +57,10 @@ FSTProcessor::FSTProcessor()
   escaped_chars.insert('@');
   escaped_chars.insert('<');
   escaped_chars.insert('>');
+  for(auto c : escaped_chars)
+  {
+    escaped_table.set(c);
+  }
 
   if(useDefaultIgnoredChars)
   {
@@ -57,6 +68,294 @@ FSTProcessor::FSTProcessor()
   }
 }
 
+FSTProcessor::FSTProcessor(FSTProcessor const &other)
+  : FSTProcessor()
+{
+  *this = other;
+}
+
+FSTProcessor &
+FSTProcessor::operator=(FSTProcessor const &other)
+{
+  if(this == &other)
+  {
+    return *this;
+  }
+
+  model = other.model;
+  default_weight = other.default_weight;
+  blankqueue = other.blankqueue;
+  wblankqueue = other.wblankqueue;
+  transliteration_queue = other.transliteration_queue;
+  escaped_chars = other.escaped_chars;
+  escaped_table = other.escaped_table;
+  input_buffer = other.input_buffer;
+  outOfWord = other.outOfWord;
+  binary_word = other.binary_word;
+  binary_pos = other.binary_pos;
+  binary_blank = other.binary_blank;
+  binary_generation = other.binary_generation;
+  binary_tags = other.binary_tags;
+  biltransSurfaceForms = other.biltransSurfaceForms;
+  caseSensitive = other.caseSensitive;
+  dictionaryCase = other.dictionaryCase;
+  nullFlush = other.nullFlush;
+  nullFlushGeneration = other.nullFlushGeneration;
+  useIgnoredChars = other.useIgnoredChars;
+  useRestoreChars = other.useRestoreChars;
+  useDefaultIgnoredChars = other.useDefaultIgnoredChars;
+  displayWeightsMode = other.displayWeightsMode;
+  do_decomposition = other.do_decomposition;
+  compoundOnlyLSymbol = other.compoundOnlyLSymbol;
+  compoundRSymbol = other.compoundRSymbol;
+  showControlSymbols = other.showControlSymbols;
+  compound_max_elements = other.compound_max_elements;
+  maxAnalyses = other.maxAnalyses;
+  transliteration_drop_tilde = other.transliteration_drop_tilde;
+  maxWeightClasses = other.maxWeightClasses;
+  pruningMode = other.pruningMode;
+  biltrans_cache = other.biltrans_cache;
+  numbers = other.numbers;
+  isLastBlankTM = other.isLastBlankTM;
+
+  // the states stepped through a DFACache point into it, so the copy
+  // gets a cache of its own and builds its initial state over it
+  dfa_cache.reset(other.dfa_cache.maxSubsets());
+  analysis_cache.reset(other.analysis_cache.maxEntries());
+  current_state = State();
+  initial_state = State();
+  buildInitialState();
+
+  // an ICX or RCX file being parsed by the other processor is its own
+  reader = nullptr;
+  rcx_current_char = 0;
+  return *this;
+}
+
+FSTProcessor
+FSTProcessor::session() const
+{
+  // the copy refers to the same model and has the settings of this
+  // processor; what it copied of the stream state is started afresh
+  FSTProcessor s(*this);
+  s.resetStream();
+  return s;
+}
+
+void
+FSTProcessor::resetStream()
+{
+  blankqueue = std::queue<UString>();
+  wblankqueue.clear();
+  transliteration_queue.clear();
+  input_buffer = Buffer<int32_t>();
+  numbers.clear();
+  outOfWord = false;
+  isLastBlankTM = false;
+  binary_word.clear();
+  binary_pos = 0;
+  binary_blank.clear();
+  binary_generation = 0;
+  binary_tags.clear();
+  current_state = State();
+}
+
+namespace {
+
+/**
+ * A chunk of the input, and what processing it gave
+ */
+struct Job
+{
+  std::string input;
+  std::string output;
+  std::string error;
+  bool done = false;
+
+  /**
+   * Whether processing stopped before the end of the chunk, where it
+   * would have stopped with one processor too
+   */
+  bool last = false;
+};
+
+/**
+ * What the threads of FSTProcessor::processInParallel share: the jobs
+ * not yet written, in input order, of which those from 'next' on are
+ * waiting for a worker
+ */
+struct JobQueue
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::shared_ptr<Job>> jobs;
+  size_t next = 0;
+  bool finished = false;
+  bool stop = false;
+};
+
+}
+
+void
+FSTProcessor::processInParallel(Process const &process, bool keep_null,
+                                InputFile &input, OutputFile &output,
+                                int threads)
+{
+  static size_t const CHUNK_SIZE = 1 << 16;
+  bool const null_flush = nullFlush;
+  size_t const max_jobs = 4 * threads;
+  JobQueue q;
+
+  // writing to cancel[1] makes the reader give up a read that waits
+  // for input, so that it can be joined when the output stops early
+  int cancel[2] = {-1, -1};
+#ifndef _MSC_VER
+  if(pipe(cancel) != 0)
+  {
+    throw std::runtime_error("Could not create a pipe");
+  }
+#endif
+
+  std::thread reader([&]() {
+    bool more = true;
+    while(more)
+    {
+      auto job = std::make_shared<Job>();
+      try
+      {
+        more = input.readChunk(job->input, null_flush, CHUNK_SIZE, cancel[0]);
+        if(more && null_flush && keep_null)
+        {
+          job->input += '\0';
+        }
+      }
+      catch (std::exception& e)
+      {
+        // passed on to be reported in order
+        job->error = e.what();
+        more = false;
+      }
+      std::unique_lock<std::mutex> lock(q.mutex);
+      q.changed.wait(lock, [&]() { return q.stop || q.jobs.size() < max_jobs; });
+      if(q.stop)
+      {
+        return;
+      }
+      q.jobs.push_back(job);
+      q.finished = !more;
+      q.changed.notify_all();
+    }
+  });
+
+  std::vector<std::thread> workers;
+  for(int i = 0; i < threads; i++)
+  {
+    workers.emplace_back([&]() {
+      FSTProcessor s = session();
+      while(true)
+      {
+        std::shared_ptr<Job> job;
+        {
+          std::unique_lock<std::mutex> lock(q.mutex);
+          q.changed.wait(lock, [&]() {
+            return q.stop || q.finished || q.next < q.jobs.size();
+          });
+          if(q.stop || q.next == q.jobs.size())
+          {
+            return;
+          }
+          job = q.jobs[q.next++];
+        }
+        InputFile in;
+        OutputFile out;
+        in.wrap(job->input);
+        out.wrap(job->output);
+        // the null-flush wrappers turn the mode off once they run
+        s.setNullFlush(null_flush);
+        if(job->error.empty())
+        {
+          try
+          {
+            process(s, in, out);
+            // text that is not null-flushed is processed up to its end,
+            // unless something in it ends the processing, such as a
+            // null character or a tag analysis does not know
+            job->last = !null_flush && in.peek() != U_EOF;
+          }
+          catch (std::exception& e)
+          {
+            job->error = e.what();
+          }
+        }
+        out.flush();
+        s.resetStream();
+        std::unique_lock<std::mutex> lock(q.mutex);
+        job->done = true;
+        q.changed.notify_all();
+      }
+    });
+  }
+
+  std::string error;
+  while(true)
+  {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(q.mutex);
+      q.changed.wait(lock, [&]() {
+        return (!q.jobs.empty() && q.jobs.front()->done) ||
+               (q.finished && q.jobs.empty());
+      });
+      if(q.jobs.empty())
+      {
+        break;
+      }
+      job = q.jobs.front();
+      q.jobs.pop_front();
+      q.next--;
+      q.changed.notify_all();
+    }
+    output.writeUtf8(job->output);
+    if(!job->error.empty())
+    {
+      error = job->error;
+      break;
+    }
+    if(job->last)
+    {
+      break;
+    }
+    if(null_flush)
+    {
+      output.flush();
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(q.mutex);
+    q.stop = true;
+    q.changed.notify_all();
+  }
+#ifndef _MSC_VER
+  while(write(cancel[1], "", 1) < 0 && errno == EINTR)
+  {
+  }
+#endif
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+  reader.join();
+#ifndef _MSC_VER
+  close(cancel[0]);
+  close(cancel[1]);
+#endif
+  if(!error.empty())
+  {
+    throw std::runtime_error(error);
+  }
+}
+
 void
 FSTProcessor::streamError()
 {
@@ -81,7 +380,7 @@ FSTProcessor::parseICX(std::string const &file)
       ret = xmlTextReaderRead(reader);
     }
     // No point trying to process ignored chars if there are none
-    if(ignored_chars.size() == 0)
+    if(model->ignored_chars.size() == 0)
     {
       useIgnoredChars = false;
     }
@@ -122,7 +421,7 @@ FSTProcessor::procNodeICX()
   }
   else if(name == XML_CHAR_ELEM)
   {
-    ignored_chars.insert(static_cast<int32_t>(XMLParseUtil::attrib(reader, XML_VALUE_ATTR)[0]));
+    model->ignored_chars.insert(static_cast<int32_t>(XMLParseUtil::attrib(reader, XML_VALUE_ATTR)[0]));
   }
   else if(name == XML_COMMENT_NODE)
   {
@@ -139,7 +438,7 @@ FSTProcessor::procNodeICX()
 void
 FSTProcessor::initDefaultIgnoredCharacters()
 {
-  ignored_chars.insert(173); // '\u00AD', soft hyphen
+  model->ignored_chars.insert(173); // '\u00AD', soft hyphen
 }
 
 void
@@ -160,7 +459,7 @@ FSTProcessor::procNodeRCX()
   }
   else if(name == XML_RESTORE_CHAR_ELEM)
   {
-    rcx_map[rcx_current_char].insert(static_cast<int32_t>(XMLParseUtil::attrib(reader, XML_VALUE_ATTR)[0]));
+    model->rcx_map[rcx_current_char].insert(static_cast<int32_t>(XMLParseUtil::attrib(reader, XML_VALUE_ATTR)[0]));
   }
   else if(name == XML_COMMENT_NODE)
   {
@@ -193,7 +492,7 @@ FSTProcessor::readAnalysis(InputFile& input)
     val = 0;
   }
 
-  while ((useIgnoredChars || useDefaultIgnoredChars) && ignored_chars.find(val) != ignored_chars.end())
+  while ((useIgnoredChars || useDefaultIgnoredChars) && model->ignored_chars.find(val) != model->ignored_chars.end())
   {
     val = input.get();
   }
@@ -203,7 +502,7 @@ FSTProcessor::readAnalysis(InputFile& input)
     switch(val)
     {
       case '<':
-        altval = alphabet(input.readBlock('<', '>'));
+        altval = tagSymbol(input.readBlock('<', '>'));
         input_buffer.add(altval);
         return altval;
 
@@ -240,6 +539,41 @@ FSTProcessor::readAnalysis(InputFile& input)
   return val;
 }
 
+bool
+FSTProcessor::readAnalysisKey(InputFile& input, UChar32 val, UString &key,
+                              size_t &word_size)
+{
+  key.clear();
+  size_t length = 0;
+  do
+  {
+    if(++length > AnalysisCache::MAX_KEY)
+    {
+      return false;
+    }
+    model->alphabet.getSymbol(key, val);
+  }
+  while((val = readAnalysis(input)) > 0 && isAlphabetic(val));
+
+  if(val <= 0)
+  {
+    // the end of the input, or a tag
+    return false;
+  }
+  word_size = key.size();
+  model->alphabet.getSymbol(key, val);
+  return true;
+}
+
+std::vector<int>
+FSTProcessor::analysisOptions() const
+{
+  return {caseSensitive, dictionaryCase, displayWeightsMode,
+          do_decomposition, useIgnoredChars, useDefaultIgnoredChars,
+          useRestoreChars, pruningMode, maxAnalyses, maxWeightClasses,
+          static_cast<int>(escaped_chars.size())};
+}
+
 int
 FSTProcessor::readTMAnalysis(InputFile& input)
 {
@@ -261,7 +595,7 @@ FSTProcessor::readTMAnalysis(InputFile& input)
     switch(val)
     {
       case '<':
-        altval = alphabet(input.readBlock('<', '>'));
+        altval = tagSymbol(input.readBlock('<', '>'));
         input_buffer.add(altval);
         return altval;
 
@@ -304,9 +638,9 @@ FSTProcessor::readTMAnalysis(InputFile& input)
             val = input.get();
           } while(u_isdigit(val));
           input.unget(val);
-          input_buffer.add(alphabet("<n>"_u));
+          input_buffer.add(tagSymbol("<n>"_u));
           numbers.push_back(ws);
-          return alphabet("<n>"_u);
+          return tagSymbol("<n>"_u);
         }
         break;
 
@@ -371,7 +705,7 @@ FSTProcessor::readTransliterationWord(InputFile& input)
         } else if (c == '\\') {
           word.push_back(static_cast<int32_t>(input.get()));
         } else if (c == '<') {
-          word.push_back(alphabet(input.readBlock('<', '>')));
+          word.push_back(tagSymbol(input.readBlock('<', '>')));
         } else if (c == '\0') {
           input.unget(c);
           break;
@@ -393,7 +727,7 @@ FSTProcessor::readTransliterationWord(InputFile& input)
       } else if (c == '\\') {
         word.push_back(static_cast<int32_t>(input.get()));
       } else if (c == '<') {
-        word.push_back(alphabet(input.readBlock('<', '>')));
+        word.push_back(tagSymbol(input.readBlock('<', '>')));
       } else {
         word.push_back(static_cast<int32_t>(c));
       }
@@ -409,7 +743,7 @@ FSTProcessor::readTransliterationWord(InputFile& input)
 }
 
 void
-FSTProcessor::skipUntil(InputFile& input, UFILE *output, UChar32 const character)
+FSTProcessor::skipUntil(InputFile& input, OutputFile& output, UChar32 const character)
 {
   while(true)
   {
@@ -427,15 +761,15 @@ FSTProcessor::skipUntil(InputFile& input, UFILE *output, UChar32 const character
         {
           return;
         }
-        u_fputc('\\', output);
-        u_fputc(val, output);
+        output.put('\\');
+        output.put(val);
         break;
 
       case '\0':
-        u_fputc(val, output);
+        output.putNull();
         if(nullFlushGeneration)
         {
-          u_fflush(output);
+          output.flush();
         }
         break;
 
@@ -446,7 +780,7 @@ FSTProcessor::skipUntil(InputFile& input, UFILE *output, UChar32 const character
         }
         else
         {
-          u_fputc(val, output);
+          output.put(val);
         }
         break;
     }
@@ -454,8 +788,13 @@ FSTProcessor::skipUntil(InputFile& input, UFILE *output, UChar32 const character
 }
 
 int
-FSTProcessor::readGeneration(InputFile& input, UFILE *output)
+FSTProcessor::readGeneration(InputFile& input, OutputFile& output)
 {
+  if(input.binaryStream())
+  {
+    return readBinary(input, output).second;
+  }
+
   UChar32 val = input.get();
 
   if(input.eof())
@@ -475,13 +814,13 @@ FSTProcessor::readGeneration(InputFile& input, UFILE *output)
     }
     else if(val == '\\')
     {
-      u_fputc(val, output);
+      output.put(val);
       val = input.get();
       if(input.eof())
       {
         return 0x7fffffff;
       }
-      u_fputc(val,output);
+      output.put(val);
       skipUntil(input, output, '^');
       val = input.get();
       if(input.eof())
@@ -491,7 +830,7 @@ FSTProcessor::readGeneration(InputFile& input, UFILE *output)
     }
     else
     {
-      u_fputc(val, output);
+      output.put(val);
       skipUntil(input, output, '^');
       val = input.get();
       if(input.eof())
@@ -514,19 +853,19 @@ FSTProcessor::readGeneration(InputFile& input, UFILE *output)
   }
   else if(val == '<')
   {
-    return alphabet(input.readBlock('<', '>'));
+    return tagSymbol(input.readBlock('<', '>'));
   }
   else if(val == '[')
   {
     val = input.get();
     if(val == '[')
     {
-      write(input.finishWBlank(), output);
+      output.write(input.finishWBlank());
     }
     else
     {
       input.unget(val);
-      write(input.readBlock('[', ']'), output);
+      output.write(input.readBlock('[', ']'));
     }
 
     return readGeneration(input, output);
@@ -540,8 +879,13 @@ FSTProcessor::readGeneration(InputFile& input, UFILE *output)
 }
 
 std::pair<UString, int>
-FSTProcessor::readBilingual(InputFile& input, UFILE *output)
+FSTProcessor::readBilingual(InputFile& input, OutputFile& output)
 {
+  if(input.binaryStream())
+  {
+    return readBinary(input, output);
+  }
+
   UChar32 val = input.get();
   UString symbol;
 
@@ -562,13 +906,13 @@ FSTProcessor::readBilingual(InputFile& input, UFILE *output)
     }
     else if(val == '\\')
     {
-      u_fputc(val, output);
+      output.put(val);
       val = input.get();
       if(input.eof())
       {
         return std::pair<UString, int>(symbol, 0x7fffffff);
       }
-      u_fputc(val,output);
+      output.put(val);
       skipUntil(input, output, '^');
       val = input.get();
       if(input.eof())
@@ -578,7 +922,7 @@ FSTProcessor::readBilingual(InputFile& input, UFILE *output)
     }
     else
     {
-      u_fputc(val, output);
+      output.put(val);
       skipUntil(input, output, '^');
       val = input.get();
       if(input.eof())
@@ -603,7 +947,7 @@ FSTProcessor::readBilingual(InputFile& input, UFILE *output)
   {
     UString cad = input.readBlock('<', '>');
 
-    int res = alphabet(cad);
+    int res = tagSymbol(cad);
 
     if (res == 0)
     {
@@ -616,12 +960,12 @@ FSTProcessor::readBilingual(InputFile& input, UFILE *output)
     val = input.get();
     if(val == '[')
     {
-      write(input.finishWBlank(), output);
+      output.write(input.finishWBlank());
     }
     else
     {
       input.unget(val);
-      write(input.readBlock('[', ']'), output);
+      output.write(input.readBlock('[', ']'));
     }
 
     return readBilingual(input, output);
@@ -630,49 +974,166 @@ FSTProcessor::readBilingual(InputFile& input, UFILE *output)
   return std::pair<UString, int>(symbol, val);
 }
 
+std::pair<UString, int>
+FSTProcessor::readBinary(InputFile& input, OutputFile& output)
+{
+  if(outOfWord)
+  {
+    bool in_word = false;
+    while(!in_word)
+    {
+      switch(input.readRecord(binary_blank, binary_word))
+      {
+        case InputFile::REC_EOF:
+          return std::pair<UString, int>(UString(), 0x7fffffff);
+
+        case InputFile::REC_BLANK:
+          output.writeUtf8(binary_blank);
+          break;
+
+        case InputFile::REC_NULL:
+          output.putNull();
+          if(nullFlushGeneration)
+          {
+            output.flush();
+          }
+          break;
+
+        case InputFile::REC_WORD:
+          in_word = true;
+          break;
+      }
+    }
+    binary_pos = 0;
+    outOfWord = false;
+  }
+
+  if(binary_pos == binary_word.size())
+  {
+    outOfWord = true;
+    return std::pair<UString, int>(UString(), static_cast<int32_t>('$'));
+  }
+
+  int32_t const val = binary_word[binary_pos++];
+  if(val >= 0)
+  {
+    return std::pair<UString, int>(UString(), val);
+  }
+
+  // tags are looked up once per stream, and again if it starts over
+  if(binary_generation != input.tagGeneration())
+  {
+    binary_generation = input.tagGeneration();
+    binary_tags.clear();
+  }
+  size_t const id = -1 - val;
+  while(binary_tags.size() <= id)
+  {
+    binary_tags.push_back(tagSymbol(input.tag(binary_tags.size())));
+  }
+  int const symbol = binary_tags[id];
+  return std::pair<UString, int>(symbol == 0 ? input.tag(id) : UString(), symbol);
+}
+
 void
-FSTProcessor::flushBlanks(UFILE *output)
+FSTProcessor::flushBlanks(OutputFile& output)
 {
   for(size_t i = blankqueue.size(); i > 0; i--)
   {
-    write(blankqueue.front(), output);
+    output.write(blankqueue.front());
     blankqueue.pop();
   }
 }
 
+bool
+FSTProcessor::calcInitial(Model::Finals finals)
+{
+  bool const classify = model->finals != finals;
+  if(classify)
+  {
+    if(model->finals != Model::FINALS_NONE && model.use_count() > 1)
+    {
+      throw std::runtime_error("The dictionaries are shared with a copy or session initialised for another mode");
+    }
+
+    // built afresh, so that initialising again adds no paths and keeps
+    // no final classes
+    model->root = Node();
+    for(auto& it : model->transducers) {
+      model->root.addTransition(0, 0, it.second.getInitial(), default_weight);
+      for(auto& f : it.second.getFinals())
+      {
+        f.first->clearFinal();
+      }
+    }
+    model->inconditional.clear();
+    model->standard.clear();
+    model->postblank.clear();
+    model->preblank.clear();
+    model->all_finals.clear();
+    model->finals = finals;
+
+    // the subsets cached so far have the old final classes
+    dfa_cache.reset(dfa_cache.maxSubsets());
+    analysis_cache.reset(analysis_cache.maxEntries());
+  }
+  buildInitialState();
+  return classify;
+}
+
 void
-FSTProcessor::calcInitial()
+FSTProcessor::buildInitialState()
 {
-  for(auto& it : transducers) {
-    root.addTransition(0, 0, it.second.getInitial(), default_weight);
+  if(do_decomposition)
+  {
+    // compound parts are filtered by their output, which the pruning of
+    // the paths at each node does not take into account
+    initial_state.setPruning(pruningMode);
   }
+  else
+  {
+    initial_state.setPruning(pruningMode, maxAnalyses, maxWeightClasses);
+  }
+  if(model->transducers.size() == 1 && model->transducers.begin()->second.isDeterministic())
+  {
+    // one path at most, the cache of subsets would not help
+    initial_state.initDeterministic(model->transducers.begin()->second.getInitial());
+  }
+  else
+  {
+    initial_state.setDFACache(&dfa_cache);
+    initial_state.init(&model->root);
+  }
+}
 
-  initial_state.init(&root);
+int32_t
+FSTProcessor::tagSymbol(UString const &tag) const
+{
+  // tags have negative symbols, so the -1 that the const operator()
+  // returns for unknown strings is no use here
+  Alphabet const &a = model->alphabet;
+  return a.isSymbolDefined(tag) ? a(tag) : 0;
 }
 
 void
 FSTProcessor::classifyFinals()
 {
-  for(auto& it : transducers) {
+  for(auto& it : model->transducers) {
     if(StringUtils::endswith(it.first, "@inconditional"_u))
     {
-      inconditional.insert(it.second.getFinals().begin(),
-                           it.second.getFinals().end());
+      addFinals(it.second.getFinals(), FINAL_INCONDITIONAL, model->inconditional);
     }
     else if(StringUtils::endswith(it.first, "@standard"_u))
     {
-      standard.insert(it.second.getFinals().begin(),
-                      it.second.getFinals().end());
+      addFinals(it.second.getFinals(), FINAL_STANDARD, model->standard);
     }
     else if(StringUtils::endswith(it.first, "@postblank"_u))
     {
-      postblank.insert(it.second.getFinals().begin(),
-                       it.second.getFinals().end());
+      addFinals(it.second.getFinals(), FINAL_POSTBLANK, model->postblank);
     }
     else if(StringUtils::endswith(it.first, "@preblank"_u))
     {
-      preblank.insert(it.second.getFinals().begin(),
-                      it.second.getFinals().end());
+      addFinals(it.second.getFinals(), FINAL_PREBLANK, model->preblank);
     }
     else
     {
@@ -683,6 +1144,18 @@ FSTProcessor::classifyFinals()
   }
 }
 
+void
+FSTProcessor::addFinals(std::map<Node *, double> const &finals,
+                        FinalClass final_class,
+                        std::map<Node *, double> &target)
+{
+  for(auto& it : finals)
+  {
+    it.first->setFinal(final_class, it.second);
+  }
+  target.insert(finals.begin(), finals.end());
+}
+
 UString
 FSTProcessor::filterFinals(const State& state, const UString& casefrom)
 {
@@ -692,34 +1165,30 @@ FSTProcessor::filterFinals(const State& state, const UString& casefrom)
     uppercase = (casefrom.size() > 1 &&
                  firstupper && u_isupper(casefrom[casefrom.size()-1]));
   }
-  return state.filterFinals(all_finals, alphabet, escaped_chars,
+  return state.filterFinals(FINAL_ANY, model->alphabet, escaped_chars,
                             displayWeightsMode, maxAnalyses, maxWeightClasses,
                             uppercase, firstupper, 0);
 }
 
 void
-FSTProcessor::writeEscaped(UString const &str, UFILE *output)
+FSTProcessor::writeEscaped(UString const &str, OutputFile& output)
 {
-  for(unsigned int i = 0, limit = str.size(); i < limit; i++)
-  {
-    if(escaped_chars.find(str[i]) != escaped_chars.end())
-    {
-      u_fputc('\\', output);
-    }
-    u_fputc(str[i], output);
-  }
+  output.writeEscaped(str, escaped_table);
 }
 
 size_t
-FSTProcessor::writeEscapedPopBlanks(UString const &str, UFILE *output)
+FSTProcessor::writeEscapedPopBlanks(UString const &str, OutputFile& output)
+{
+  output.writeEscaped(str, escaped_table);
+  return popBlanks(str);
+}
+
+size_t
+FSTProcessor::popBlanks(UString const &str)
 {
   size_t postpop = 0;
   for (unsigned int i = 0, limit = str.size(); i < limit; i++)
   {
-    if (escaped_chars.find(str[i]) != escaped_chars.end()) {
-      u_fputc('\\', output);
-    }
-    u_fputc(str[i], output);
     if (str[i] == ' ') {
       if (blankqueue.front() == " "_u) {
         blankqueue.pop();
@@ -732,63 +1201,99 @@ FSTProcessor::writeEscapedPopBlanks(UString const &str, UFILE *output)
 }
 
 void
-FSTProcessor::writeEscapedWithTags(UString const &str, UFILE *output)
+FSTProcessor::writeEscapedWithTags(UString const &str, OutputFile& output)
 {
-  for(unsigned int i = 0, limit = str.size(); i < limit; i++)
+  for(unsigned int i = 1, limit = str.size(); i < limit; i++)
   {
-    if(str[i] == '<' && i >=1 && str[i-1] != '\\')
+    if(str[i] == '<' && str[i-1] != '\\')
     {
-      write(str.substr(i), output);
+      output.writeEscaped(str.substr(0, i), escaped_table);
+      output.write(str.substr(i));
       return;
     }
-
-    if(escaped_chars.find(str[i]) != escaped_chars.end())
-    {
-      u_fputc('\\', output);
-    }
-    u_fputc(str[i], output);
   }
+  output.writeEscaped(str, escaped_table);
 }
 
 
-
 void
-FSTProcessor::printWord(UString const &sf, UString const &lf, UFILE *output)
+FSTProcessor::printWord(UString const &sf, UString const &lf, OutputFile& output)
 {
-  u_fputc('^', output);
+  if(output.binaryStream())
+  {
+    output.beginWord();
+    output.wordChars(sf);
+    output.wordText(lf);
+    output.endWord();
+    return;
+  }
+  output.put('^');
   writeEscaped(sf, output);
-  write(lf, output);
-  u_fputc('$', output);
+  output.write(lf);
+  output.put('$');
 }
 
 void
-FSTProcessor::printWordPopBlank(UString const &sf, UString const &lf, UFILE *output)
+FSTProcessor::printWordPopBlank(UString const &sf, UString const &lf, OutputFile& output)
 {
-  u_fputc('^', output);
-  size_t postpop = writeEscapedPopBlanks(sf, output);
-  u_fprintf(output, "%S$", lf.c_str());
+  size_t postpop;
+  if(output.binaryStream())
+  {
+    output.beginWord();
+    output.wordChars(sf);
+    postpop = popBlanks(sf);
+    output.wordText(lf);
+    output.endWord();
+  }
+  else
+  {
+    output.put('^');
+    postpop = writeEscapedPopBlanks(sf, output);
+    output.write(lf);
+    output.put('$');
+  }
   while (postpop-- && blankqueue.size() > 0)
   {
-    write(blankqueue.front(), output);
+    output.write(blankqueue.front());
     blankqueue.pop();
   }
 }
 
 void
-FSTProcessor::printWordBilingual(UString const &sf, UString const &lf, UFILE *output)
+FSTProcessor::printWordBilingual(UString const &sf, UString const &lf, OutputFile& output)
 {
-  u_fprintf(output, "^%S%S$", sf.c_str(), lf.c_str());
+  if(output.binaryStream())
+  {
+    output.beginWord();
+    output.wordText(sf);
+    output.wordText(lf);
+    output.endWord();
+    return;
+  }
+  output.put('^');
+  output.write(sf);
+  output.write(lf);
+  output.put('$');
 }
 
 void
-FSTProcessor::printUnknownWord(UString const &sf, UFILE *output)
+FSTProcessor::printUnknownWord(UString const &sf, OutputFile& output)
 {
-  u_fputc('^', output);
+  if(output.binaryStream())
+  {
+    output.beginWord();
+    output.wordChars(sf);
+    output.wordText("/*"_u);
+    output.wordChars(sf);
+    output.endWord();
+    return;
+  }
+  output.put('^');
   writeEscaped(sf, output);
-  u_fputc('/', output);
-  u_fputc('*', output);
+  output.put('/');
+  output.put('*');
   writeEscaped(sf, output);
-  u_fputc('$', output);
+  output.put('$');
 }
 
 unsigned int
@@ -796,7 +1301,7 @@ FSTProcessor::lastBlank(UString const &str)
 {
   for(int i = static_cast<int>(str.size())-1; i >= 0; i--)
   {
-    if(alphabetic_chars.find(str[i]) == alphabetic_chars.end())
+    if(model->alphabetic_chars.find(str[i]) == model->alphabetic_chars.end())
     {
       return static_cast<unsigned int>(i);
     }
@@ -806,7 +1311,7 @@ FSTProcessor::lastBlank(UString const &str)
 }
 
 void
-FSTProcessor::printSpace(UChar32 const val, UFILE *output)
+FSTProcessor::printSpace(UChar32 const val, OutputFile& output)
 {
   if(blankqueue.size() > 0)
   {
@@ -814,26 +1319,26 @@ FSTProcessor::printSpace(UChar32 const val, UFILE *output)
   }
   else
   {
-    u_fputc(val, output);
+    output.put(val);
   }
 }
 
 void
-FSTProcessor::printChar(const UChar32 val, UFILE* output)
+FSTProcessor::printChar(const UChar32 val, OutputFile& output)
 {
   if (u_isspace(val)) {
     if (blankqueue.size() > 0) {
-      write(blankqueue.front(), output);
+      output.write(blankqueue.front());
       blankqueue.pop();
     } else {
-      u_fputc(val, output);
+      output.put(val);
     }
   } else {
     if (isEscaped(val)) {
-      u_fputc('\\', output);
+      output.put('\\');
     }
     if (val) {
-      u_fputc(val, output);
+      output.put(val);
     }
   }
 }
@@ -847,34 +1352,37 @@ FSTProcessor::isEscaped(UChar32 const c) const
 bool
 FSTProcessor::isAlphabetic(UChar32 const c) const
 {
-  return u_isalnum(c) || alphabetic_chars.find(c) != alphabetic_chars.end();
+  return u_isalnum(c) || model->alphabetic_chars.find(c) != model->alphabetic_chars.end();
 }
 
 void
-FSTProcessor::load(FILE *input)
+FSTProcessor::load(FILE *input, SectionFilter const &wanted)
 {
-  readTransducerSet(input, alphabetic_chars, alphabet, transducers);
+  readTransducerSet(input, model->alphabetic_chars, model->alphabet, model->transducers, wanted);
+  model->finals = Model::FINALS_NONE;
 }
 
 void
 FSTProcessor::initAnalysis()
 {
-  calcInitial();
-  classifyFinals();
-  all_finals = standard;
-  all_finals.insert(inconditional.begin(), inconditional.end());
-  all_finals.insert(postblank.begin(), postblank.end());
-  all_finals.insert(preblank.begin(), preblank.end());
+  if(calcInitial(Model::FINALS_BY_SECTION))
+  {
+    classifyFinals();
+    model->all_finals = model->standard;
+    model->all_finals.insert(model->inconditional.begin(), model->inconditional.end());
+    model->all_finals.insert(model->postblank.begin(), model->postblank.end());
+    model->all_finals.insert(model->preblank.begin(), model->preblank.end());
+  }
 }
 
 void
 FSTProcessor::initTMAnalysis()
 {
-  calcInitial();
-
-  for(auto& it : transducers) {
-    all_finals.insert(it.second.getFinals().begin(),
-                      it.second.getFinals().end());
+  if(calcInitial(Model::FINALS_STANDARD))
+  {
+    for(auto& it : model->transducers) {
+      addFinals(it.second.getFinals(), FINAL_STANDARD, model->all_finals);
+    }
   }
 }
 
@@ -882,10 +1390,11 @@ void
 FSTProcessor::initGeneration()
 {
   setIgnoredChars(false);
-  calcInitial();
-  for(auto& it : transducers) {
-    all_finals.insert(it.second.getFinals().begin(),
-                      it.second.getFinals().end());
+  if(calcInitial(Model::FINALS_STANDARD))
+  {
+    for(auto& it : model->transducers) {
+      addFinals(it.second.getFinals(), FINAL_STANDARD, model->all_finals);
+    }
   }
 }
 
@@ -926,10 +1435,10 @@ FSTProcessor::compoundAnalysis(UString input_word)
 
     if(i < input_word.size()-1)
     {
-      current_state.restartFinals(all_finals, compoundOnlyLSymbol, &initial_state, '+');
+      current_state.restartFinals(model->all_finals, compoundOnlyLSymbol, &initial_state, '+');
     }
 
-    if(current_state.size()==0)
+    if(current_state.isEmpty())
     {
       UString nullString;
       return nullString;
@@ -945,30 +1454,30 @@ FSTProcessor::compoundAnalysis(UString input_word)
 void
 FSTProcessor::initDecompositionSymbols()
 {
-  if((compoundOnlyLSymbol=alphabet("<:co:only-L>"_u)) == 0
-     && (compoundOnlyLSymbol=alphabet("<:compound:only-L>"_u)) == 0
-     && (compoundOnlyLSymbol=alphabet("<@co:only-L>"_u)) == 0
-     && (compoundOnlyLSymbol=alphabet("<@compound:only-L>"_u)) == 0
-     && (compoundOnlyLSymbol=alphabet("<compound-only-L>"_u)) == 0)
+  if((compoundOnlyLSymbol=model->alphabet("<:co:only-L>"_u)) == 0
+     && (compoundOnlyLSymbol=model->alphabet("<:compound:only-L>"_u)) == 0
+     && (compoundOnlyLSymbol=model->alphabet("<@co:only-L>"_u)) == 0
+     && (compoundOnlyLSymbol=model->alphabet("<@compound:only-L>"_u)) == 0
+     && (compoundOnlyLSymbol=model->alphabet("<compound-only-L>"_u)) == 0)
   {
     std::cerr << "Warning: Decomposition symbol <:compound:only-L> not found" << std::endl;
   }
   else if(!showControlSymbols)
   {
-    alphabet.setSymbol(compoundOnlyLSymbol, ""_u);
+    model->alphabet.setSymbol(compoundOnlyLSymbol, ""_u);
   }
 
-  if((compoundRSymbol=alphabet("<:co:R>"_u)) == 0
-     && (compoundRSymbol=alphabet("<:compound:R>"_u)) == 0
-     && (compoundRSymbol=alphabet("<@co:R>"_u)) == 0
-     && (compoundRSymbol=alphabet("<@compound:R>"_u)) == 0
-     && (compoundRSymbol=alphabet("<compound-R>"_u)) == 0)
+  if((compoundRSymbol=model->alphabet("<:co:R>"_u)) == 0
+     && (compoundRSymbol=model->alphabet("<:compound:R>"_u)) == 0
+     && (compoundRSymbol=model->alphabet("<@co:R>"_u)) == 0
+     && (compoundRSymbol=model->alphabet("<@compound:R>"_u)) == 0
+     && (compoundRSymbol=model->alphabet("<compound-R>"_u)) == 0)
   {
     std::cerr << "Warning: Decomposition symbol <:compound:R> not found" << std::endl;
   }
   else if(!showControlSymbols)
   {
-    alphabet.setSymbol(compoundRSymbol, ""_u);
+    model->alphabet.setSymbol(compoundRSymbol, ""_u);
   }
 }
 
@@ -982,7 +1491,7 @@ FSTProcessor::initDecomposition()
 }
 
 void
-FSTProcessor::analysis(InputFile& input, UFILE *output)
+FSTProcessor::analysis(InputFile& input, OutputFile& output)
 {
   if(getNullFlush())
   {
@@ -1002,14 +1511,74 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
   size_t last_size = 0;  // size of sf at last analysis
   std::map<int, std::set<int> >::iterator rcx_map_ptr;
 
+  UString cache_key;     // word form being read and the character after it
+  size_t key_size = 0;   // size of the word form in cache_key
+  size_t key_end = 0;    // position in input_buffer after cache_key
+  if(analysis_cache.enabled())
+  {
+    analysis_cache.setOptions(analysisOptions());
+  }
+  // store the analysis of sf if the transducers stopped right after the
+  // character that follows it in cache_key
+  auto cacheAnalysis = [&](UString const &analysis, bool known) {
+    if(!cache_key.empty() && input_buffer.getPos() == key_end &&
+       sf.size() == key_size && cache_key.compare(0, key_size, sf) == 0)
+    {
+      analysis_cache.add(cache_key, analysis, known);
+    }
+  };
+
   UChar32 val;
   do
   {
     val = readAnalysis(input);
+
+    if(sf.empty() && analysis_cache.enabled())
+    {
+      cache_key.clear();
+      if(val > 0 && isAlphabetic(val))
+      {
+        size_t const pos = input_buffer.getPos();
+        if(readAnalysisKey(input, val, cache_key, key_size))
+        {
+          bool known = false;
+          UString const *cached = analysis_cache.find(cache_key, known);
+          if(cached != nullptr)
+          {
+            // the same output as when the transducers stopped on the
+            // character after the word form
+            UString word = cache_key.substr(0, key_size);
+            input_buffer.back(1);
+            if(known)
+            {
+              printWordPopBlank(word, *cached, output);
+            }
+            else if(!cached->empty())
+            {
+              printWord(word, *cached, output);
+            }
+            else
+            {
+              printUnknownWord(word, output);
+            }
+            cache_key.clear();
+            last_start = input_buffer.getPos();
+            continue;
+          }
+          key_end = input_buffer.getPos();
+        }
+        else
+        {
+          cache_key.clear();
+        }
+        input_buffer.setPos(pos);
+      }
+    }
+
     // test for final states
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
-      if(current_state.isFinal(inconditional))
+      if(current_state.isFinal(FINAL_INCONDITIONAL))
       {
         if(do_decomposition && compoundOnlyLSymbol != 0)
         {
@@ -1020,7 +1589,7 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
         last = input_buffer.getPos();
         last_size = sf.size();
       }
-      else if(current_state.isFinal(postblank))
+      else if(current_state.isFinal(FINAL_POSTBLANK))
       {
         if(do_decomposition && compoundOnlyLSymbol != 0)
         {
@@ -1031,7 +1600,7 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
         last = input_buffer.getPos();
         last_size = sf.size();
       }
-      else if(current_state.isFinal(preblank))
+      else if(current_state.isFinal(FINAL_PREBLANK))
       {
         if(do_decomposition && compoundOnlyLSymbol != 0)
         {
@@ -1074,17 +1643,17 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
       last_size = sf.size();
     }
 
-    if(useRestoreChars && rcx_map.find(val) != rcx_map.end())
+    if(useRestoreChars && model->rcx_map.find(val) != model->rcx_map.end())
     {
-      rcx_map_ptr = rcx_map.find(val);
+      rcx_map_ptr = model->rcx_map.find(val);
       std::set<int> tmpset = rcx_map_ptr->second;
-      if(!u_isupper(val) || caseSensitive)
+      if(!StringUtils::isupper(val) || caseSensitive)
       {
         current_state.step(val, tmpset);
       }
-      else if(rcx_map.find(u_tolower(val)) != rcx_map.end())
+      else if(model->rcx_map.find(StringUtils::tolower(val)) != model->rcx_map.end())
       {
-        rcx_map_ptr = rcx_map.find(tolower(val));
+        rcx_map_ptr = model->rcx_map.find(tolower(val));
         tmpset.insert(tolower(val));
         tmpset.insert(rcx_map_ptr->second.begin(), rcx_map_ptr->second.end());
         current_state.step(val, tmpset);
@@ -1100,11 +1669,11 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
       current_state.step_case(val, caseSensitive);
     }
 
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
       if(val != 0)
       {
-        alphabet.getSymbol(sf, val);
+        model->alphabet.getSymbol(sf, val);
       }
     }
     else
@@ -1119,7 +1688,7 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
         int oldval = val;
         UString oldsf = sf;
         do {
-          alphabet.getSymbol(sf, val);
+          model->alphabet.getSymbol(sf, val);
         } while ((val = readAnalysis(input)) && isAlphabetic(val));
         lf_spcmp = compoundAnalysis(sf);
         if(lf_spcmp.empty()) {  // didn't work, rewind!
@@ -1145,13 +1714,13 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
       {
         printWordPopBlank(sf.substr(0, last_size),
                           lf, output);
-        u_fputc(' ', output);
+        output.put(' ');
         input_buffer.setPos(last);
         input_buffer.back(1);
       }
       else if(last_preblank)
       {
-        u_fputc(' ', output);
+        output.put(' ');
         printWordPopBlank(sf.substr(0, last_size),
                           lf, output);
         input_buffer.setPos(last);
@@ -1172,7 +1741,7 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
       {
         do
         {
-          alphabet.getSymbol(sf, val);
+          model->alphabet.getSymbol(sf, val);
         }
         while((val = readAnalysis(input)) && isAlphabetic(val));
 
@@ -1184,19 +1753,17 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
         }
         else
         {
-          input_buffer.setPos(last_start + limit.i_codepoint);
           UString unknown_word = sf.substr(0, limit.i_utf16);
+          UString compound;
           if(do_decomposition)
           {
-            UString compound = compoundAnalysis(unknown_word);
-            if(!compound.empty())
-            {
-              printWord(unknown_word, compound, output);
-            }
-            else
-            {
-              printUnknownWord(unknown_word, output);
-            }
+            compound = compoundAnalysis(unknown_word);
+          }
+          cacheAnalysis(compound, false);
+          input_buffer.setPos(last_start + limit.i_codepoint);
+          if(!compound.empty())
+          {
+            printWord(unknown_word, compound, output);
           }
           else
           {
@@ -1214,19 +1781,17 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
         }
         else
         {
-          input_buffer.setPos(last_start + limit.i_codepoint);
           UString unknown_word = sf.substr(0, limit.i_utf16);
+          UString compound;
           if(do_decomposition)
           {
-            UString compound = compoundAnalysis(unknown_word);
-            if(!compound.empty())
-            {
-              printWord(unknown_word, compound, output);
-            }
-            else
-            {
-              printUnknownWord(unknown_word, output);
-            }
+            compound = compoundAnalysis(unknown_word);
+          }
+          cacheAnalysis(compound, false);
+          input_buffer.setPos(last_start + limit.i_codepoint);
+          if(!compound.empty())
+          {
+            printWord(unknown_word, compound, output);
           }
           else
           {
@@ -1236,6 +1801,10 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
       }
       else
       {
+        if(last_size == sf.size())
+        {
+          cacheAnalysis(lf, true);
+        }
         printWordPopBlank(sf.substr(0, last_size),
                           lf, output);
         input_buffer.setPos(last);
@@ -1263,14 +1832,14 @@ FSTProcessor::analysis(InputFile& input, UFILE *output)
 }
 
 void
-FSTProcessor::analysis_wrapper_null_flush(InputFile& input, UFILE *output)
+FSTProcessor::analysis_wrapper_null_flush(InputFile& input, OutputFile& output)
 {
   setNullFlush(false);
   while(!input.eof())
   {
     analysis(input, output);
-    u_fputc('\0', output);
-    u_fflush(output);
+    output.putNull();
+    output.flush();
     // analysis() doesn't always leave input_buffer empty
     // which results in repeatedly analyzing the same string
     // so clear it here
@@ -1279,7 +1848,7 @@ FSTProcessor::analysis_wrapper_null_flush(InputFile& input, UFILE *output)
 }
 
 void
-FSTProcessor::generation_wrapper_null_flush(InputFile& input, UFILE *output,
+FSTProcessor::generation_wrapper_null_flush(InputFile& input, OutputFile& output,
                                             GenerationMode mode)
 {
   setNullFlush(false);
@@ -1288,13 +1857,13 @@ FSTProcessor::generation_wrapper_null_flush(InputFile& input, UFILE *output,
   while(!input.eof())
   {
     generation(input, output, mode);
-    u_fputc('\0', output);
-    u_fflush(output);
+    output.putNull();
+    output.flush();
   }
 }
 
 void
-FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
+FSTProcessor::tm_analysis(InputFile& input, OutputFile& output)
 {
   State current_state = initial_state;
   UString lf;     //lexical form
@@ -1304,11 +1873,11 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
   while(int32_t val = readTMAnalysis(input))
   {
     // test for final states
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
       if(u_ispunct(val))
       {
-        lf = current_state.filterFinalsTM(all_finals, alphabet,
+        lf = current_state.filterFinalsTM(model->all_finals, model->alphabet,
                                           escaped_chars,
                                           blankqueue, numbers).substr(1);
         last = input_buffer.getPos();
@@ -1323,7 +1892,7 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
 
     current_state.step_case(val, false);
 
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
       if(val == -1)
       {
@@ -1335,7 +1904,7 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
       }
       else
       {
-        alphabet.getSymbol(sf, val);
+        model->alphabet.getSymbol(sf, val);
       }
     }
     else
@@ -1350,9 +1919,9 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
         {
           if(isEscaped(val))
           {
-            u_fputc('\\', output);
+            output.put('\\');
           }
-          u_fputc(val, output);
+          output.put(val);
         }
       }
       else if(!u_isspace(val) && !u_ispunct(val) &&
@@ -1372,19 +1941,19 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
           }
           else
           {
-            alphabet.getSymbol(sf, val);
+            model->alphabet.getSymbol(sf, val);
           }
         }
         while((val = readTMAnalysis(input)) && !u_isspace(val) && !u_ispunct(val));
 
         if(val == 0)
         {
-          write(sf, output);
+          output.write(sf);
           return;
         }
 
         input_buffer.back(1);
-        write(sf, output);
+        output.write(sf);
 
         while(blankqueue.size() > 0)
         {
@@ -1400,7 +1969,7 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
         unsigned int size = sf.size();
         limit = (limit == static_cast<unsigned int>(UString::npos)?size:limit);
         input_buffer.back(1+(size-limit));
-        write(sf.substr(0, limit), output);
+        output.write(sf.substr(0, limit));
 */      }
       else if(lf.empty())
       {
@@ -1408,10 +1977,10 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
         unsigned int size = sf.size();
         limit = (limit == static_cast<unsigned int >(UString::npos)?size:limit);
         input_buffer.back(1+(size-limit));
-        write(sf.substr(0, limit), output);
+        output.write(sf.substr(0, limit));
 */
         input_buffer.back(1);
-        write(sf, output);
+        output.write(sf);
 
         while(blankqueue.size() > 0)
         {
@@ -1425,7 +1994,9 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
       }
       else
       {
-        u_fprintf(output, "[%S]", lf.c_str());
+        output.put('[');
+        output.write(lf);
+        output.put(']');
         input_buffer.setPos(last);
         input_buffer.back(1);
       }
@@ -1442,7 +2013,7 @@ FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
 
 
 void
-FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
+FSTProcessor::generation(InputFile& input, OutputFile& output, GenerationMode mode)
 {
   if(getNullFlush())
   {
@@ -1452,16 +2023,22 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
   State current_state = initial_state;
   UString sf;
 
-  outOfWord = false;
-
-  skipUntil(input, output, '^');
+  if(input.binaryStream())
+  {
+    outOfWord = true;
+  }
+  else
+  {
+    outOfWord = false;
+    skipUntil(input, output, '^');
+  }
   int val;
 
   while((val = readGeneration(input, output)) != 0x7fffffff)
   {
     if(sf.empty() && val == '=')
     {
-      u_fputc('=', output);
+      output.put('=');
       val = readGeneration(input, output);
     }
 
@@ -1479,11 +2056,11 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
         }
         else if(mode == gm_tagged_nm)
         {
-          u_fputc('^', output);
+          output.put('^');
           writeEscaped(removeTags(sf.substr(1)), output);
-          u_fputc('/', output);
+          output.put('/');
           writeEscapedWithTags(sf, output);
-          u_fputc('$', output);
+          output.put('$');
         }
       }
       else if(sf[0] == '@')
@@ -1506,14 +2083,14 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
         }
         else if(mode == gm_tagged_nm)
         {
-          u_fputc('^', output);
+          output.put('^');
           writeEscaped(removeTags(sf.substr(1)), output);
-          u_fputc('/', output);
+          output.put('/');
           writeEscapedWithTags(sf, output);
-          u_fputc('$', output);
+          output.put('$');
         }
       }
-      else if(current_state.isFinal(all_finals))
+      else if(current_state.isFinal(FINAL_ANY))
       {
         bool firstupper = false, uppercase = false;
         if(!dictionaryCase)
@@ -1524,18 +2101,18 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
 
         if(mode == gm_tagged || mode == gm_tagged_nm)
         {
-          u_fputc('^', output);
+          output.put('^');
         }
 
-        write(current_state.filterFinals(all_finals, alphabet,
-                                         escaped_chars,
-                                         displayWeightsMode, maxAnalyses, maxWeightClasses,
-                                         uppercase, firstupper).substr(1), output);
+        output.write(current_state.filterFinals(FINAL_ANY, model->alphabet,
+                                                escaped_chars,
+                                                displayWeightsMode, maxAnalyses, maxWeightClasses,
+                                                uppercase, firstupper).substr(1));
         if(mode == gm_tagged || mode == gm_tagged_nm)
         {
-          u_fputc('/', output);
+          output.put('/');
           writeEscapedWithTags(sf, output);
-          u_fputc('$', output);
+          output.put('$');
         }
 
       }
@@ -1543,7 +2120,7 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
       {
         if(mode == gm_all)
         {
-          u_fputc('#', output);
+          output.put('#');
           writeEscaped(sf, output);
         }
         else if(mode == gm_clean)
@@ -1554,23 +2131,23 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
         {
           if(!sf.empty())
           {
-            u_fputc('#', output);
+            output.put('#');
             writeEscaped(removeTags(sf), output);
           }
         }
         else if(mode == gm_tagged)
         {
-          u_fputc('#', output);
+          output.put('#');
           writeEscaped(removeTags(sf), output);
         }
         else if(mode == gm_tagged_nm)
         {
-          u_fputc('^', output);
+          output.put('^');
           writeEscaped(removeTags(sf), output);
-          u_fputc('/', output);
-          u_fputc('#', output);
+          output.put('/');
+          output.put('#');
           writeEscapedWithTags(sf, output);
-          u_fputc('$', output);
+          output.put('$');
         }
       }
 
@@ -1583,22 +2160,22 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
     }
     else if(sf.size() > 0 && (sf[0] == '*' || sf[0] == '%' ))
     {
-      alphabet.getSymbol(sf, val);
+      model->alphabet.getSymbol(sf, val);
     }
     else
     {
-      alphabet.getSymbol(sf,val);
-      if(current_state.size() > 0)
+      model->alphabet.getSymbol(sf,val);
+      if(!current_state.isEmpty())
       {
-        if(!alphabet.isTag(val) && u_isupper(val) && !caseSensitive)
+        if(!model->alphabet.isTag(val) && StringUtils::isupper(val) && !caseSensitive)
         {
           if(mode == gm_carefulcase)
           {
-            current_state.step_careful(val, u_tolower(val));
+            current_state.step_careful(val, StringUtils::tolower(val));
           }
           else
           {
-            current_state.step(val, u_tolower(val));
+            current_state.step(val, StringUtils::tolower(val));
           }
         }
         else
@@ -1611,21 +2188,21 @@ FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
 }
 
 void
-FSTProcessor::postgeneration(InputFile& input, UFILE *output)
+FSTProcessor::postgeneration(InputFile& input, OutputFile& output)
 {
   transliteration_drop_tilde = true;
   transliteration(input, output);
 }
 
 void
-FSTProcessor::intergeneration(InputFile& input, UFILE *output)
+FSTProcessor::intergeneration(InputFile& input, OutputFile& output)
 {
   transliteration_drop_tilde = false;
   transliteration(input, output);
 }
 
 void
-FSTProcessor::transliteration(InputFile& input, UFILE *output)
+FSTProcessor::transliteration(InputFile& input, OutputFile& output)
 {
   size_t start_pos = 0;
   size_t cur_word = 0;
@@ -1650,15 +2227,15 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
         if (input.eof()) {
           break;
         } else {
-          u_fputc(input.get(), output);
-          u_fflush(output);
+          output.put(input.get());
+          output.flush();
           continue;
         }
       }
     }
 
-    if (current_state.isFinal(all_finals)) {
-      last_match = current_state.filterFinals(all_finals, alphabet,
+    if (current_state.isFinal(FINAL_ANY)) {
+      last_match = current_state.filterFinals(FINAL_ANY, model->alphabet,
                                               escaped_chars, displayWeightsMode,
                                               1, maxWeightClasses,
                                               uppercase, firstupper);
@@ -1710,7 +2287,7 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
     if (isAlphabetic(sym)) {
       if (!have_first) {
         have_first = true;
-        if (u_isupper(sym)) {
+        if (StringUtils::isupper(sym)) {
           firstupper = true;
         } else {
           firstupper = false;
@@ -1718,17 +2295,17 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
         }
       } else if (!have_second) {
         have_second = true;
-        uppercase = u_isupper(sym);
+        uppercase = StringUtils::isupper(sym);
       }
     }
 
     current_state.step_case_override(sym, caseSensitive);
 
-    if (current_state.size() == 0 || is_end) {
+    if (current_state.isEmpty() || is_end) {
       if (last_match.empty()) {
         start_pos++;
       } else {
-        std::vector<int32_t> match = alphabet.tokenize(last_match.substr(1));
+        std::vector<int32_t> match = model->alphabet.tokenize(last_match.substr(1));
         last_match.clear();
         std::vector<int32_t> word = transliteration_queue.front();
         transliteration_queue.pop_front();
@@ -1759,10 +2336,10 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
         cur_word = 0;
       }
       if (start_pos >= transliteration_queue.front().size()) {
-        write(blankqueue.front(), output);
+        output.write(blankqueue.front());
         blankqueue.pop();
         bool has_wblank = !wblankqueue.front().empty();
-        write(wblankqueue.front(), output);
+        output.write(wblankqueue.front());
         wblankqueue.pop_front();
         auto word = transliteration_queue.front();
         transliteration_queue.pop_front();
@@ -1787,16 +2364,16 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
             if (c > 0 && isEscaped(c)) {
               out += '\\';
             }
-            alphabet.getSymbol(out, c);
+            model->alphabet.getSymbol(out, c);
           }
         }
-        write(out, output);
+        output.write(out);
         if (has_wblank) {
-          write(WBLANK_FINAL, output);
+          output.write(WBLANK_FINAL);
         }
         while (space_diff < 0) {
           if (blankqueue.front() != " "_u) {
-            write(blankqueue.front(), output);
+            output.write(blankqueue.front());
           }
           blankqueue.pop();
           space_diff++;
@@ -1816,8 +2393,94 @@ FSTProcessor::transliteration(InputFile& input, UFILE *output)
   }
 }
 
+UString
+FSTProcessor::biltransKey(int kind, bool with_delim, UString const &input_word) const
+{
+  UString key;
+  key.reserve(input_word.size() + 6);
+  key += static_cast<UChar>(kind * 2 + with_delim);
+  key += static_cast<UChar>(caseSensitive * 2 + displayWeightsMode);
+  key += static_cast<UChar>(maxAnalyses >> 16);
+  key += static_cast<UChar>(maxAnalyses);
+  key += static_cast<UChar>(maxWeightClasses >> 16);
+  key += static_cast<UChar>(maxWeightClasses);
+  key.append(input_word);
+  return key;
+}
+
+UString
+FSTProcessor::biltrans(UString const &input_word, bool with_delim)
+{
+  if(!biltrans_cache)
+  {
+    return lookupBiltrans(input_word, with_delim);
+  }
+  UString const key = biltransKey(BiltransCache::BILTRANS, with_delim, input_word);
+  UString result;
+  int queue_length = 0;
+  if(!biltrans_cache->find(key, result, queue_length))
+  {
+    result = lookupBiltrans(input_word, with_delim);
+    biltrans_cache->add(key, result, 0);
+  }
+  return result;
+}
+
 UString
 FSTProcessor::biltransfull(UString const &input_word, bool with_delim)
+{
+  if(!biltrans_cache)
+  {
+    return lookupBiltransfull(input_word, with_delim);
+  }
+  UString const key = biltransKey(BiltransCache::BILTRANSFULL, with_delim, input_word);
+  UString result;
+  int queue_length = 0;
+  if(!biltrans_cache->find(key, result, queue_length))
+  {
+    result = lookupBiltransfull(input_word, with_delim);
+    biltrans_cache->add(key, result, 0);
+  }
+  return result;
+}
+
+std::pair<UString, int>
+FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
+{
+  if(!biltrans_cache)
+  {
+    return lookupBiltransWithQueue(input_word, with_delim);
+  }
+  UString const key = biltransKey(BiltransCache::WITH_QUEUE, with_delim, input_word);
+  std::pair<UString, int> result;
+  if(!biltrans_cache->find(key, result.first, result.second))
+  {
+    result = lookupBiltransWithQueue(input_word, with_delim);
+    biltrans_cache->add(key, result.first, result.second);
+  }
+  return result;
+}
+
+UString
+FSTProcessor::biltransWithoutQueue(UString const &input_word, bool with_delim)
+{
+  if(!biltrans_cache)
+  {
+    return lookupBiltransWithoutQueue(input_word, with_delim);
+  }
+  UString const key = biltransKey(BiltransCache::WITHOUT_QUEUE, with_delim, input_word);
+  UString result;
+  int queue_length = 0;
+  if(!biltrans_cache->find(key, result, queue_length))
+  {
+    result = lookupBiltransWithoutQueue(input_word, with_delim);
+    biltrans_cache->add(key, result, 0);
+  }
+  return result;
+}
+
+UString
+FSTProcessor::lookupBiltransfull(UString const &input_word, bool with_delim)
 {
   State current_state = initial_state;
   UString result;
@@ -1868,24 +2531,24 @@ FSTProcessor::biltransfull(UString const &input_word, bool with_delim)
           break;
         }
       }
-      val = alphabet(symbol);
+      val = tagSymbol(symbol);
     }
     else
     {
       val = static_cast<int32_t>(input_word[i]);
     }
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
-      if(!alphabet.isTag(val) && u_isupper(val) && !caseSensitive)
+      if(!model->alphabet.isTag(val) && StringUtils::isupper(val) && !caseSensitive)
       {
-        current_state.step(val, u_tolower(val));
+        current_state.step(val, StringUtils::tolower(val));
       }
       else
       {
         current_state.step(val);
       }
     }
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
       result.clear();
       if(with_delim) {
@@ -1894,13 +2557,13 @@ FSTProcessor::biltransfull(UString const &input_word, bool with_delim)
       if(mark) {
         result += '=';
       }
-      result += current_state.filterFinals(all_finals, alphabet,
+      result += current_state.filterFinals(FINAL_ANY, model->alphabet,
                                            escaped_chars,
                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
                                            uppercase, firstupper, 0).substr(1);
     }
 
-    if(current_state.size() == 0)
+    if(current_state.isEmpty())
     {
       if(!symbol.empty() && !result.empty())
       {
@@ -1970,7 +2633,7 @@ FSTProcessor::biltransfull(UString const &input_word, bool with_delim)
 
 
 UString
-FSTProcessor::biltrans(UString const &input_word, bool with_delim)
+FSTProcessor::lookupBiltrans(UString const &input_word, bool with_delim)
 {
   State current_state = initial_state;
   UString result;
@@ -2021,24 +2684,24 @@ FSTProcessor::biltrans(UString const &input_word, bool with_delim)
           break;
         }
       }
-      val = alphabet(symbol);
+      val = tagSymbol(symbol);
     }
     else
     {
       val = static_cast<int32_t>(input_word[i]);
     }
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
-      if(!alphabet.isTag(val) && u_isupper(val) && !caseSensitive)
+      if(!model->alphabet.isTag(val) && StringUtils::isupper(val) && !caseSensitive)
       {
-        current_state.step(val, u_tolower(val));
+        current_state.step(val, StringUtils::tolower(val));
       }
       else
       {
         current_state.step(val);
       }
     }
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
       result.clear();
       if (with_delim) {
@@ -2047,13 +2710,13 @@ FSTProcessor::biltrans(UString const &input_word, bool with_delim)
       if (mark) {
         result += '=';
       }
-      result += current_state.filterFinals(all_finals, alphabet,
+      result += current_state.filterFinals(FINAL_ANY, model->alphabet,
                                            escaped_chars,
                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
                                            uppercase, firstupper, 0).substr(1);
     }
 
-    if(current_state.size() == 0)
+    if(current_state.isEmpty())
     {
       if(!symbol.empty() && !result.empty())
       {
@@ -2117,7 +2780,7 @@ FSTProcessor::biltrans(UString const &input_word, bool with_delim)
 }
 
 void
-FSTProcessor::bilingual_wrapper_null_flush(InputFile& input, UFILE *output, GenerationMode mode)
+FSTProcessor::bilingual_wrapper_null_flush(InputFile& input, OutputFile& output, GenerationMode mode)
 {
   setNullFlush(false);
   nullFlushGeneration = true;
@@ -2125,8 +2788,8 @@ FSTProcessor::bilingual_wrapper_null_flush(InputFile& input, UFILE *output, Gene
   while(!input.eof())
   {
     bilingual(input, output, mode);
-    u_fputc('\0', output);
-    u_fflush(output);
+    output.putNull();
+    output.flush();
   }
 }
 
@@ -2156,7 +2819,7 @@ FSTProcessor::compose(UString const &lexforms, UString const &queue) const
 }
 
 void
-FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
+FSTProcessor::bilingual(InputFile& input, OutputFile& output, GenerationMode mode)
 {
   if(getNullFlush())
   {
@@ -2168,9 +2831,15 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
   UString queue;                // symbols to be added to each target
   UString result;               // result of looking up analysis in bidix
 
-  outOfWord = false;
-
-  skipUntil(input, output, '^');
+  if(input.binaryStream())
+  {
+    outOfWord = true;
+  }
+  else
+  {
+    outOfWord = false;
+    skipUntil(input, output, '^');
+  }
   std::pair<UString,int> tr;           // readBilingual return value, containing:
   int val;                        // the alphabet value of current symbol, and
   UString symbol;           // the current symbol as a string
@@ -2179,6 +2848,56 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
   bool seensurface = false;
   UString surface;
 
+  // step through the bidix with a symbol of sf; sf_size is the size
+  // sf had after it was added
+  auto step = [&](int val, UString const &symbol, size_t sf_size) {
+    if(!current_state.isEmpty())
+    {
+      current_state.step_case(val, caseSensitive);
+    }
+    if(current_state.isFinal(FINAL_ANY))
+    {
+      bool uppercase = sf_size > 1 && u_isupper(sf[1]);
+      bool firstupper= u_isupper(sf[0]);
+
+      queue.clear(); // the intervening tags were matched
+      result = current_state.filterFinals(FINAL_ANY, model->alphabet,
+                                          escaped_chars,
+                                          displayWeightsMode, maxAnalyses, maxWeightClasses,
+                                          uppercase, firstupper, 0);
+    }
+    else if(!result.empty())
+    {
+      // We already have a result, but there is still more to read
+      // of the analysis; following tags are not consumed, but
+      // output as target language tags (added to result on
+      // end-of-word). This queue is reset if result is changed.
+      if(model->alphabet.isTag(val)) // known tag
+      {
+        model->alphabet.getSymbol(queue, val);
+      }
+      else if (val == 0) // non-alphabetic, possibly unknown tag
+      {
+        queue += symbol;
+      }
+      else if(current_state.isEmpty())
+      {
+        // There are no more alive transductions and the current symbol is not a tag -- unknown word!
+        result.clear();
+      }
+    }
+  };
+
+  // with biltrans_cache, the steps are only taken at the end of the
+  // lexical unit if its result is not stored
+  struct Step
+  {
+    int val;
+    UString symbol;
+    size_t sf_size;
+  };
+  std::vector<Step> steps;
+
   while(true)                   // ie. while(val != 0x7fffffff)
   {
     tr = readBilingual(input, output);
@@ -2191,7 +2910,7 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
       while(val != '/' && val != 0x7fffffff)
       {
         surface = surface + symbol;
-        alphabet.getSymbol(surface, val);
+        model->alphabet.getSymbol(surface, val);
         tr = readBilingual(input, output);
         symbol = tr.first;
         val = tr.second;
@@ -2210,15 +2929,40 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
 
     if(val == '$' && outOfWord)
     {
-      if(!seentags)        // if no tags: only return complete matches
+      UString target;           // composed result, empty if not found
+      if(sf[0] != '*')
       {
-        bool uppercase = sf.size() > 1 && u_isupper(sf[1]);
-        bool firstupper= u_isupper(sf[0]);
+        UString key;
+        int queue_length = 0;
+        if(biltrans_cache)
+        {
+          key = biltransKey(BiltransCache::BILINGUAL, true, sf);
+        }
+        if(!biltrans_cache || !biltrans_cache->find(key, target, queue_length))
+        {
+          for(auto const &s : steps)
+          {
+            step(s.val, s.symbol, s.sf_size);
+          }
+          if(!seentags)        // if no tags: only return complete matches
+          {
+            bool uppercase = sf.size() > 1 && u_isupper(sf[1]);
+            bool firstupper= u_isupper(sf[0]);
 
-        result = current_state.filterFinals(all_finals, alphabet,
-                                            escaped_chars,
-                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
-                                            uppercase, firstupper, 0);
+            result = current_state.filterFinals(FINAL_ANY, model->alphabet,
+                                                escaped_chars,
+                                                displayWeightsMode, maxAnalyses, maxWeightClasses,
+                                                uppercase, firstupper, 0);
+          }
+          if(!result.empty())
+          {
+            target = compose(result, queue);
+          }
+          if(biltrans_cache)
+          {
+            biltrans_cache->add(key, target, queue.size());
+          }
+        }
       }
 
       if(sf[0] == '*')
@@ -2230,9 +2974,9 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
           printWordBilingual(sf, "/"_u + sf, output);
         }
       }
-      else if(!result.empty())
+      else if(!target.empty())
       {
-        printWordBilingual(sf, compose(result, queue), output);
+        printWordBilingual(sf, target, output);
       }
       else
       { //xxx
@@ -2252,6 +2996,7 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
       result.clear();
       current_state = initial_state;
       sf.clear();
+      steps.clear();
       seentags = false;
     }
     else if(u_isspace(val) && sf.size() == 0)
@@ -2264,7 +3009,7 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
       {
         sf += '\\';
       }
-      alphabet.getSymbol(sf, val); // add symbol to sf iff alphabetic
+      model->alphabet.getSymbol(sf, val); // add symbol to sf iff alphabetic
       if(val == 0)  // non-alphabetic, possibly unknown tag; add to sf
       {
         sf += symbol;
@@ -2276,56 +3021,29 @@ FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
       {
         sf += '\\';
       }
-      alphabet.getSymbol(sf, val); // add symbol to sf iff alphabetic
+      model->alphabet.getSymbol(sf, val); // add symbol to sf iff alphabetic
       if(val == 0)  // non-alphabetic, possibly unknown tag; add to sf
       {
         sf += symbol;
       }
-      if(alphabet.isTag(val) || val == 0)
+      if(model->alphabet.isTag(val) || val == 0)
       {
         seentags = true;
       }
-      if(current_state.size() != 0)
+      if(biltrans_cache)
       {
-        current_state.step_case(val, caseSensitive);
+        steps.push_back({val, val == 0 ? symbol : UString(), sf.size()});
       }
-      if(current_state.isFinal(all_finals))
-      {
-        bool uppercase = sf.size() > 1 && u_isupper(sf[1]);
-        bool firstupper= u_isupper(sf[0]);
-
-        queue.clear(); // the intervening tags were matched
-        result = current_state.filterFinals(all_finals, alphabet,
-                                            escaped_chars,
-                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
-                                            uppercase, firstupper, 0);
-      }
-      else if(!result.empty())
+      else
       {
-        // We already have a result, but there is still more to read
-        // of the analysis; following tags are not consumed, but
-        // output as target language tags (added to result on
-        // end-of-word). This queue is reset if result is changed.
-        if(alphabet.isTag(val)) // known tag
-        {
-          alphabet.getSymbol(queue, val);
-        }
-        else if (val == 0) // non-alphabetic, possibly unknown tag
-        {
-          queue += symbol;
-        }
-        else if(current_state.size() == 0)
-        {
-          // There are no more alive transductions and the current symbol is not a tag -- unknown word!
-          result.clear();
-        }
+        step(val, symbol, sf.size());
       }
     }
   }
 }
 
 std::pair<UString, int>
-FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
+FSTProcessor::lookupBiltransWithQueue(UString const &input_word, bool with_delim)
 {
   State current_state = initial_state;
   UString result;
@@ -2378,24 +3096,24 @@ FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
           break;
         }
       }
-      val = alphabet(symbol);
+      val = tagSymbol(symbol);
     }
     else
     {
       val = input_word[i];
     }
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
-      if(!alphabet.isTag(val) && u_isupper(val) && !caseSensitive)
+      if(!model->alphabet.isTag(val) && StringUtils::isupper(val) && !caseSensitive)
       {
-        current_state.step(val, u_tolower(val));
+        current_state.step(val, StringUtils::tolower(val));
       }
       else
       {
         current_state.step(val);
       }
     }
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
       result.clear();
       if (with_delim) {
@@ -2404,13 +3122,13 @@ FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
       if (mark) {
         result += '=';
       }
-      result += current_state.filterFinals(all_finals, alphabet,
+      result += current_state.filterFinals(FINAL_ANY, model->alphabet,
                                            escaped_chars,
                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
                                            uppercase, firstupper, 0).substr(1);
     }
 
-    if(current_state.size() == 0)
+    if(current_state.isEmpty())
     {
       if(!symbol.empty() && !result.empty())
       {
@@ -2433,7 +3151,7 @@ FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
   }
 
   if (!seentags
-      && current_state.filterFinals(all_finals, alphabet, escaped_chars,
+      && current_state.filterFinals(FINAL_ANY, model->alphabet, escaped_chars,
                                     displayWeightsMode, maxAnalyses, maxWeightClasses,
                                     uppercase, firstupper, 0).empty())
   {
@@ -2493,7 +3211,7 @@ FSTProcessor::biltransWithQueue(UString const &input_word, bool with_delim)
 }
 
 UString
-FSTProcessor::biltransWithoutQueue(UString const &input_word, bool with_delim)
+FSTProcessor::lookupBiltransWithoutQueue(UString const &input_word, bool with_delim)
 {
   State current_state = initial_state;
   UString result;
@@ -2543,24 +3261,24 @@ FSTProcessor::biltransWithoutQueue(UString const &input_word, bool with_delim)
           break;
         }
       }
-      val = alphabet(symbol);
+      val = tagSymbol(symbol);
     }
     else
     {
       val = static_cast<int32_t>(input_word[i]);
     }
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
-      if(!alphabet.isTag(val) && u_isupper(val) && !caseSensitive)
+      if(!model->alphabet.isTag(val) && StringUtils::isupper(val) && !caseSensitive)
       {
-        current_state.step(val, u_tolower(val));
+        current_state.step(val, StringUtils::tolower(val));
       }
       else
       {
         current_state.step(val);
       }
     }
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
       result.clear();
       if (with_delim) {
@@ -2569,13 +3287,13 @@ FSTProcessor::biltransWithoutQueue(UString const &input_word, bool with_delim)
       if (mark) {
         result += '=';
       }
-      result += current_state.filterFinals(all_finals, alphabet,
+      result += current_state.filterFinals(FINAL_ANY, model->alphabet,
                                            escaped_chars,
                                            displayWeightsMode, maxAnalyses, maxWeightClasses,
                                            uppercase, firstupper, 0).substr(1);
     }
 
-    if(current_state.size() == 0)
+    if(current_state.isEmpty())
     {
       if(symbol.empty())
       {
@@ -2604,7 +3322,7 @@ FSTProcessor::biltransWithoutQueue(UString const &input_word, bool with_delim)
 bool
 FSTProcessor::valid() const
 {
-  if(initial_state.isFinal(all_finals))
+  if(initial_state.isFinal(FINAL_ANY))
   {
     std::cerr << "Error: Invalid dictionary (hint: the left side of an entry is empty)" << std::endl;
     return false;
@@ -2678,20 +3396,14 @@ FSTProcessor::readSAO(InputFile& input)
 }
 
 void
-FSTProcessor::printSAOWord(UString const &lf, UFILE *output)
+FSTProcessor::printSAOWord(UString const &lf, OutputFile& output)
 {
-  for(unsigned int i = 1, limit = lf.size(); i != limit; i++)
-  {
-    if(lf[i] == '/')
-    {
-      break;
-    }
-    u_fputc(lf[i], output);
-  }
+  size_t const limit = lf.find('/', 1);
+  output.write(lf.substr(1, limit == UString::npos ? UString::npos : limit - 1));
 }
 
 void
-FSTProcessor::SAO(InputFile& input, UFILE *output)
+FSTProcessor::SAO(InputFile& input, OutputFile& output)
 {
   bool last_incond = false;
   bool last_postblank = false;
@@ -2708,25 +3420,25 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
   while(UChar32 val = readSAO(input))
   {
     // test for final states
-    if(current_state.isFinal(all_finals))
+    if(current_state.isFinal(FINAL_ANY))
     {
-      if(current_state.isFinal(inconditional))
+      if(current_state.isFinal(FINAL_INCONDITIONAL))
       {
         bool firstupper = u_isupper(sf[0]);
         bool uppercase = firstupper && u_isupper(sf[sf.size()-1]);
 
-        lf = current_state.filterFinalsSAO(all_finals, alphabet,
+        lf = current_state.filterFinalsSAO(model->all_finals, model->alphabet,
                                         escaped_chars,
                                         uppercase, firstupper);
         last_incond = true;
         last = input_buffer.getPos();
       }
-      else if(current_state.isFinal(postblank))
+      else if(current_state.isFinal(FINAL_POSTBLANK))
       {
         bool firstupper = u_isupper(sf[0]);
         bool uppercase = firstupper && u_isupper(sf[sf.size()-1]);
 
-        lf = current_state.filterFinalsSAO(all_finals, alphabet,
+        lf = current_state.filterFinalsSAO(model->all_finals, model->alphabet,
                                         escaped_chars,
                                         uppercase, firstupper);
         last_postblank = true;
@@ -2737,7 +3449,7 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
         bool firstupper = u_isupper(sf[0]);
         bool uppercase = firstupper && u_isupper(sf[sf.size()-1]);
 
-        lf = current_state.filterFinalsSAO(all_finals, alphabet,
+        lf = current_state.filterFinalsSAO(model->all_finals, model->alphabet,
                                         escaped_chars,
                                         uppercase, firstupper);
         last_postblank = false;
@@ -2756,9 +3468,9 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
 
     current_state.step_case(val, caseSensitive);
 
-    if(current_state.size() != 0)
+    if(!current_state.isEmpty())
     {
-      alphabet.getSymbol(sf, val);
+      model->alphabet.getSymbol(sf, val);
     }
     else
     {
@@ -2772,9 +3484,9 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
         {
           if(isEscaped(val))
           {
-            u_fputc('\\', output);
+            output.put('\\');
           }
-          u_fputc(val, output);
+          output.put(val);
         }
       }
       else if(last_incond)
@@ -2786,7 +3498,7 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
       else if(last_postblank)
       {
         printSAOWord(lf, output);
-        u_fputc(' ', output);
+        output.put(' ');
         input_buffer.setPos(last);
         input_buffer.back(1);
       }
@@ -2796,21 +3508,25 @@ FSTProcessor::SAO(InputFile& input, UFILE *output)
       {
         do
         {
-          alphabet.getSymbol(sf, val);
+          model->alphabet.getSymbol(sf, val);
         }
         while((val = readSAO(input)) && isAlphabetic(val));
 
         auto limit = firstNotAlpha(sf);
         unsigned int size = sf.size(); // TODO: change these to character counts
         input_buffer.back(1+(size-limit.i_utf16));
-        u_fprintf(output, "<d>%S</d>", sf.c_str());
+        output.write("<d>"_u);
+        output.write(sf);
+        output.write("</d>"_u);
       }
       else if(lf.empty())
       {
         auto limit = firstNotAlpha(sf);
         unsigned int size = sf.size(); // TODO: change these to character counts
         input_buffer.back(1+(size-limit.i_utf16));
-        u_fprintf(output, "<d>%S</d>", sf.c_str());
+        output.write("<d>"_u);
+        output.write(sf);
+        output.write("</d>"_u);
       }
       else
       {
@@ -2906,6 +3622,61 @@ FSTProcessor::setMaxWeightClassesValue(int const value)
   maxWeightClasses = value;
 }
 
+void
+FSTProcessor::setPruningMode(bool const value)
+{
+  pruningMode = value;
+}
+
+void
+FSTProcessor::setDFACacheSize(int const value)
+{
+  dfa_cache.reset(value);
+}
+
+void
+FSTProcessor::setAnalysisCacheSize(int const value)
+{
+  analysis_cache.reset(value);
+}
+
+size_t
+FSTProcessor::getAnalysisCacheHits() const
+{
+  return analysis_cache.hits();
+}
+
+size_t
+FSTProcessor::getAnalysisCacheMisses() const
+{
+  return analysis_cache.misses();
+}
+
+void
+FSTProcessor::setBiltransCacheSize(int const value)
+{
+  if(value > 0)
+  {
+    biltrans_cache = std::make_shared<BiltransCache>(value);
+  }
+  else
+  {
+    biltrans_cache.reset();
+  }
+}
+
+size_t
+FSTProcessor::getBiltransCacheHits() const
+{
+  return biltrans_cache ? biltrans_cache->hits() : 0;
+}
+
+size_t
+FSTProcessor::getBiltransCacheMisses() const
+{
+  return biltrans_cache ? biltrans_cache->misses() : 0;
+}
+
 bool
 FSTProcessor::getDecompoundingMode()
 {
@@ -2937,3 +3708,67 @@ FSTProcessor::firstNotAlpha(UString const &sf)
   }
   return ix;
 }
+
+void
+FSTProcessor::analysis(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  analysis(input, out);
+}
+
+void
+FSTProcessor::tm_analysis(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  tm_analysis(input, out);
+}
+
+void
+FSTProcessor::generation(InputFile& input, UFILE *output, GenerationMode mode)
+{
+  OutputFile out;
+  out.wrap(output);
+  generation(input, out, mode);
+}
+
+void
+FSTProcessor::postgeneration(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  postgeneration(input, out);
+}
+
+void
+FSTProcessor::intergeneration(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  intergeneration(input, out);
+}
+
+void
+FSTProcessor::transliteration(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  transliteration(input, out);
+}
+
+void
+FSTProcessor::bilingual(InputFile& input, UFILE *output, GenerationMode mode)
+{
+  OutputFile out;
+  out.wrap(output);
+  bilingual(input, out, mode);
+}
+
+void
+FSTProcessor::SAO(InputFile& input, UFILE *output)
+{
+  OutputFile out;
+  out.wrap(output);
+  SAO(input, out);
+}
@@ -22,14 +22,21 @@
 #include <unicode/uchriter.h>
 #include <lttoolbox/alphabet.h>
 #include <lttoolbox/buffer.h>
+#include <lttoolbox/analysis_cache.h>
+#include <lttoolbox/biltrans_cache.h>
+#include <lttoolbox/dfa_cache.h>
+#include <lttoolbox/file_utils.h>
 #include <lttoolbox/my_stdio.h>
 #include <lttoolbox/state.h>
 #include <lttoolbox/trans_exe.h>
 #include <lttoolbox/input_file.h>
+#include <lttoolbox/output_file.h>
 #include <libxml/xmlreader.h>
 
 #include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <queue>
 #include <set>
 #include <string>
@@ -55,9 +62,65 @@ class FSTProcessor
 {
 private:
   /**
-   * Transducers in FSTP
-   */
-  std::map<UString, TransExe> transducers;
+   * What load(), parseICX(), parseRCX() and the init functions set up,
+   * which processing only reads, shared by a processor, its copies and
+   * its sessions
+   */
+  struct Model
+  {
+    /**
+     * Transducers in FSTP
+     */
+    std::map<UString, TransExe> transducers;
+
+    /**
+     * The final states of inconditional, standard, postblank and
+     * preblank sections in the dictionaries, and their merge
+     */
+    std::map<Node *, double> inconditional;
+    std::map<Node *, double> standard;
+    std::map<Node *, double> postblank;
+    std::map<Node *, double> preblank;
+    std::map<Node *, double> all_finals;
+
+    /**
+     * Set of characters being considered alphabetics
+     */
+    std::set<UChar32> alphabetic_chars;
+
+    /**
+     * Set of characters to ignore
+     */
+    std::set<UChar32> ignored_chars;
+
+    /**
+     * Mapping of characters for simplistic diacritic restoration specified in RCX files
+     */
+    std::map<int, std::set<int> > rcx_map;
+
+    /**
+     * Alphabet
+     */
+    Alphabet alphabet;
+
+    /**
+     * Begin of the transducer
+     */
+    Node root;
+
+    /**
+     * How the init function that built root classified the final nodes:
+     * by the type of their section, all as standard, or not at all yet
+     */
+    enum Finals
+    {
+      FINALS_NONE,
+      FINALS_BY_SECTION,
+      FINALS_STANDARD
+    };
+    Finals finals = FINALS_NONE;
+  };
+  std::shared_ptr<Model> model;
 
   /**
    * Current state of lexical analysis
@@ -75,29 +138,17 @@ private:
   double default_weight = 0.0000;
 
   /**
-   * The final states of inconditional sections in the dictionaries
-   */
-  std::map<Node *, double> inconditional;
-
-  /**
-   * The final states of standard sections in the dictionaries
-   */
-  std::map<Node *, double> standard;
-
-  /**
-   * The final states of postblank sections in the dictionaries
+   * Classes of final nodes, also set on the nodes themselves so that
+   * the final checks of the processing loops are bit tests
    */
-  std::map<Node *, double> postblank;
-
-  /**
-   * The final states of preblank sections in the dictionaries
-   */
-  std::map<Node *, double> preblank;
-
-  /**
-   * Merge of 'inconditional', 'standard', 'postblank' and 'preblank' sets
-   */
-  std::map<Node *, double> all_finals;
+  enum FinalClass
+  {
+    FINAL_STANDARD = 1,
+    FINAL_INCONDITIONAL = 2,
+    FINAL_POSTBLANK = 4,
+    FINAL_PREBLANK = 8,
+    FINAL_ANY = 15
+  };
 
   /**
    * Queue of blanks, used in reading methods
@@ -111,50 +162,45 @@ private:
 
   std::deque<std::vector<int32_t>> transliteration_queue;
 
-  /**
-   * Set of characters being considered alphabetics
-   */
-  std::set<UChar32> alphabetic_chars;
-
   /**
    * Set of characters to escape with a backslash
    */
   std::set<UChar32> escaped_chars;
 
   /**
-   * Set of characters to ignore
-   */
-  std::set<UChar32> ignored_chars;
-
-  /**
-   * Mapping of characters for simplistic diacritic restoration specified in RCX files
+   * escaped_chars as a table for OutputFile::writeEscaped
    */
-  std::map<int, std::set<int> > rcx_map;
+  OutputFile::EscapeTable escaped_table;
 
   /**
    * Original char being restored
    */
-  int rcx_current_char;
+  int rcx_current_char = 0;
 
   /**
-   * Alphabet
+   * Input buffer
    */
-  Alphabet alphabet;
+  Buffer<int32_t> input_buffer;
 
   /**
-   * Input buffer
+   * true if the position of input stream is out of a word
    */
-  Buffer<int32_t> input_buffer;
+  bool outOfWord = false;
 
   /**
-   * Begin of the transducer
+   * Lexical unit being read from a binary stream, as returned by
+   * InputFile::readRecord, and the position of the next symbol in it
    */
-  Node root;
+  std::vector<int32_t> binary_word;
+  size_t binary_pos = 0;
+  std::string binary_blank;
 
   /**
-   * true if the position of input stream is out of a word
+   * Alphabet symbol of each tag of the binary stream whose tags are of
+   * InputFile::tagGeneration binary_generation
    */
-  bool outOfWord = false;
+  uint64_t binary_generation = 0;
+  std::vector<int> binary_tags;
 
   /**
    * true if we're automatically removing surface forms.
@@ -242,6 +288,30 @@ private:
    */
   int maxWeightClasses = INT_MAX;
 
+  /**
+   * if true, merges identical paths and drops those that cannot be
+   * among the maxAnalyses or maxWeightClasses best while reading
+   */
+  bool pruningMode = false;
+
+  /**
+   * Subsets of nodes reached by the states stepped with step_case, see
+   * setDFACacheSize
+   */
+  DFACache dfa_cache;
+
+  /**
+   * Analyses of the word forms already seen by analysis(), see
+   * setAnalysisCacheSize
+   */
+  AnalysisCache analysis_cache;
+
+  /**
+   * Results of bilingual() and the biltrans functions, shared with the
+   * sessions, see setBiltransCacheSize
+   */
+  std::shared_ptr<BiltransCache> biltrans_cache;
+
   /**
    * Prints an error of input stream and exits
    */
@@ -268,13 +338,32 @@ private:
    */
   int readAnalysis(InputFile& input);
 
+  /**
+   * Read the rest of a word form with readAnalysis, and the character
+   * after it, as a key of analysis_cache
+   * @param input the stream to read
+   * @param val the first character of the word form, already read
+   * @param key set to the key
+   * @param word_size set to the length of the word form in key
+   * @return false if the word form is too long to be cached or is
+   * followed by the end of the input
+   */
+  bool readAnalysisKey(InputFile& input, UChar32 val, UString &key,
+                       size_t &word_size);
+
+  /**
+   * Options that change the output of analysis() for a word form, see
+   * AnalysisCache::setOptions
+   */
+  std::vector<int> analysisOptions() const;
+
   /**
    * Read text from stream (decomposition version)
    * @param input the stream to read
    * @param output the stream to write on
    * @return the next symbol in the stream
    */
-  int readDecomposition(InputFile& input, UFILE *output);
+  int readDecomposition(InputFile& input, OutputFile& output);
 
   bool readTransliterationBlank(InputFile& input);
   bool readTransliterationWord(InputFile& input);
@@ -285,7 +374,7 @@ private:
    * @param output the stream being written to
    * @return the next symbol in the stream
    */
-  int readGeneration(InputFile& input, UFILE *output);
+  int readGeneration(InputFile& input, OutputFile& output);
 
   /**
    * Read text from stream (biltrans version)
@@ -293,7 +382,17 @@ private:
    * @param output the stream to write on
    * @return the queue of 0-symbols, and the next symbol in the stream
    */
-  std::pair<UString, int> readBilingual(InputFile& input, UFILE *output);
+  std::pair<UString, int> readBilingual(InputFile& input, OutputFile& output);
+
+  /**
+   * Read from a binary stream, copying the blanks before a lexical
+   * unit to the output, for readGeneration and readBilingual
+   * @param input the stream to read
+   * @param output the stream to write on
+   * @return the text of the symbol if it is a tag unknown to the
+   *         alphabet, and the next symbol in the stream
+   */
+  std::pair<UString, int> readBinary(InputFile& input, OutputFile& output);
 
   /**
    * Read text from stream (SAO version)
@@ -306,18 +405,47 @@ private:
    * Flush all the blanks remaining in the current process
    * @param output stream to write blanks
    */
-  void flushBlanks(UFILE *output);
+  void flushBlanks(OutputFile& output);
+
+  /**
+   * Calculate the initial state of parsing, building the root of the
+   * model and clearing its final nodes first unless an init function
+   * already did for the same classification of the final nodes; a model
+   * shared with copies or sessions is never built for another one
+   * @param finals how the init function classifies the final nodes
+   * @return whether the final nodes are to be classified
+   */
+  bool calcInitial(Model::Finals finals);
+
+  /**
+   * Set initial_state up from root with the current settings
+   */
+  void buildInitialState();
 
   /**
-   * Calculate the initial state of parsing
+   * Symbol of a tag, 0 if the alphabet does not have it; unlike
+   * Alphabet::operator() it never adds the tag to the alphabet, which
+   * may be shared with other sessions
+   * @param tag the tag, with its angle brackets
+   * @return the symbol
    */
-  void calcInitial();
+  int32_t tagSymbol(UString const &tag) const;
 
   /**
    * Calculate all the results of the word being parsed
    */
   void classifyFinals();
 
+  /**
+   * Add a set of final nodes to a class of final nodes
+   * @param finals the final nodes and their weights
+   * @param final_class the class
+   * @param target the set of the class
+   */
+  void addFinals(std::map<Node *, double> const &finals,
+                 FinalClass final_class,
+                 std::map<Node *, double> &target);
+
   /**
    * Shortcut for filtering on all final states with current settings
    * Assumes that casefrom is non-empty
@@ -329,7 +457,7 @@ private:
    * @param str the string to write, escaping characters
    * @param output the stream to write in
    */
-  void writeEscaped(UString const &str, UFILE *output);
+  void writeEscaped(UString const &str, OutputFile& output);
 
   /**
    * Write a string to an output stream.
@@ -340,7 +468,15 @@ private:
    * @param output the stream to write in
    * @return how many blanks to pop and print after printing lu
    */
-  size_t writeEscapedPopBlanks(UString const &str, UFILE *output);
+  size_t writeEscapedPopBlanks(UString const &str, OutputFile& output);
+
+  /**
+   * Pop a space from blankqueue for each space of a string written
+   * by writeEscapedPopBlanks
+   * @param str the string written
+   * @return how many blanks to pop and print after printing lu
+   */
+  size_t popBlanks(UString const &str);
 
   /**
    * Write a string to an output stream, escaping all escapable characters
@@ -348,7 +484,7 @@ private:
    * @param str the string to write, escaping characters
    * @param output the stream to write in
    */
-  void writeEscapedWithTags(UString const &str, UFILE *output);
+  void writeEscapedWithTags(UString const &str, OutputFile& output);
 
   /**
    * Prints a word
@@ -356,7 +492,7 @@ private:
    * @param lf lexical form of the word
    * @param output stream where the word is written
    */
-  void printWord(UString const &sf, UString const &lf, UFILE *output);
+  void printWord(UString const &sf, UString const &lf, OutputFile& output);
 
   /**
    * Prints a word.
@@ -366,7 +502,7 @@ private:
    * @param lf lexical form of the word
    * @param output stream where the word is written
    */
-  void printWordPopBlank(UString const &sf, UString const &lf, UFILE *output);
+  void printWordPopBlank(UString const &sf, UString const &lf, OutputFile& output);
 
   /**
    * Prints a word (Bilingual version)
@@ -374,7 +510,7 @@ private:
    * @param lf lexical form of the word
    * @param output stream where the word is written
    */
-  void printWordBilingual(UString const &sf, UString const &lf, UFILE *output);
+  void printWordBilingual(UString const &sf, UString const &lf, OutputFile& output);
 
 
   /**
@@ -382,14 +518,14 @@ private:
    * @param lf lexical form
    * @param output stream where the word is written
    */
-  void printSAOWord(UString const &lf, UFILE *output);
+  void printSAOWord(UString const &lf, OutputFile& output);
 
   /**
    * Prints an unknown word
    * @param sf surface form of the word
    * @param output stream where the word is written
    */
-  void printUnknownWord(UString const &sf, UFILE *output);
+  void printUnknownWord(UString const &sf, OutputFile& output);
 
   void initDecompositionSymbols();
 
@@ -404,15 +540,15 @@ private:
    * @param val the space character to use if no blank queue
    * @param output stream where the word is written
    */
-  void printSpace(UChar32 const val, UFILE *output);
+  void printSpace(UChar32 const val, OutputFile& output);
   /**
    * Print one possibly escaped character
    * if it's a space and the blank queue is non-empty,
    * pop the first blank and print that instead
    */
-  void printChar(const UChar32 val, UFILE* output);
+  void printChar(const UChar32 val, OutputFile& output);
 
-  void skipUntil(InputFile& input, UFILE *output, UChar32 const character);
+  void skipUntil(InputFile& input, OutputFile& output, UChar32 const character);
   static UString removeTags(UString const &str);
   UString compoundAnalysis(UString str);
 
@@ -430,19 +566,34 @@ private:
    */
   Indices firstNotAlpha(UString const &sf);
 
-  void analysis_wrapper_null_flush(InputFile& input, UFILE *output);
-  void bilingual_wrapper_null_flush(InputFile& input, UFILE *output, GenerationMode mode = gm_unknown);
-  void generation_wrapper_null_flush(InputFile& input, UFILE *output,
+  void analysis_wrapper_null_flush(InputFile& input, OutputFile& output);
+  void bilingual_wrapper_null_flush(InputFile& input, OutputFile& output, GenerationMode mode = gm_unknown);
+  void generation_wrapper_null_flush(InputFile& input, OutputFile& output,
                                      GenerationMode mode);
   UString compose(UString const &lexforms, UString const &queue) const;
 
+  /**
+   * Key of biltrans_cache for a lookup: its kind and the options it
+   * depends on, then the lexical unit
+   * @param kind the lookup, see BiltransCache::Kind
+   */
+  UString biltransKey(int kind, bool with_delim, UString const &input_word) const;
+
+  /*
+   * The biltrans functions without biltrans_cache
+   */
+  UString lookupBiltrans(UString const &input_word, bool with_delim);
+  UString lookupBiltransfull(UString const &input_word, bool with_delim);
+  std::pair<UString, int> lookupBiltransWithQueue(UString const &input_word, bool with_delim);
+  UString lookupBiltransWithoutQueue(UString const &input_word, bool with_delim);
+
   void procNodeICX();
   void procNodeRCX();
   void initDefaultIgnoredCharacters();
 
   bool isLastBlankTM = false;
 
-  xmlTextReaderPtr reader;
+  xmlTextReaderPtr reader = nullptr;
 public:
 
   /*
@@ -459,6 +610,56 @@ public:
 
   FSTProcessor();
 
+  /**
+   * A copy has the settings and the stream state of the processor and
+   * shares its dictionaries and its cache of bilingual lookups, but
+   * starts with empty caches of subsets and analyses of its own and
+   * with the state of the word being read cleared
+   */
+  FSTProcessor(FSTProcessor const &other);
+  FSTProcessor & operator=(FSTProcessor const &other);
+
+  /**
+   * A session of this processor: a processor sharing its dictionaries,
+   * with a copy of its settings and a stream state of its own.  Sessions
+   * of one processor may run in different threads.  They are to be
+   * created once the dictionaries are loaded and the processor is
+   * initialised for the mode they are used in, and neither the processor
+   * nor its sessions may be loaded, initialised or given ICX or RCX files
+   * afterwards.
+   */
+  FSTProcessor session() const;
+
+  /**
+   * Forget what processing left of the stream it read, so that the
+   * next call starts on a new stream with the same settings
+   */
+  void resetStream();
+
+  /**
+   * What processInParallel does with a chunk of its input
+   */
+  typedef std::function<void(FSTProcessor &, InputFile &, OutputFile &)> Process;
+
+  /**
+   * Process the chunks of the input that InputFile::readChunk splits it
+   * in with sessions of this processor in as many threads, writing their
+   * output in the order of the input.  A null-flushed stream is processed
+   * as if by one processor, each chunk being one of its null-terminated
+   * parts, and otherwise chunks are a few paragraphs long.  Processing
+   * that stops before the end of a chunk that is not null-flushed, such
+   * as analysis at a tag it does not know, ends there, as it would with
+   * one processor.  If processing a chunk fails, its error is thrown
+   * once the output of the chunks before it is written and the threads
+   * are stopped; a read waiting for input is given up, except on
+   * Windows, where it is waited for.
+   * @param process what to do with a chunk, in a session of its own
+   * @param keep_null whether process reads the null character ending a
+   *        chunk itself, rather than writing one at the end of its input
+   */
+  void processInParallel(Process const &process, bool keep_null,
+                         InputFile &input, OutputFile &output, int threads);
+
   void initAnalysis();
   void initTMAnalysis();
   void initSAO(){initAnalysis();};
@@ -468,22 +669,38 @@ public:
   void initBiltrans();
   void initDecomposition();
 
+  void analysis(InputFile& input, OutputFile& output);
+  void tm_analysis(InputFile& input, OutputFile& output);
+  void generation(InputFile& input, OutputFile& output, GenerationMode mode = gm_unknown);
+  void postgeneration(InputFile& input, OutputFile& output);
+  void intergeneration(InputFile& input, OutputFile& output);
+  void transliteration(InputFile& input, OutputFile& output);
+  UString biltrans(UString const &input_word, bool with_delim = true);
+  UString biltransfull(UString const &input_word, bool with_delim = true);
+  void bilingual(InputFile& input, OutputFile& output, GenerationMode mode = gm_unknown);
+  std::pair<UString, int> biltransWithQueue(UString const &input_word, bool with_delim = true);
+  UString biltransWithoutQueue(UString const &input_word, bool with_delim = true);
+  void SAO(InputFile& input, OutputFile& output);
+
+  /*
+   * The same, writing through ICU to a UFILE
+   */
   void analysis(InputFile& input, UFILE *output);
   void tm_analysis(InputFile& input, UFILE *output);
   void generation(InputFile& input, UFILE *output, GenerationMode mode = gm_unknown);
   void postgeneration(InputFile& input, UFILE *output);
   void intergeneration(InputFile& input, UFILE *output);
   void transliteration(InputFile& input, UFILE *output);
-  UString biltrans(UString const &input_word, bool with_delim = true);
-  UString biltransfull(UString const &input_word, bool with_delim = true);
   void bilingual(InputFile& input, UFILE *output, GenerationMode mode = gm_unknown);
-  std::pair<UString, int> biltransWithQueue(UString const &input_word, bool with_delim = true);
-  UString biltransWithoutQueue(UString const &input_word, bool with_delim = true);
   void SAO(InputFile& input, UFILE *output);
   void parseICX(std::string const &file);
   void parseRCX(std::string const &file);
 
-  void load(FILE *input);
+  /**
+   * Load the dictionary
+   * @param wanted if given, only the sections it accepts are loaded
+   */
+  void load(FILE *input, SectionFilter const &wanted = nullptr);
 
   bool valid() const;
 
@@ -497,6 +714,53 @@ public:
   void setDisplayWeightsMode(bool const value);
   void setMaxAnalysesValue(int const value);
   void setMaxWeightClassesValue(int const value);
+
+  /**
+   * Step through a cache of subsets of nodes instead of following every
+   * path on each character, to be called before the init functions
+   * @param value maximum number of subsets in the cache, 0 to disable it
+   */
+  void setDFACacheSize(int const value);
+
+  /**
+   * Merge identical paths, and drop those that cannot be among the
+   * best analyses allowed by setMaxAnalysesValue and
+   * setMaxWeightClassesValue, after each character; to be called
+   * before the init functions
+   * @param value whether to prune, see State::setPruning
+   */
+  void setPruningMode(bool const value);
+
+  /**
+   * Remember the analyses of up to a number of word forms, to output
+   * them again without walking the transducers when the same forms come
+   * again; the output is the same as without it
+   * @param value maximum number of word forms, 0 to disable the cache
+   */
+  void setAnalysisCacheSize(int const value);
+
+  /**
+   * Number of lookups in the cache of setAnalysisCacheSize that found
+   * the word form, and that did not
+   */
+  size_t getAnalysisCacheHits() const;
+  size_t getAnalysisCacheMisses() const;
+
+  /**
+   * Remember the results of up to a number of lookups in bilingual()
+   * and the biltrans functions, to return them again without walking
+   * the transducers; the cache is shared with the sessions, and by
+   * their threads
+   * @param value maximum number of results, 0 to disable the cache
+   */
+  void setBiltransCacheSize(int const value);
+
+  /**
+   * Number of lookups in the cache of setBiltransCacheSize that found
+   * their lexical unit, and that did not
+   */
+  size_t getBiltransCacheHits() const;
+  size_t getBiltransCacheMisses() const;
   bool getNullFlush();
   bool getDecompoundingMode();
 };
@@ -16,16 +16,62 @@
  */
 
 #include <lttoolbox/input_file.h>
+#include <lttoolbox/spsc_queue.h>
+#include <lttoolbox/stream_format.h>
 #include <utf8.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <stdexcept>
+#include <thread>
 #include <unicode/ustdio.h>
+#include <unicode/utf8.h>
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <lttoolbox/my_stdio.h>
+#ifdef _MSC_VER
+#include <io.h>
+#define read _read
+#define fileno _fileno
+#else
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// blocks decoded by the thread of a pipeline, laid out as chars, with
+// the characters in [UNGET_ROOM, end) and, at the end of input or on an
+// error, none
+struct InputFile::Block
+{
+  std::vector<UChar32> chars;
+  size_t end;
+  std::string error;
+};
+
+struct InputFile::Pipeline
+{
+  static constexpr size_t DEPTH = 4;
+  // decoded blocks, and emptied ones going back to be reused
+  SPSCQueue<Block> full;
+  SPSCQueue<Block> empty;
+  std::thread thread;
+  bool done;
+
+  Pipeline() : full(DEPTH), empty(DEPTH + 1), done(false) {}
+};
 
 InputFile::InputFile()
-  : infile(stdin), buffer_size(0)
-{}
+  : infile(stdin), bytes(BLOCK_SIZE), byte_end(0),
+    chars(UNGET_ROOM + BLOCK_SIZE), pos(UNGET_ROOM), end(UNGET_ROOM),
+    at_eof(false), mapped(nullptr), mapped_size(0), mapped_pos(0),
+    in_memory(false), binary(false), binary_started(false), byte_pos(0)
+{
+  forgetTags();
+}
 
 InputFile::~InputFile()
 {
@@ -40,6 +86,9 @@ InputFile::open(const char* fname)
     infile = stdin;
   } else {
     infile = fopen(fname, "rb");
+    if (infile != nullptr) {
+      map();
+    }
   }
   return (infile != nullptr);
 }
@@ -53,15 +102,60 @@ InputFile::open_or_exit(const char* fname)
   }
 }
 
+void
+InputFile::map()
+{
+#ifndef _MSC_VER
+  struct stat st;
+  if (fstat(fileno(infile), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0) {
+    return;
+  }
+  void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+                 fileno(infile), 0);
+  if (m == MAP_FAILED) {
+    // fall back to reading the file
+    return;
+  }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  mapped = static_cast<char const*>(m);
+  mapped_size = st.st_size;
+  mapped_pos = 0;
+#endif
+}
+
+void
+InputFile::unmap()
+{
+#ifndef _MSC_VER
+  if (mapped != nullptr && !in_memory) {
+    munmap(const_cast<char*>(mapped), mapped_size);
+  }
+#endif
+  mapped = nullptr;
+  in_memory = false;
+  mapped_size = 0;
+  mapped_pos = 0;
+}
+
 void
 InputFile::close()
 {
+  setPipeline(false);
+  unmap();
   if (infile != nullptr) {
     if (infile != stdin) {
       fclose(infile);
     }
     infile = nullptr;
   }
+  byte_end = 0;
+  pos = end = UNGET_ROOM;
+  at_eof = false;
+  binary = false;
+  binary_started = false;
+  byte_pos = 0;
+  forgetTags();
 }
 
 void
@@ -69,91 +163,270 @@ InputFile::wrap(FILE* newinfile)
 {
   close();
   infile = newinfile;
+  // the bytes are read from the descriptor, around the stdio buffer:
+  // move the descriptor back to the bytes the stream has buffered but
+  // not given out yet, which only works if the file is seekable
+  if (infile != nullptr) {
+    fflush(infile);
+  }
+}
+
+void
+InputFile::wrap(std::string const& newmemory)
+{
+  close();
+  mapped = newmemory.data();
+  mapped_size = newmemory.size();
+  in_memory = true;
+}
+
+static void
+truncated(unsigned char lead, size_t have)
+{
+  int const missing = ((lead & 0xF0) == 0xF0 ? 4 : (lead & 0xE0) == 0xE0 ? 3 : 2) - have;
+  throw std::runtime_error("Could not read " + std::to_string(missing) +
+                           (missing == 1 ? " expected byte" : " expected bytes") +
+                           " from stream");
+}
+
+void
+InputFile::refill()
+{
+  pos = end = UNGET_ROOM;
+  if (pipeline && !at_eof) {
+    takeBlock();
+  } else if (!decodeBlock(chars.data(), end, at_eof)) {
+    chars[end++] = U_EOF;
+  }
 }
 
 void
-InputFile::internal_read()
+InputFile::setPipeline(bool value)
 {
-  if (buffer_size) {
+  if (value == bool(pipeline)) {
     return;
   }
-  if (feof(infile)) {
-    ubuffer[buffer_size++] = U_EOF;
+  if (!value) {
+    pipeline->full.cancel();
+    pipeline->empty.cancel();
+    pipeline->thread.join();
+    pipeline.reset();
     return;
   }
+  pipeline.reset(new Pipeline);
+  for (size_t i = 0; i < Pipeline::DEPTH + 1; i++) {
+    Block block;
+    block.chars.resize(UNGET_ROOM + BLOCK_SIZE);
+    pipeline->empty.push(std::move(block));
+  }
+  pipeline->thread = std::thread([this]() {
+    Pipeline& p = *pipeline;
+    Block block;
+    while (p.empty.pop(block)) {
+      block.end = UNGET_ROOM;
+      block.error.clear();
+      bool more = false;
+      try {
+        more = decodeBlock(block.chars.data(), block.end, p.done);
+      } catch (std::exception& e) {
+        block.error = e.what();
+      }
+      if (!p.full.push(std::move(block)) || !more) {
+        return;
+      }
+    }
+  });
+}
 
-  int first = fgetc_unlocked(infile);
-  if (first == EOF) {
-    ubuffer[buffer_size++] = U_EOF;
-    return;
-  } else if (first == '\0') {
-    ubuffer[buffer_size++] = '\0';
+void
+InputFile::takeBlock()
+{
+  Block block;
+  if (!pipeline->full.pop(block)) {
+    at_eof = true;
+    chars[end++] = U_EOF;
     return;
   }
+  if (!block.error.empty()) {
+    // the thread stops after an error, as reading does without it
+    at_eof = true;
+    throw std::runtime_error(block.error);
+  }
+  if (block.end == UNGET_ROOM) {
+    at_eof = true;
+    chars[end++] = U_EOF;
+  } else {
+    std::swap(chars, block.chars);
+    end = block.end;
+  }
+  pipeline->empty.push(std::move(block));
+}
 
-  int i = 1;
-  cbuffer[0] = static_cast<char>(first);
-  if ((first & 0xF0) == 0xF0) {
-    i += 3;
-    if (fread_unlocked(cbuffer+1, 1, 3, infile) != 3) {
-      throw std::runtime_error("Could not read 3 expected bytes from stream");
+bool
+InputFile::decodeBlock(UChar32* out, size_t& out_end, bool& done)
+{
+  size_t const start = out_end;
+  while (out_end == start) {
+    if (done || closed()) {
+      done = true;
+      return false;
     }
-  } else if ((first & 0xE0) == 0xE0) {
-    i += 2;
-    if (fread_unlocked(cbuffer+1, 1, 2, infile) != 2) {
-      throw std::runtime_error("Could not read 2 expected bytes from stream");
+    if (mapped != nullptr) {
+      if (mapped_pos == mapped_size) {
+        done = true;
+        continue;
+      }
+      char const* p = mapped + mapped_pos;
+      size_t const n = std::min(BLOCK_SIZE, mapped_size - mapped_pos);
+      UChar32* o = out + out_end;
+      char const* rest = decode(p, p + n, o);
+      out_end = o - out;
+      if (rest == p) {
+        // only an incomplete sequence is left
+        truncated(*p, mapped_size - mapped_pos);
+      }
+      mapped_pos = rest - mapped;
+#ifndef _MSC_VER
+      // ask for the page after next block ahead of time
+      static size_t const page = sysconf(_SC_PAGESIZE);
+      size_t const ahead = (mapped_pos + BLOCK_SIZE) & ~(page - 1);
+      if (ahead < mapped_size && !in_memory) {
+        madvise(const_cast<char*>(mapped) + ahead,
+                std::min(BLOCK_SIZE, mapped_size - ahead), MADV_WILLNEED);
+      }
+#endif
+      continue;
     }
-  } else if ((first & 0xC0) == 0xC0) {
-    i += 1;
-    if (fread_unlocked(cbuffer+1, 1, 1, infile) != 1) {
-      throw std::runtime_error("Could not read 1 expected byte from stream");
+    // read(2) returns what is available, so that a null-flushing
+    // pipeline is not kept waiting for a whole block
+    int got;
+    do {
+      got = read(fileno(infile), bytes.data() + byte_end, BLOCK_SIZE - byte_end);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+      if (byte_end != 0) {
+        truncated(bytes[0], byte_end);
+      }
+      done = true;
+      continue;
     }
+    byte_end += got;
+    UChar32* o = out + out_end;
+    char const* rest = decode(bytes.data(), bytes.data() + byte_end, o);
+    out_end = o - out;
+    byte_end = bytes.data() + byte_end - rest;
+    memmove(bytes.data(), rest, byte_end);
   }
-  memset(ubuffer, 0, 3*sizeof(UChar));
-  utf8::utf8to32(cbuffer, cbuffer+i, ubuffer);
-  buffer_size = 1;
+  return true;
 }
 
-UChar32
-InputFile::get()
+char const*
+InputFile::decode(char const* p, char const* limit, UChar32*& out)
 {
-  if (!buffer_size) {
-    internal_read();
-  }
-  return ubuffer[--buffer_size];
-}
 
-UChar32
-InputFile::peek()
-{
-  if (!buffer_size) {
-    internal_read();
+  while (p != limit) {
+    // eight ASCII bytes at a time
+    if (limit - p >= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      if ((word & 0x8080808080808080ULL) == 0) {
+        for (int i = 0; i < 8; i++) {
+          out[i] = static_cast<unsigned char>(p[i]);
+        }
+        out += 8;
+        p += 8;
+        continue;
+      }
+    }
+
+    unsigned char const lead = *p;
+    if (lead < 0x80) {
+      *out++ = lead;
+      p++;
+      continue;
+    }
+
+    int len = 1;
+    if ((lead & 0xF0) == 0xF0) {
+      len = 4;
+    } else if ((lead & 0xE0) == 0xE0) {
+      len = 3;
+    } else if ((lead & 0xC0) == 0xC0) {
+      len = 2;
+    }
+    if (limit - p < len) {
+      break;
+    }
+
+    UChar32 c = -1;
+    if (len == 2 && lead >= 0xC2 && (p[1] & 0xC0) == 0x80) {
+      c = ((lead & 0x1F) << 6) | (p[1] & 0x3F);
+    } else if (len == 3 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+      c = ((lead & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+      if (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF)) {
+        c = -1;
+      }
+    } else if (len == 4 && lead <= 0xF4 && (p[1] & 0xC0) == 0x80 &&
+               (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80) {
+      c = ((lead & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+          ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+      if (c < 0x10000 || c > 0x10FFFF) {
+        c = -1;
+      }
+    }
+    if (c < 0) {
+      // let utfcpp deal with invalid sequences, as it always has
+      UChar32 decoded[4] = {0, 0, 0, 0};
+      utf8::utf8to32(p, p+len, decoded);
+      c = decoded[0];
+    }
+    *out++ = c;
+    p += len;
   }
-  return ubuffer[buffer_size-1];
-}
 
-void
-InputFile::unget(UChar32 c)
-{
-  // this will probably segfault if called multiple times
-  ubuffer[buffer_size++] = c;
+  return p;
 }
 
 bool
 InputFile::eof()
 {
-  return (infile == nullptr) || feof(infile);
+  return closed() || at_eof;
 }
 
 void
 InputFile::rewind()
 {
-  if (infile != nullptr) {
+  setPipeline(false);
+  byte_pos = 0;
+  binary_started = false;
+  forgetTags();
+  if (mapped != nullptr) {
+    mapped_pos = 0;
+    pos = end = UNGET_ROOM;
+    at_eof = false;
+  } else if (infile != nullptr) {
     if (std::fseek(infile, 0, SEEK_SET) != 0) {
       std::cerr << "Error: Unable to rewind file" << std::endl;
       exit(EXIT_FAILURE);
     }
+    byte_end = 0;
+    pos = end = UNGET_ROOM;
+    at_eof = false;
+  }
+}
+
+void
+InputFile::appendPlain(UString& ret, UChar32 a, UChar32 b)
+{
+  size_t i = pos;
+  for (; i != end; i++) {
+    UChar32 const c = chars[i];
+    if (c == a || c == b || c == '\\' || c == '\0' || c == U_EOF) {
+      break;
+    }
+    ret += c;
   }
+  pos = i;
 }
 
 UString
@@ -163,6 +436,7 @@ InputFile::readBlock(const UChar32 start, const UChar32 end)
   ret += start;
   UChar32 c = 0;
   while (c != end && !eof()) {
+    appendPlain(ret, end, end);
     c = get();
     if (c == '\0') {
       break;
@@ -183,6 +457,7 @@ InputFile::finishWBlank()
   ret += '[';
   UChar32 c = 0;
   while (!eof()) {
+    appendPlain(ret, ']', ']');
     c = get();
     if (c == '\0') {
       break;
@@ -203,6 +478,7 @@ InputFile::readBlank(bool readwblank)
 {
   UString ret;
   while (!eof()) {
+    appendPlain(ret, '^', '[');
     UChar32 c = get();
     if (c == '^' || c == '\0' || c == U_EOF) {
       unget(c);
@@ -235,3 +511,247 @@ InputFile::readBlank(bool readwblank)
   }
   return ret;
 }
+
+void
+InputFile::setBinaryStream(bool value)
+{
+  binary = value;
+  binary_started = false;
+  forgetTags();
+}
+
+void
+InputFile::forgetTags()
+{
+  // unique among all the InputFiles, so that an object reusing the
+  // address of another is not taken for it
+  static std::atomic<uint64_t> generations(0);
+  tags.clear();
+  tag_generation = ++generations;
+}
+
+char const*
+InputFile::takeBytes(size_t n)
+{
+  if (at_eof || closed()) {
+    return nullptr;
+  }
+  if (mapped != nullptr) {
+    if (mapped_size - mapped_pos < n) {
+      mapped_pos = mapped_size;
+      at_eof = true;
+      return nullptr;
+    }
+    char const* p = mapped + mapped_pos;
+    mapped_pos += n;
+    return p;
+  }
+  if (byte_end - byte_pos < n) {
+    memmove(bytes.data(), bytes.data() + byte_pos, byte_end - byte_pos);
+    byte_end -= byte_pos;
+    byte_pos = 0;
+    if (bytes.size() < n) {
+      bytes.resize(n);
+    }
+    // as in refill(), only wait for the bytes that are needed
+    while (byte_end < n) {
+      int got;
+      do {
+        got = read(fileno(infile), bytes.data() + byte_end, bytes.size() - byte_end);
+      } while (got < 0 && errno == EINTR);
+      if (got <= 0) {
+        at_eof = true;
+        return nullptr;
+      }
+      byte_end += got;
+    }
+  }
+  char const* p = bytes.data() + byte_pos;
+  byte_pos += n;
+  return p;
+}
+
+InputFile::Record
+InputFile::readRecord(std::string& blank, std::vector<int32_t>& word)
+{
+  if (!binary_started) {
+    binary_started = true;
+    char const* head = takeBytes(sizeof(HEADER_STREAM));
+    if (head == nullptr) {
+      return REC_EOF;
+    }
+    if (memcmp(head, HEADER_STREAM, sizeof(HEADER_STREAM)) != 0) {
+      throw std::runtime_error("Input is not in the binary stream format");
+    }
+  }
+
+  while (true) {
+    char const* byte = takeBytes(1);
+    if (byte == nullptr) {
+      return REC_EOF;
+    }
+    // byte is only valid until the next takeBytes()
+    unsigned char const type = *byte;
+    if (type == SR_NULL) {
+      return REC_NULL;
+    }
+
+    uint32_t length = 0;
+    for (int shift = 0; ; shift += 7) {
+      byte = takeBytes(1);
+      if (byte == nullptr || shift >= 35) {
+        throw std::runtime_error("Could not read record from binary stream");
+      }
+      length |= static_cast<uint32_t>(*byte & 0x7F) << shift;
+      if ((*byte & 0x80) == 0) {
+        break;
+      }
+    }
+    char const* p = takeBytes(length);
+    if (p == nullptr) {
+      throw std::runtime_error("Could not read record from binary stream");
+    }
+    char const* limit = p + length;
+
+    switch (type) {
+      case SR_BLANK:
+        blank.assign(p, limit);
+        return REC_BLANK;
+
+      case SR_TAG:
+        tags.emplace_back();
+        utf8::utf8to16(p, limit, std::back_inserter(tags.back()));
+        break;
+
+      case SR_WORD:
+        word.clear();
+        while (p != limit) {
+          unsigned char const lead = *p;
+          if (lead < 0x80) {
+            word.push_back(lead);
+            p++;
+          } else if (lead == WORD_TAG) {
+            uint32_t id;
+            p = readVarint(p + 1, limit, id);
+            if (p == nullptr || id >= tags.size()) {
+              throw std::runtime_error("Could not read record from binary stream");
+            }
+            word.push_back(-1 - static_cast<int32_t>(id));
+          } else {
+            int32_t i = 0;
+            UChar32 c;
+            U8_NEXT(reinterpret_cast<uint8_t const*>(p), i, limit - p, c);
+            word.push_back(c < 0 ? 0xFFFD : c);
+            p += i;
+          }
+        }
+        return REC_WORD;
+
+      default:
+        throw std::runtime_error("Unknown record in binary stream");
+    }
+  }
+}
+
+bool
+InputFile::readChunk(std::string& chunk, bool null_flush, size_t size,
+                     int cancel)
+{
+  chunk.clear();
+  // where the scan of a text that is not null-flushed is: after a
+  // backslash, in a [blank] or a ^unit$, just after a newline outside
+  // them, or past a null character
+  bool escaped = false;
+  bool in_blank = false;
+  bool in_word = false;
+  bool newline = false;
+  bool to_end = false;
+  while (true) {
+    char const* p;
+    char const* limit;
+    if (mapped != nullptr) {
+      p = mapped + mapped_pos;
+      limit = mapped + mapped_size;
+    } else {
+      if (byte_pos == byte_end && !at_eof && !closed()) {
+#ifndef _MSC_VER
+        if (cancel >= 0) {
+          // wait for input or for cancel, whichever comes first
+          pollfd fds[2] = {{fileno(infile), POLLIN, 0}, {cancel, POLLIN, 0}};
+          while (poll(fds, 2, -1) < 0 && errno == EINTR) {
+          }
+          if (fds[1].revents != 0) {
+            return false;
+          }
+        }
+#endif
+        int got;
+        do {
+          got = read(fileno(infile), bytes.data(), bytes.size());
+        } while (got < 0 && errno == EINTR);
+        byte_pos = 0;
+        byte_end = (got > 0 ? got : 0);
+      }
+      p = bytes.data() + byte_pos;
+      limit = bytes.data() + byte_end;
+    }
+    if (p == limit) {
+      at_eof = true;
+      return false;
+    }
+
+    char const* q = p;
+    bool found = false;
+    if (null_flush) {
+      q = static_cast<char const*>(memchr(p, '\0', limit - p));
+      found = (q != nullptr);
+      if (!found) {
+        q = limit;
+      }
+    } else if (!to_end) {
+      for (; q != limit; q++) {
+        char const c = *q;
+        bool const empty_line = newline && c == '\n';
+        newline = false;
+        if (escaped) {
+          escaped = false;
+        } else if (c == '\\') {
+          escaped = true;
+        } else if (c == '\0') {
+          to_end = true;
+          q = limit;
+          break;
+        } else if (in_blank) {
+          in_blank = (c != ']');
+        } else if (in_word) {
+          in_word = (c != '$');
+        } else if (c == '[') {
+          in_blank = true;
+        } else if (c == '^') {
+          in_word = true;
+        } else if (c == '\n') {
+          if (empty_line && chunk.size() + (q - p) >= size) {
+            q++;
+            found = true;
+            break;
+          }
+          newline = true;
+        }
+      }
+    } else {
+      q = limit;
+    }
+
+    chunk.append(p, q);
+    // the null character ending a null-flushed chunk is consumed too
+    size_t const taken = (q - p) + (found && null_flush ? 1 : 0);
+    if (mapped != nullptr) {
+      mapped_pos += taken;
+    } else {
+      byte_pos += taken;
+    }
+    if (found) {
+      return true;
+    }
+  }
+}
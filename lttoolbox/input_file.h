@@ -18,7 +18,11 @@
 #ifndef _LT_INPUT_FILE_H_
 #define _LT_INPUT_FILE_H_
 
+#include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
 #include <unicode/uchar.h>
 #include <lttoolbox/ustring.h>
 
@@ -26,20 +30,92 @@ class InputFile
 {
 private:
   FILE* infile;
-  UChar32 ubuffer[3];
-  char cbuffer[4];
-  int buffer_size;
-  void internal_read();
+  // bytes are read from infile in blocks of BLOCK_SIZE and decoded to
+  // chars, the pending characters being [pos, end); decoding starts at
+  // UNGET_ROOM so that unget() always has room
+  static constexpr size_t BLOCK_SIZE = 1 << 16;
+  static constexpr size_t UNGET_ROOM = 4;
+  std::vector<char> bytes;
+  size_t byte_end;
+  std::vector<UChar32> chars;
+  size_t pos;
+  size_t end;
+  bool at_eof;
+  // regular files are mapped rather than read, and decoded in blocks
+  // straight from the mapping; mapped is nullptr when streaming
+  char const* mapped;
+  size_t mapped_size;
+  size_t mapped_pos;
+  // text wrapped from memory is read as if it were mapped, but never
+  // unmapped
+  bool in_memory;
+  // whether there is anything to read from
+  bool closed() const { return infile == nullptr && mapped == nullptr; }
+  // map infile if it is a non-empty regular file
+  void map();
+  void unmap();
+  // read and decode the next block, or queue U_EOF at the end of input
+  void refill();
+  // read and decode at least one character to out from out_end on,
+  // unless the end of input is reached, which sets done
+  bool decodeBlock(UChar32* out, size_t& out_end, bool& done);
+  // decode the complete sequences of bytes in [p, limit) to out
+  // returns the start of a trailing incomplete sequence, or limit
+  static char const* decode(char const* p, char const* limit, UChar32*& out);
+  // with a pipeline, blocks are read and decoded by a thread of its own,
+  // which alone touches infile, bytes and the mapping, and refill()
+  // takes them as they come
+  struct Block;
+  struct Pipeline;
+  std::unique_ptr<Pipeline> pipeline;
+  void takeBlock();
+  // move the characters before the next a, b, backslash, \0 or U_EOF
+  // in the decoded buffer to ret without going through get()
+  void appendPlain(UString& ret, UChar32 a, UChar32 b);
+  // a binary stream is read as bytes, the pending ones being
+  // [byte_pos, byte_end) of bytes when streaming, and tags holds the
+  // tags defined so far
+  bool binary;
+  bool binary_started;
+  size_t byte_pos;
+  std::vector<UString> tags;
+  // changed whenever tags is cleared, see tagGeneration()
+  uint64_t tag_generation;
+  void forgetTags();
+  // the next n bytes of a binary stream, valid until the next call, or
+  // nullptr at the end of input
+  char const* takeBytes(size_t n);
 public:
   InputFile();
   ~InputFile();
   bool open(const char* fname = nullptr);
   void open_or_exit(const char* fname = nullptr);
   void close();
+  // read what is left of a stream; if it is not seekable, such as a
+  // pipe, it must not have been read from through stdio before, since
+  // the bytes stdio buffered ahead would be skipped
   void wrap(FILE* newinfile);
-  UChar32 get();
-  UChar32 peek();
-  void unget(UChar32 c);
+  // read the UTF-8 text of a string, which must outlive the reading
+  void wrap(std::string const& newmemory);
+  UChar32 get()
+  {
+    if (pos == end) {
+      refill();
+    }
+    return chars[pos++];
+  }
+  UChar32 peek()
+  {
+    if (pos == end) {
+      refill();
+    }
+    return chars[pos];
+  }
+  void unget(UChar32 c)
+  {
+    // room is only guaranteed for a few characters
+    chars[--pos] = c;
+  }
   bool eof();
   void rewind();
   // assumes that start has already been read
@@ -51,8 +127,44 @@ public:
   UString finishWBlank();
   // read until ^ or \0
   // if readwblank == false, also stop at [[
-  // Note: relies on the fact that ubuffer has length >= 2
+  // Note: relies on unget() having room for two characters
   UString readBlank(bool readwblank = false);
+
+  // read and decode the input in a thread of its own, ahead of what is
+  // asked for; not for binary streams or readChunk(), and to be set
+  // before anything is read.  Closing the input waits for the thread,
+  // which may be waiting for input.
+  void setPipeline(bool value);
+
+  // read the binary stream format of stream_format.h instead of text,
+  // to be set before anything is read
+  void setBinaryStream(bool value);
+  bool binaryStream() const { return binary; }
+  enum Record { REC_EOF, REC_BLANK, REC_WORD, REC_NULL };
+  // read the next record of a binary stream, other than a tag: the text
+  // of a blank goes to blank, and the contents of a lexical unit to
+  // word, characters as they are and tag t as -1 - t
+  Record readRecord(std::string& blank, std::vector<int32_t>& word);
+  // the text of a tag read from a binary stream
+  UString const& tag(size_t id) const { return tags[id]; }
+  // a number that changes whenever the tags of the stream start again,
+  // as when it is opened, wrapped or rewound, and differs between
+  // InputFiles, so that what is derived from the tags can be kept while
+  // it stays the same
+  uint64_t tagGeneration() const { return tag_generation; }
+
+  // read the next chunk of the input as UTF-8 bytes, for processing
+  // chunks independently instead of reading characters: if null_flush,
+  // the text up to the next null character, which is consumed but not
+  // put in chunk; otherwise the text up to the end of the first empty
+  // line after at least size bytes that is outside [blanks], ^units$
+  // and backslash escapes, or up to the end of input if there is a null
+  // character on the way, which ends the processing of text that is not
+  // null-flushed.  Returns false if the chunk ends at the end of input.
+  // If cancel is a file descriptor, a read waiting for input gives up
+  // once cancel is readable, returning false; on Windows it waits.
+  bool readChunk(std::string& chunk, bool null_flush, size_t size,
+                 int cancel = -1);
 };
 
 #endif
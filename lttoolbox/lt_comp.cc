@@ -39,7 +39,7 @@ void endProgram(char *name)
   if(name != NULL)
   {
     std::cout << basename(name) << " v" << PACKAGE_VERSION <<": build a letter transducer from a dictionary" << std::endl;
-    std::cout << "USAGE: " << basename(name) << " [-hmvalrHSj] lr | rl dictionary_file output_file [acx_file]" << std::endl;
+    std::cout << "USAGE: " << basename(name) << " [-hmvalrHSjMI] lr | rl dictionary_file output_file [acx_file]" << std::endl;
 #if HAVE_GETOPT_LONG
     std::cout << "  -d, --debug:               insert line numbers before each entry" << std::endl;
     std::cout << "  -m, --keep-boundaries:     keep morpheme boundaries" << std::endl;
@@ -50,6 +50,8 @@ void endProgram(char *name)
     std::cout << "  -H, --hfst:                expect HFST symbols" << std::endl;
     std::cout << "  -S, --no-split:            don't attempt to split into word and punctuation transducers" << std::endl;
     std::cout << "  -j, --jobs:                use one cpu core per section when minimising, new section after 50k entries" << std::endl;
+    std::cout << "  -M, --mmap:                write a binary that lt-proc can map without decoding" << std::endl;
+    std::cout << "  -I, --index:               write a directory of the sections, to decode them in parallel" << std::endl;
 #else
     std::cout << "  -d:     insert line numbers before each entry" << std::endl;
     std::cout << "  -m:     keep morpheme boundaries" << std::endl;
@@ -60,6 +62,8 @@ void endProgram(char *name)
     std::cout << "  -H:     expect HFST symbols" << std::endl;
     std::cout << "  -S:     don't attempt to split into word and punctuation transducers" << std::endl;
     std::cout << "  -j:     use one cpu core per section when minimising, new section after 50k entries" << std::endl;
+    std::cout << "  -M:     write a binary that lt-proc can map without decoding" << std::endl;
+    std::cout << "  -I:     write a directory of the sections, to decode them in parallel" << std::endl;
 #endif
     std::cout << "Modes:" << std::endl;
     std::cout << "  lr:     left-to-right compilation" << std::endl;
@@ -102,12 +106,14 @@ int main(int argc, char *argv[])
       {"help",      no_argument,       0, 'h'},
       {"verbose",   no_argument,       0, 'V'},
       {"jobs",      no_argument,       0, 'j'},
+      {"mmap",      no_argument,       0, 'M'},
+      {"index",     no_argument,       0, 'I'},
       {0, 0, 0, 0}
     };
 
-    int cnt=getopt_long(argc, argv, "a:v:l:r:dmHShVj", long_options, &option_index);
+    int cnt=getopt_long(argc, argv, "a:v:l:r:dmHShVjMI", long_options, &option_index);
 #else
-    int cnt=getopt(argc, argv, "a:v:l:r:dmHShV");
+    int cnt=getopt(argc, argv, "a:v:l:r:dmHShVMI");
 #endif
     if (cnt==-1)
       break;
@@ -153,6 +159,16 @@ int main(int argc, char *argv[])
         c.setMaxSectionEntries(50000);
         break;
 
+      case 'M':
+        c.setMmapLayout(true);
+        a.setMmapLayout(true);
+        break;
+
+      case 'I':
+        c.setIndexLayout(true);
+        a.setIndexLayout(true);
+        break;
+
       case 'V':
         c.setVerbose(true);
         break;
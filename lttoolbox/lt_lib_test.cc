@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lttoolbox/compression.h>
+#include <lttoolbox/file_utils.h>
+#include <lttoolbox/fst_processor.h>
+#include <lttoolbox/input_file.h>
+#include <lttoolbox/lt_locale.h>
+#include <lttoolbox/output_file.h>
+#include <lttoolbox/stream_format.h>
+#include <lttoolbox/trans_exe.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Checks of what the library does behind the programs, for the tests
+ * in tests/lt_lib; not installed.
+ */
+
+int links(char const *file)
+{
+  FILE *input = openInBinFile(file);
+  std::set<UChar32> letters;
+  Alphabet alphabet;
+  std::map<UString, TransExe> transducers;
+  readTransducerSet(input, letters, alphabet, transducers);
+  fclose(input);
+
+  for(auto& it : transducers)
+  {
+    std::cout << it.first << ' ' << it.second.usesStoredLinks() << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+int wrap(char const *file)
+{
+  // the first line is read through stdio, the rest by InputFile
+  FILE *input = fopen(file, "rb");
+  char line[256];
+  if(input == nullptr || fgets(line, sizeof(line), input) == nullptr)
+  {
+    std::cerr << "Error: Unable to read '" << file << "'." << std::endl;
+    return EXIT_FAILURE;
+  }
+  InputFile in;
+  in.wrap(input); // closes it
+  UString rest;
+  for(UChar32 c = in.get(); c != U_EOF; c = in.get())
+  {
+    rest += c;
+  }
+
+  std::cout << rest;
+  return EXIT_SUCCESS;
+}
+
+std::string readText(char const *text_file)
+{
+  std::string text;
+  FILE *input = openInBinFile(text_file);
+  char buffer[4096];
+  for(size_t got; (got = fread(buffer, 1, sizeof(buffer), input)) != 0;)
+  {
+    text.append(buffer, got);
+  }
+  fclose(input);
+  return text;
+}
+
+void load(FSTProcessor &fstp, char const *file)
+{
+  FILE *input = openInBinFile(file);
+  fstp.load(input);
+  fclose(input);
+  // copies and sessions step through caches of subsets of their own
+  fstp.setDFACacheSize(64);
+}
+
+std::string analyse(FSTProcessor &fstp, std::string const &text)
+{
+  std::string result;
+  InputFile in;
+  OutputFile out;
+  in.wrap(text);
+  out.wrap(result);
+  fstp.analysis(in, out);
+  out.flush();
+  fstp.resetStream();
+  return result;
+}
+
+int sessions(char const *file, char const *text_file)
+{
+  FSTProcessor fstp;
+  load(fstp, file);
+  fstp.initAnalysis();
+
+  std::string const text = readText(text_file);
+  std::string const expected = analyse(fstp, text);
+
+  // one is a plain copy of the processor, the other a session assigned
+  // to another processor
+  static int const ROUNDS = 1000;
+  FSTProcessor first = fstp;
+  FSTProcessor second;
+  second = fstp.session();
+  int differ[2] = {0, 0};
+  std::thread other([&]() {
+    for(int i = 0; i < ROUNDS; i++)
+    {
+      differ[1] += analyse(second, text) != expected;
+    }
+  });
+  for(int i = 0; i < ROUNDS; i++)
+  {
+    differ[0] += analyse(first, text) != expected;
+  }
+  other.join();
+
+  std::cout << expected;
+  std::cout << "differing rounds: " << differ[0] << ' ' << differ[1] << std::endl;
+  return EXIT_SUCCESS;
+}
+
+int reinit(char const *file, char const *text_file)
+{
+  FSTProcessor fstp;
+  load(fstp, file);
+  fstp.initAnalysis();
+  std::string const text = readText(text_file);
+  std::string const expected = analyse(fstp, text);
+
+  FSTProcessor copy = fstp;
+  copy.initAnalysis();
+  fstp.initAnalysis();
+  std::cout << expected;
+  std::cout << "same after initialising again: " << (analyse(fstp, text) == expected)
+            << ' ' << (analyse(copy, text) == expected) << std::endl;
+
+  try
+  {
+    copy.initGeneration();
+    std::cout << "generation on a copy: initialised" << std::endl;
+  }
+  catch(std::exception &e)
+  {
+    std::cout << "generation on a copy: " << e.what() << std::endl;
+  }
+  std::cout << "same after that: " << (analyse(fstp, text) == expected) << std::endl;
+  return EXIT_SUCCESS;
+}
+
+int caches(char const *file, char const *text_file)
+{
+  std::string const text = readText(text_file);
+  FSTProcessor plain;
+  load(plain, file);
+  plain.initAnalysis();
+  std::string const expected = analyse(plain, text);
+
+  // the text is analysed twice, so every word comes again
+  FSTProcessor fstp;
+  load(fstp, file);
+  fstp.setAnalysisCacheSize(64);
+  fstp.initAnalysis();
+  bool const same = analyse(fstp, text) == expected && analyse(fstp, text) == expected;
+  std::cout << expected;
+  std::cout << "analysis cache: same " << same
+            << ", hits " << (fstp.getAnalysisCacheHits() != 0) << std::endl;
+
+  FSTProcessor bil;
+  load(bil, file);
+  bil.setBiltransCacheSize(64);
+  bil.initBiltrans();
+  UString first = bil.biltrans("^ab$"_u);
+  UString second = bil.biltrans("^ab$"_u);
+  std::cout << first << std::endl;
+  std::cout << "biltrans cache: same " << (first == second)
+            << ", hits " << (bil.getBiltransCacheHits() != 0) << std::endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * A binary stream of one lexical unit, with its tags numbered in the
+ * order given
+ */
+std::string binaryStream(std::vector<std::string> const &tags,
+                         std::string const &lemma,
+                         std::vector<uint32_t> const &word_tags)
+{
+  std::string stream(HEADER_STREAM, sizeof(HEADER_STREAM));
+  for(auto &it : tags)
+  {
+    stream += SR_TAG;
+    writeVarint(stream, it.size());
+    stream += it;
+  }
+  std::string word = lemma;
+  for(auto it : word_tags)
+  {
+    word += WORD_TAG;
+    writeVarint(word, it);
+  }
+  stream += SR_WORD;
+  writeVarint(stream, word.size());
+  return stream + word;
+}
+
+int restart(char const *file)
+{
+  FSTProcessor fstp;
+  load(fstp, file);
+  fstp.initGeneration();
+
+  // the same unit, its tags numbered the other way round in the second
+  // stream, read through the same InputFile
+  std::string const streams[2] = {
+    binaryStream({"<n>", "<ind>"}, "ab", {0, 1}),
+    binaryStream({"<ind>", "<n>"}, "ab", {1, 0})
+  };
+  InputFile in;
+  for(auto &it : streams)
+  {
+    std::string result;
+    OutputFile out;
+    in.wrap(it);
+    in.setBinaryStream(true);
+    out.wrap(result);
+    fstp.generation(in, out);
+    out.flush();
+    std::cout << result << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+int damaged(char const *file)
+{
+  // every section claims features this version does not have
+  std::string bytes = readText(file);
+  std::string const header(HEADER_TRANSDUCER, sizeof(HEADER_TRANSDUCER));
+  for(size_t at = bytes.find(header); at != std::string::npos; at = bytes.find(header, at + 1))
+  {
+    bytes.replace(at + header.size(), 8, 8, '\xff');
+  }
+  FILE *input = tmpfile();
+  fwrite(bytes.data(), 1, bytes.size(), input);
+  rewind(input);
+
+  FSTProcessor fstp;
+  try
+  {
+    fstp.load(input);
+    std::cout << "loaded" << std::endl;
+  }
+  catch(std::exception &e)
+  {
+    std::cout << "not loaded: " << e.what() << std::endl;
+  }
+  fclose(input);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+  LtLocale::tryToSetLocale();
+
+  if(argc == 3 && std::string(argv[1]) == "links")
+  {
+    return links(argv[2]);
+  }
+  if(argc == 3 && std::string(argv[1]) == "wrap")
+  {
+    return wrap(argv[2]);
+  }
+  if(argc == 4 && std::string(argv[1]) == "sessions")
+  {
+    return sessions(argv[2], argv[3]);
+  }
+  if(argc == 4 && std::string(argv[1]) == "reinit")
+  {
+    return reinit(argv[2], argv[3]);
+  }
+  if(argc == 4 && std::string(argv[1]) == "caches")
+  {
+    return caches(argv[2], argv[3]);
+  }
+  if(argc == 3 && std::string(argv[1]) == "restart")
+  {
+    return restart(argv[2]);
+  }
+  if(argc == 3 && std::string(argv[1]) == "damaged")
+  {
+    return damaged(argv[2]);
+  }
+
+  std::cerr << "USAGE: lt-lib-test links fst_file" << std::endl;
+  std::cerr << "       lt-lib-test wrap text_file" << std::endl;
+  std::cerr << "       lt-lib-test sessions fst_file text_file" << std::endl;
+  std::cerr << "       lt-lib-test reinit fst_file text_file" << std::endl;
+  std::cerr << "       lt-lib-test caches fst_file text_file" << std::endl;
+  std::cerr << "       lt-lib-test restart fst_file" << std::endl;
+  std::cerr << "       lt-lib-test damaged fst_file" << std::endl;
+  std::cerr << "  links:  print the sections of fst_file, each followed by 1 if it" << std::endl;
+  std::cerr << "          uses the node list stored in the file, 0 otherwise" << std::endl;
+  std::cerr << "  wrap:   print text_file but its first line, read through stdio" << std::endl;
+  std::cerr << "  sessions: print the analysis of text_file, and how many times a copy" << std::endl;
+  std::cerr << "          and a session analysing it at once got something else" << std::endl;
+  std::cerr << "  reinit: print the analysis of text_file, and whether initialising" << std::endl;
+  std::cerr << "          a processor and its copy again changes it" << std::endl;
+  std::cerr << "  caches: print the analysis of text_file, and whether analysing it" << std::endl;
+  std::cerr << "          twice with a cache, and looking a word up twice in the" << std::endl;
+  std::cerr << "          biltrans cache, gives the same and finds cached results" << std::endl;
+  std::cerr << "  restart: generate a word from two binary streams read in turn by" << std::endl;
+  std::cerr << "          the same processor, which number its tags differently" << std::endl;
+  std::cerr << "  damaged: load fst_file with every section marked as having unknown" << std::endl;
+  std::cerr << "          features, and print the error" << std::endl;
+  return EXIT_FAILURE;
+}
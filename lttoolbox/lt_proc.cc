@@ -27,7 +27,7 @@
 void endProgram(char *name)
 {
   std::cout << basename(name) << ": process a stream with a letter transducer" << std::endl;
-  std::cout << "USAGE: " << basename(name) << " [ -a | -b | -c | -d | -e | -g | -n | -p | -x | -s | -t | -v | -h | -z | -w ] [-W] [-N N] [-L N] [ -i icx_file ] [ -r rcx_file ] fst_file [input_file [output_file]]" << std::endl;
+  std::cout << "USAGE: " << basename(name) << " [ -a | -b | -c | -d | -e | -g | -n | -p | -x | -s | -t | -v | -h | -z | -w ] [-W] [-N N] [-L N] [-D N] [-A N] [-P] [-B] [-j N] [-T] [-S section]... [ -i icx_file ] [ -r rcx_file ] fst_file [input_file [output_file]]" << std::endl;
   std::cout << "Options:" << std::endl;
 #if HAVE_GETOPT_LONG
   std::cout << "  -a, --analysis:          morphological analysis (default behavior)" << std::endl;
@@ -54,6 +54,13 @@ void endProgram(char *name)
   std::cout << "  -W, --show-weights:      Print final analysis weights (if any)" << std::endl;
   std::cout << "  -N, --analyses:          Output no more than N analyses (if the transducer is weighted, the N best analyses)" << std::endl;
   std::cout << "  -L, --weight-classes:    Output no more than N best weight classes (where analyses with equal weight constitute a class)" << std::endl;
+  std::cout << "  -D, --dfa-cache:         Cache up to N sets of states to speed up recognition" << std::endl;
+  std::cout << "  -A, --analysis-cache:    Cache the analyses or translations of up to N words" << std::endl;
+  std::cout << "  -P, --prune:             Merge identical paths and drop those that cannot make the -N/-L cut" << std::endl;
+  std::cout << "  -S, --section:           Only load the named section, may be repeated" << std::endl;
+  std::cout << "  -B, --binary-stream:     Binary format between stages: written by analysis, read by generation, both by lexical transfer" << std::endl;
+  std::cout << "  -j, --threads:           Process null-flushed chunks or paragraphs in N threads" << std::endl;
+  std::cout << "  -T, --pipeline:          Read and write in threads of their own, overlapping with processing" << std::endl;
   std::cout << "  -h, --help:              show this help" << std::endl;
 #else
   std::cout << "  -a:   morphological analysis (default behavior)" << std::endl;
@@ -77,6 +84,13 @@ void endProgram(char *name)
   std::cout << "  -W:   Print final analysis weights (if any)" << std::endl;
   std::cout << "  -N:   Output no more than N analyses" << std::endl;
   std::cout << "  -L:   Output no more than N best weight classes" << std::endl;
+  std::cout << "  -D:   Cache up to N sets of states to speed up recognition" << std::endl;
+  std::cout << "  -A:   Cache the analyses or translations of up to N words" << std::endl;
+  std::cout << "  -P:   Merge identical paths and drop those that cannot make the -N/-L cut" << std::endl;
+  std::cout << "  -S:   Only load the named section, may be repeated" << std::endl;
+  std::cout << "  -B:   Binary format between stages: written by analysis, read by generation, both by lexical transfer" << std::endl;
+  std::cout << "  -j:   Process null-flushed chunks or paragraphs in N threads" << std::endl;
+  std::cout << "  -T:   Read and write in threads of their own, overlapping with processing" << std::endl;
   std::cout << "  -I:   skips loading the default ignore characters" << std::endl;
   std::cout << "  -w:   use dictionary case instead of surface case" << std::endl;
   std::cout << "  -h:   show this help" << std::endl;
@@ -99,6 +113,8 @@ int main(int argc, char *argv[])
   int cmd = 0;
   int maxAnalyses;
   int maxWeightClasses;
+  int dfaCacheSize;
+  int analysisCacheSize;
   FSTProcessor fstp;
 
 #if HAVE_GETOPT_LONG
@@ -127,10 +143,26 @@ int main(int argc, char *argv[])
       {"show-weights",      0, 0, 'W'},
       {"analyses",          1, 0, 'N'},
       {"weight-classes",    1, 0, 'L'},
+      {"dfa-cache",         1, 0, 'D'},
+      {"analysis-cache",    1, 0, 'A'},
+      {"prune",             0, 0, 'P'},
+      {"section",           1, 0, 'S'},
+      {"binary-stream",     0, 0, 'B'},
+      {"threads",           1, 0, 'j'},
+      {"pipeline",          0, 0, 'T'},
       {"help",              0, 0, 'h'}
     };
 #endif
 
+  // sections given with -S, all are loaded if empty
+  std::set<UString> sections;
+  std::set<UString> found;
+  SectionFilter wanted = nullptr;
+
+  bool binary_stream = false;
+  int threads = 1;
+  bool pipeline = false;
+
   GenerationMode bilmode = gm_unknown;
   // more than one option sets generation mode, but -gb also sets gm_unknown
   bool really_g = false;
@@ -138,9 +170,9 @@ int main(int argc, char *argv[])
   {
 #if HAVE_GETOPT_LONG
     int option_index;
-    int c = getopt_long(argc, argv, "abcegi:r:lmndopxstzwvCIWN:L:h", long_options, &option_index);
+    int c = getopt_long(argc, argv, "abcegi:r:lmndopxstzwvCIWN:L:D:A:PS:Bj:Th", long_options, &option_index);
 #else
-    int c = getopt(argc, argv, "abcegi:r:lmndopxstzwvCIWN:L:h");
+    int c = getopt(argc, argv, "abcegi:r:lmndopxstzwvCIWN:L:D:A:PS:Bj:Th");
 #endif
 
     if(c == -1)
@@ -193,6 +225,52 @@ int main(int argc, char *argv[])
       fstp.setMaxWeightClassesValue(maxWeightClasses);
       break;
 
+    case 'D':
+      dfaCacheSize = atoi(optarg);
+      if (dfaCacheSize < 1)
+      {
+        std::cerr << "Invalid or no argument for cache size" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      fstp.setDFACacheSize(dfaCacheSize);
+      break;
+
+    case 'A':
+      analysisCacheSize = atoi(optarg);
+      if (analysisCacheSize < 1)
+      {
+        std::cerr << "Invalid or no argument for cache size" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      fstp.setAnalysisCacheSize(analysisCacheSize);
+      fstp.setBiltransCacheSize(analysisCacheSize);
+      break;
+
+    case 'P':
+      fstp.setPruningMode(true);
+      break;
+
+    case 'S':
+      sections.insert(to_ustring(optarg));
+      break;
+
+    case 'B':
+      binary_stream = true;
+      break;
+
+    case 'T':
+      pipeline = true;
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 1)
+      {
+        std::cerr << "Invalid or no argument for thread count" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+
     case 'e':
     case 'a':
     case 'b':
@@ -262,28 +340,36 @@ int main(int argc, char *argv[])
     }
   }
 
+  if(!sections.empty())
+  {
+    wanted = [&sections, &found](UString const &name) {
+      found.insert(name);
+      return sections.find(name) != sections.end();
+    };
+  }
+
   InputFile input;
-  UFILE* output = u_finit(stdout, NULL, NULL);
+  OutputFile output;
 
   if(optind == (argc - 3))
   {
     FILE* in = openInBinFile(argv[optind]);
     input.open_or_exit(argv[optind+1]);
-    output = openOutTextFile(argv[optind+2]);
-    fstp.load(in);
+    output.open_or_exit(argv[optind+2]);
+    fstp.load(in, wanted);
     fclose(in);
   }
   else if(optind == (argc -2))
   {
     FILE* in = openInBinFile(argv[optind]);
     input.open_or_exit(argv[optind+1]);
-    fstp.load(in);
+    fstp.load(in, wanted);
     fclose(in);
   }
   else if(optind == (argc - 1))
   {
     FILE* in = openInBinFile(argv[optind]);
-    fstp.load(in);
+    fstp.load(in, wanted);
     fclose(in);
   }
   else
@@ -291,77 +377,173 @@ int main(int argc, char *argv[])
     endProgram(argv[0]);
   }
 
+  for(auto &it : sections)
+  {
+    if(found.find(it) == found.end())
+    {
+      std::cerr << "Error: No section '" << it << "' in the dictionary." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if(binary_stream && threads > 1)
+  {
+    // the tags of a binary stream are numbered from its start
+    std::cerr << "Error: -B cannot be used with -j." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if(binary_stream)
+  {
+    switch(cmd)
+    {
+      case 'g':
+        input.setBinaryStream(true);
+        break;
+
+      case 'b':
+      case 'o':
+        input.setBinaryStream(true);
+        output.setBinaryStream(true);
+        break;
+
+      case 'a':
+      case 'e':
+      case 0:
+        output.setBinaryStream(true);
+        break;
+
+      default:
+        std::cerr << "Error: -B only works with analysis, generation and lexical transfer." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if(pipeline)
+  {
+    // -j splits the input itself, and binary input is not decoded
+    if(threads == 1 && !input.binaryStream())
+    {
+      input.setPipeline(true);
+    }
+    output.setPipeline(true);
+  }
+
+  if(cmd == 's' && threads > 1)
+  {
+    std::cerr << "Error: -j does not work with SAO." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
   try
   {
+    FSTProcessor::Process process;
+    // the modes other than analysis, generation and lexical transfer
+    // write the null characters of a null-flushed stream as they read
+    // them
+    bool keep_null = true;
     switch(cmd)
     {
       case 'g':
         fstp.initGeneration();
         checkValidity(fstp);
-        fstp.generation(input, output, bilmode);
+        process = [bilmode](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.generation(in, out, bilmode);
+        };
+        keep_null = false;
         break;
 
       case 'p':
         fstp.initPostgeneration();
         checkValidity(fstp);
-        fstp.postgeneration(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.postgeneration(in, out);
+        };
         break;
 
       case 'x':
         fstp.initPostgeneration();
         checkValidity(fstp);
-        fstp.intergeneration(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.intergeneration(in, out);
+        };
         break;
 
       case 's':
         fstp.initAnalysis();
         checkValidity(fstp);
-        fstp.SAO(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.SAO(in, out);
+        };
         break;
 
       case 't':
         fstp.initPostgeneration();
         checkValidity(fstp);
-        fstp.transliteration(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.transliteration(in, out);
+        };
         break;
 
       case 'o':
         fstp.initBiltrans();
         checkValidity(fstp);
         fstp.setBiltransSurfaceForms(true);
-        fstp.bilingual(input, output, bilmode);
+        process = [bilmode](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.bilingual(in, out, bilmode);
+        };
+        keep_null = false;
         break;
 
       case 'b':
         fstp.initBiltrans();
         checkValidity(fstp);
-        fstp.bilingual(input, output, bilmode);
+        process = [bilmode](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.bilingual(in, out, bilmode);
+        };
+        keep_null = false;
         break;
 
       case 'e':
         fstp.initDecomposition();
         checkValidity(fstp);
-        fstp.analysis(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.analysis(in, out);
+        };
+        keep_null = false;
         break;
 
       case 'a':
       default:
         fstp.initAnalysis();
         checkValidity(fstp);
-        fstp.analysis(input, output);
+        process = [](FSTProcessor &p, InputFile &in, OutputFile &out) {
+          p.analysis(in, out);
+        };
+        keep_null = false;
         break;
     }
+
+    if(threads > 1)
+    {
+      fstp.processInParallel(process, keep_null, input, output, threads);
+    }
+    else
+    {
+      process(fstp, input, output);
+    }
   }
   catch (std::exception& e)
   {
     std::cerr << e.what();
     if (fstp.getNullFlush()) {
-      u_fputc('\0', output);
+      output.putNull();
     }
+    output.flush();
 
     exit(1);
   }
 
-  u_fclose(output);
+  output.close();
   return EXIT_SUCCESS;
 }
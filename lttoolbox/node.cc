@@ -16,6 +16,8 @@
  */
 #include <lttoolbox/node.h>
 
+#include <algorithm>
+
 Node::Node()
 {
 }
@@ -44,41 +46,94 @@ Node::operator =(Node const &n)
 void
 Node::copy(Node const &n)
 {
-  transitions = n.transitions;
+  final_class = n.final_class;
+  final_weight = n.final_weight;
+  if(n.local != nullptr)
+  {
+    local = new LocalArcs(*n.local);
+    useLocal();
+  }
+  else
+  {
+    usePacked(n.arc_count, n.arc_input, n.arc_output, n.arc_dest, n.arc_weight);
+    closure_levels = n.closure_levels;
+    closure = n.closure;
+    case_count = n.case_count;
+    case_index = n.case_index;
+    dense = n.dense;
+  }
 }
 
 void
 Node::destroy()
 {
+  delete local;
+  local = nullptr;
+  usePacked(0, nullptr, nullptr, nullptr, nullptr);
 }
 
 void
-Node::addTransition(int const i, int const o, Node * const d, double const wt)
+Node::useLocal()
 {
-  Dest &aux = transitions[i];
-  aux.size++;
-  int *out_tag = new int[aux.size];
-  Node **dest = new Node*[aux.size];
-  double *out_weight = new double[aux.size];
+  arc_count = local->input.size();
+  arc_input = local->input.data();
+  arc_output = local->output.data();
+  arc_dest = local->dest.data();
+  arc_weight = local->weight.data();
+  closure_levels = -1;
+  closure = nullptr;
+  case_count = -1;
+  case_index = nullptr;
+  dense = nullptr;
+}
 
-  for(int i = 0; i<aux.size-1; i++)
-  {
-    out_tag[i] = aux.out_tag[i];
-    dest[i] = aux.dest[i];
-    out_weight[i] = aux.out_weight[i];
-  }
+void
+Node::usePacked(int count, int const *input, int const *output,
+                RelPtr<Node> const *dest, double const *weight)
+{
+  arc_count = count;
+  arc_input = input;
+  arc_output = output;
+  arc_dest = dest;
+  arc_weight = weight;
+  closure_levels = -1;
+  closure = nullptr;
+  case_count = -1;
+  case_index = nullptr;
+  dense = nullptr;
+}
 
-  if(aux.size > 1)
+void
+Node::addTransition(int const i, int const o, Node * const d, double const wt)
+{
+  if(local == nullptr)
   {
-    delete[] aux.out_tag;
-    delete[] aux.dest;
-    delete[] aux.out_weight;
+    local = new LocalArcs;
+    local->input.assign(arc_input.get(), arc_input.get() + arc_count);
+    local->output.assign(arc_output.get(), arc_output.get() + arc_count);
+    local->dest.assign(arc_dest.get(), arc_dest.get() + arc_count);
+    local->weight.assign(arc_weight.get(), arc_weight.get() + arc_count);
   }
 
-  out_tag[aux.size-1] = o;
-  dest[aux.size-1] = d;
-  out_weight[aux.size-1] = wt;
-  aux.out_tag = out_tag;
-  aux.dest = dest;
-  aux.out_weight = out_weight;
+  // keep insertion order among transitions with the same input symbol
+  auto pos = std::upper_bound(local->input.begin(), local->input.end(), i) - local->input.begin();
+  local->input.insert(local->input.begin() + pos, i);
+  local->output.insert(local->output.begin() + pos, o);
+  local->dest.insert(local->dest.begin() + pos, d);
+  local->weight.insert(local->weight.begin() + pos, wt);
+  useLocal();
+}
+
+void
+Node::setFinal(unsigned int const c, double const wt)
+{
+  final_class |= c;
+  final_weight = wt;
+}
+
+void
+Node::clearFinal()
+{
+  final_class = 0;
+  final_weight = 0.0000;
 }
@@ -18,91 +18,141 @@
 #ifndef _NODE_
 #define _NODE_
 
+#include <cstdint>
 #include <cstdlib>
-#include <list>
-#include <map>
+#include <vector>
 
-class State;
+class DFACache;
 class Node;
+class State;
+class TransExe;
 
-
-class Dest
+/**
+ * Pointer stored as the distance from itself to its target, so that
+ * the nodes and indices of a transducer stay valid wherever the memory
+ * holding them is mapped.  Null is stored as 0.
+ */
+template<typename T>
+class RelPtr
 {
 private:
-  int size;
-  int *out_tag;
-  Node **dest;
-  double *out_weight;
+  intptr_t offset = 0;
 
-  friend class State;
-  friend class Node;
+public:
+  RelPtr()
+  {
+  }
 
-  void copy(Dest const &d)
+  RelPtr(T *p)
   {
-    destroy();
-    size = d.size;
-    out_tag = new int[size];
-    dest = new Node*[size];
-    out_weight = new double[size];
+    *this = p;
   }
 
-  void destroy()
+  RelPtr(RelPtr const &p)
   {
-    if(size != 0)
-    {
-      size = 0;
-      if(out_tag)
-      {
-        delete[] out_tag;
-      }
-      if(dest)
-      {
-        delete[] dest;
-      }
-      if(out_weight)
-      {
-        delete[] out_weight;
-      }
-    }
+    *this = p.get();
   }
 
-  void init()
+  RelPtr & operator =(T *p)
   {
-    size = 0;
-    out_tag = NULL;
-    dest = NULL;
-    out_weight = NULL;
+    offset = p == nullptr ? 0 : reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(this);
+    return *this;
   }
 
-public:
-  Dest()
+  RelPtr & operator =(RelPtr const &p)
   {
-    init();
+    return *this = p.get();
   }
 
-  ~Dest()
+  T * get() const
   {
-    destroy();
+    return offset == 0 ? nullptr : at();
   }
 
-  Dest(Dest const &d)
+  operator T *() const
   {
-    init();
-    copy(d);
+    return get();
   }
 
-  Dest & operator=(Dest const &d)
+  T * operator ->() const
   {
-    if(this != &d)
-    {
-      destroy();
-      copy(d);
-    }
-    return *this;
+    return at();
+  }
+
+  /**
+   * Element of an array, which is never reached through a null pointer
+   */
+  T & operator [](size_t i) const
+  {
+    return at()[i];
+  }
+
+private:
+  T * at() const
+  {
+    return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + offset);
   }
 };
 
+/**
+ * Epsilon closure of a node, precomputed by TransExe.  The arrays are
+ * slices of the flat indices of the transducer.
+ */
+struct EpsilonClosure
+{
+  /**
+   * Destinations in the order a breadth-first walk of the epsilon
+   * transitions reaches them.  Level l, starting with 0 for the
+   * destinations of the node's own epsilon transitions, is
+   * [level[l], level[l+1]), so there are level[closure_levels] of them
+   */
+  RelPtr<unsigned int const> level;
+  RelPtr<RelPtr<Node> const> dest;
+
+  /**
+   * The path to dest[k] is the one to dest[parent[k]], or the node
+   * itself if parent[k] is -1, followed by a transition with output
+   * symbol[k], 0 for none, and weight[k]
+   */
+  RelPtr<int const> parent;
+  RelPtr<int const> symbol;
+  RelPtr<double const> weight;
+};
+
+/**
+ * Direct index of the transitions of a node with many of them,
+ * precomputed by TransExe
+ */
+struct DenseIndex
+{
+  /**
+   * Compact number of each letter read by the transducer, -1 for the
+   * symbols below letter_limit it never reads.  Shared by the nodes of
+   * the transducer.
+   */
+  RelPtr<int const> letter_id;
+  int letter_limit;
+
+  /**
+   * Positions of the first transition of the node on each letter and
+   * one past the last, at 2*id and 2*id+1
+   */
+  RelPtr<int const> range;
+};
 
+/**
+ * Transitions of a node on an uppercase input symbol and on its
+ * lowercase version, precomputed by TransExe.  The ranges are positions
+ * in the transitions of the node, empty when there are none.
+ */
+struct CaseEntry
+{
+  int upper;
+  int upper_first;
+  int upper_limit;
+  int lower_first;
+  int lower_limit;
+};
 
 /**
  * Node class of TransExe.  State is a friend class since the
@@ -111,13 +161,176 @@ public:
 class Node
 {
 private:
+  friend class DFACache;
   friend class State;
+  friend class TransExe;
+
+  /**
+   * Number of outgoing transitions of this node
+   */
+  int arc_count = 0;
+
+  /**
+   * Number of levels of the epsilon closure, 0 if the node has no
+   * epsilon transitions and -1 if the closure is not precomputed
+   */
+  int closure_levels = -1;
+  RelPtr<EpsilonClosure const> closure;
 
   /**
-   * The outgoing transitions of this node.
-   * Schema: (input symbol, (output symbol, destination, weight))
+   * Classes of final nodes this node belongs to as a bit set, 0 if it
+   * is not final, and its weight as a final node
    */
-  std::map<int, Dest> transitions;
+  unsigned int final_class = 0;
+  double final_weight = 0.0000;
+
+  /**
+   * Entries for the uppercase input symbols of the transitions, sorted
+   * by symbol, or a count of -1 if they are not precomputed
+   */
+  int case_count = -1;
+  RelPtr<CaseEntry const> case_index;
+
+  /**
+   * Direct index of the transitions on letters, NULL for nodes with few
+   * transitions, which are searched
+   */
+  RelPtr<DenseIndex const> dense;
+
+  /**
+   * The outgoing transitions of this node, sorted by input symbol and
+   * stored as parallel arrays.
+   * Schema: (input symbol, output symbol, destination, weight)
+   * For nodes loaded by TransExe::read these point into the packed
+   * arrays of the transducer, otherwise into 'local'
+   */
+  RelPtr<int const> arc_input;
+  RelPtr<int const> arc_output;
+  RelPtr<RelPtr<Node> const> arc_dest;
+  RelPtr<double const> arc_weight;
+
+  /**
+   * Storage for the transitions of nodes built with addTransition(),
+   * NULL for packed nodes
+   */
+  struct LocalArcs
+  {
+    std::vector<int> input;
+    std::vector<int> output;
+    std::vector<RelPtr<Node>> dest;
+    std::vector<double> weight;
+  } *local = nullptr;
+
+  /**
+   * Point the transition arrays to the local storage
+   */
+  void useLocal();
+
+  /**
+   * Point the transition arrays to a slice of external storage
+   */
+  void usePacked(int count, int const *input, int const *output,
+                 RelPtr<Node> const *dest, double const *weight);
+
+  /**
+   * Locate the transitions with a given input symbol
+   * @param input the input symbol
+   * @param first position of the first matching transition
+   * @return one past the last matching transition, equal to first if none
+   */
+  int findTransitions(int const input, int &first) const
+  {
+    if(dense != nullptr && input > 0 && input < dense->letter_limit)
+    {
+      int const id = dense->letter_id[input];
+      if(id < 0)
+      {
+        first = 0;
+        return 0;
+      }
+      first = dense->range[2*id];
+      return dense->range[2*id+1];
+    }
+
+    int lo = 0;
+    if(arc_count <= 8)
+    {
+      while(lo != arc_count && arc_input[lo] < input)
+      {
+        lo++;
+      }
+    }
+    else
+    {
+      int hi = arc_count;
+      while(lo < hi)
+      {
+        int mid = (lo + hi) / 2;
+        if(arc_input[mid] < input)
+        {
+          lo = mid + 1;
+        }
+        else
+        {
+          hi = mid;
+        }
+      }
+    }
+    first = lo;
+    while(lo != arc_count && arc_input[lo] == input)
+    {
+      lo++;
+    }
+    return lo;
+  }
+
+  /**
+   * Locate the transitions with an uppercase input symbol and with its
+   * lowercase version, in one probe of the case index when there is one;
+   * the index only has the symbols that differ from their lowercase
+   * version, so input must not be its own lowercase version
+   * @param input the input symbol
+   * @param lower the lowercase version of input, other than input
+   * @param first position of the first transition on input
+   * @param limit one past the last transition on input
+   * @param lower_first position of the first transition on lower
+   * @param lower_limit one past the last transition on lower
+   */
+  void findCaseTransitions(int const input, int const lower,
+                           int &first, int &limit,
+                           int &lower_first, int &lower_limit) const
+  {
+    if(case_count < 0)
+    {
+      limit = findTransitions(input, first);
+      lower_limit = findTransitions(lower, lower_first);
+      return;
+    }
+    int lo = 0;
+    int hi = case_count;
+    while(lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if(case_index[mid].upper < input)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    if(lo != case_count && case_index[lo].upper == input)
+    {
+      first = case_index[lo].upper_first;
+      limit = case_index[lo].upper_limit;
+      lower_first = case_index[lo].lower_first;
+      lower_limit = case_index[lo].lower_limit;
+      return;
+    }
+    first = limit = 0;
+    lower_limit = findTransitions(lower, lower_first);
+  }
 
   /**
    * Copy method
@@ -163,6 +376,19 @@ public:
    * @param w weight value
    */
   void addTransition(int i, int o, Node * const d, double wt);
+
+  /**
+   * Mark the node as final, so that State can test it without looking
+   * it up in a set of final nodes
+   * @param c bits of the classes of final nodes to add the node to
+   * @param wt weight of the node as a final node
+   */
+  void setFinal(unsigned int c, double wt);
+
+  /**
+   * Unmark the node as final, in every class
+   */
+  void clearFinal();
 };
 
 #endif
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <lttoolbox/output_file.h>
+#include <lttoolbox/spsc_queue.h>
+#include <lttoolbox/stream_format.h>
+#include <utf8.h>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unicode/utf8.h>
+#include <unicode/utf16.h>
+
+struct OutputFile::Pipeline
+{
+  static constexpr size_t DEPTH = 4;
+  // buffers to write, each with whether to flush the target after it,
+  // and written ones going back to be reused
+  SPSCQueue<std::pair<std::string, bool>> full;
+  SPSCQueue<std::string> empty;
+  std::thread thread;
+  // flushes asked for by flush() and done by the thread
+  size_t flushes_asked;
+  size_t flushes_done;
+  std::mutex mutex;
+  std::condition_variable flushed;
+
+  Pipeline() : full(DEPTH), empty(DEPTH + 2), flushes_asked(0), flushes_done(0) {}
+};
+
+OutputFile::OutputFile()
+  : outfile(stdout), ufile(nullptr), memory(nullptr), owned(false),
+    binary(false), blank_start(0)
+{
+  buffer.reserve(BLOCK_SIZE + 8);
+}
+
+OutputFile::~OutputFile()
+{
+  close();
+}
+
+bool
+OutputFile::open(const char* fname)
+{
+  close();
+  if (fname == nullptr) {
+    outfile = stdout;
+  } else {
+    outfile = fopen(fname, "wb");
+    owned = (outfile != nullptr);
+  }
+  return (outfile != nullptr);
+}
+
+void
+OutputFile::open_or_exit(const char* fname)
+{
+  if (!open(fname)) {
+    std::cerr << "Error: Cannot open file '" << fname << "' for writing." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void
+OutputFile::close()
+{
+  flush();
+  setPipeline(false);
+  if (owned) {
+    fclose(outfile);
+  }
+  outfile = nullptr;
+  ufile = nullptr;
+  memory = nullptr;
+  owned = false;
+  binary = false;
+  blank_start = 0;
+  tags.clear();
+}
+
+void
+OutputFile::wrap(FILE* newoutfile)
+{
+  close();
+  outfile = newoutfile;
+}
+
+void
+OutputFile::wrap(UFILE* newufile)
+{
+  close();
+  ufile = newufile;
+}
+
+void
+OutputFile::wrap(std::string& newmemory)
+{
+  close();
+  memory = &newmemory;
+}
+
+void
+OutputFile::closeBlank()
+{
+  if (blank_start == buffer.size()) {
+    return;
+  }
+  std::string head(1, static_cast<char>(SR_BLANK));
+  writeVarint(head, buffer.size() - blank_start);
+  buffer.insert(blank_start, head);
+  blank_start = buffer.size();
+}
+
+void
+OutputFile::drain()
+{
+  if (binary) {
+    closeBlank();
+    blank_start = 0;
+  }
+  if (buffer.empty()) {
+    return;
+  }
+  if (pipeline) {
+    handOff(false);
+    return;
+  }
+  writeOut(buffer);
+  buffer.clear();
+}
+
+void
+OutputFile::writeOut(std::string const& data)
+{
+  if (outfile != nullptr) {
+    fwrite(data.data(), 1, data.size(), outfile);
+  } else if (ufile != nullptr) {
+    // let ICU convert to whatever the UFILE was opened with
+    UString text;
+    text.reserve(data.size());
+    utf8::utf8to16(data.begin(), data.end(), std::back_inserter(text));
+    u_file_write(text.data(), text.size(), ufile);
+  } else if (memory != nullptr) {
+    memory->append(data);
+  }
+}
+
+void
+OutputFile::flushOut()
+{
+  if (outfile != nullptr) {
+    fflush(outfile);
+  } else if (ufile != nullptr) {
+    u_fflush(ufile);
+  }
+}
+
+void
+OutputFile::handOff(bool flush_after)
+{
+  Pipeline& p = *pipeline;
+  std::string next;
+  if (!p.empty.tryPop(next)) {
+    next.reserve(BLOCK_SIZE + 8);
+  }
+  std::swap(buffer, next);
+  p.full.push(std::make_pair(std::move(next), flush_after));
+  if (flush_after) {
+    std::unique_lock<std::mutex> lock(p.mutex);
+    size_t const asked = ++p.flushes_asked;
+    p.flushed.wait(lock, [&]() { return p.flushes_done >= asked; });
+  }
+}
+
+void
+OutputFile::flush()
+{
+  drain();
+  if (pipeline) {
+    handOff(true);
+  } else {
+    flushOut();
+  }
+}
+
+void
+OutputFile::setPipeline(bool value)
+{
+  if (value == bool(pipeline) || (value && memory != nullptr)) {
+    return;
+  }
+  if (!value) {
+    flush();
+    pipeline->full.cancel();
+    pipeline->empty.cancel();
+    pipeline->thread.join();
+    pipeline.reset();
+    return;
+  }
+  drain();
+  pipeline.reset(new Pipeline);
+  pipeline->thread = std::thread([this]() {
+    Pipeline& p = *pipeline;
+    std::pair<std::string, bool> block;
+    while (p.full.pop(block)) {
+      writeOut(block.first);
+      if (block.second) {
+        flushOut();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.flushes_done++;
+        p.flushed.notify_all();
+      }
+      block.first.clear();
+      p.empty.push(std::move(block.first));
+    }
+  });
+}
+
+void
+OutputFile::encode(UChar32 c)
+{
+  if (c < 0 || c > 0x10FFFF) {
+    // not a character: u_fputc wrote nothing for these
+    return;
+  }
+  if (U_IS_SURROGATE(c)) {
+    // what ICU writes for a surrogate without its pair
+    c = 0xFFFD;
+  }
+  if (c < 0x800) {
+    buffer += static_cast<char>(0xC0 | (c >> 6));
+  } else if (c < 0x10000) {
+    buffer += static_cast<char>(0xE0 | (c >> 12));
+    buffer += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+  } else {
+    buffer += static_cast<char>(0xF0 | (c >> 18));
+    buffer += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+    buffer += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+  }
+  buffer += static_cast<char>(0x80 | (c & 0x3F));
+  if (buffer.size() >= BLOCK_SIZE) {
+    drain();
+  }
+}
+
+void
+OutputFile::append(UChar const* p, UChar const* limit)
+{
+  while (p != limit) {
+    UChar const* ascii = p;
+    while (p != limit && *p < 0x80) {
+      p++;
+    }
+    buffer.append(ascii, p);
+    if (p == limit) {
+      break;
+    }
+    UChar32 c = *p++;
+    if (U16_IS_LEAD(c) && p != limit && U16_IS_TRAIL(*p)) {
+      c = U16_GET_SUPPLEMENTARY(c, *p++);
+    }
+    encode(c);
+  }
+  if (buffer.size() >= BLOCK_SIZE) {
+    drain();
+  }
+}
+
+void
+OutputFile::write(UString const& str)
+{
+  append(str.data(), str.data() + str.size());
+}
+
+void
+OutputFile::writeEscaped(UString const& str, EscapeTable const& escape)
+{
+  UChar const* p = str.data();
+  UChar const* limit = p + str.size();
+  UChar const* run = p;
+  for (; p != limit; p++) {
+    if (*p < 0x80 && escape[*p]) {
+      append(run, p);
+      buffer += '\\';
+      run = p;
+    }
+  }
+  append(run, limit);
+}
+
+void
+OutputFile::writeUtf8(std::string const& str)
+{
+  buffer += str;
+  if (buffer.size() >= BLOCK_SIZE) {
+    drain();
+  }
+}
+
+void
+OutputFile::putNull()
+{
+  if (!binary) {
+    put('\0');
+    return;
+  }
+  closeBlank();
+  buffer += static_cast<char>(SR_NULL);
+  blank_start = buffer.size();
+}
+
+void
+OutputFile::setBinaryStream(bool value)
+{
+  if (value == binary) {
+    return;
+  }
+  if (value && ufile != nullptr) {
+    throw std::runtime_error("A binary stream cannot be written through a UFILE");
+  }
+  drain();
+  binary = value;
+  tags.clear();
+  if (binary) {
+    buffer.append(HEADER_STREAM, sizeof(HEADER_STREAM));
+    blank_start = buffer.size();
+  }
+}
+
+void
+OutputFile::beginWord()
+{
+  closeBlank();
+  word.clear();
+}
+
+// append c to str in UTF-8
+static void
+appendUtf8(std::string& str, UChar32 c)
+{
+  if (c < 0 || c > 0x10FFFF || U_IS_SURROGATE(c)) {
+    c = 0xFFFD;
+  }
+  uint8_t bytes[4];
+  int32_t length = 0;
+  U8_APPEND_UNSAFE(bytes, length, c);
+  str.append(reinterpret_cast<char const*>(bytes), length);
+}
+
+void
+OutputFile::wordChars(UString const& str)
+{
+  for (size_t i = 0; i < str.size(); i++) {
+    UChar32 c = str[i];
+    if (c < 0x80) {
+      word += static_cast<char>(c);
+      continue;
+    }
+    if (U16_IS_LEAD(c) && i + 1 < str.size() && U16_IS_TRAIL(str[i+1])) {
+      c = U16_GET_SUPPLEMENTARY(c, str[++i]);
+    }
+    appendUtf8(word, c);
+  }
+}
+
+void
+OutputFile::wordText(UString const& str)
+{
+  size_t i = 0;
+  while (i < str.size()) {
+    if (str[i] == '\\' && i + 1 < str.size()) {
+      i++;
+    } else if (str[i] == '<') {
+      size_t const close = str.find('>', i);
+      if (close != UString::npos) {
+        UString const tag = str.substr(i, close + 1 - i);
+        auto it = tags.find(tag);
+        if (it == tags.end()) {
+          it = tags.insert(std::make_pair(tag, tags.size())).first;
+          std::string text;
+          utf8::utf16to8(tag.begin(), tag.end(), std::back_inserter(text));
+          buffer += static_cast<char>(SR_TAG);
+          writeVarint(buffer, text.size());
+          buffer += text;
+        }
+        word += static_cast<char>(WORD_TAG);
+        writeVarint(word, it->second);
+        i = close + 1;
+        continue;
+      }
+    }
+    UChar32 c = str[i++];
+    if (c < 0x80) {
+      word += static_cast<char>(c);
+      continue;
+    }
+    if (U16_IS_LEAD(c) && i < str.size() && U16_IS_TRAIL(str[i])) {
+      c = U16_GET_SUPPLEMENTARY(c, str[i++]);
+    }
+    appendUtf8(word, c);
+  }
+}
+
+void
+OutputFile::endWord()
+{
+  buffer += static_cast<char>(SR_WORD);
+  writeVarint(buffer, word.size());
+  buffer += word;
+  blank_start = buffer.size();
+  if (buffer.size() >= BLOCK_SIZE) {
+    drain();
+  }
+}
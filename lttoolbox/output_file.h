@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LT_OUTPUT_FILE_H_
+#define _LT_OUTPUT_FILE_H_
+
+#include <bitset>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <unicode/uchar.h>
+#include <unicode/ustdio.h>
+#include <lttoolbox/ustring.h>
+
+class OutputFile
+{
+private:
+  // text is encoded to UTF-8 in buffer and handed to exactly one of
+  // outfile, ufile or memory when it grows past BLOCK_SIZE, on flush()
+  // and on close()
+  static constexpr size_t BLOCK_SIZE = 1 << 16;
+  std::string buffer;
+  FILE* outfile;
+  UFILE* ufile;
+  std::string* memory;
+  // whether close() should fclose outfile
+  bool owned;
+  // in a binary stream, text written outside lexical units is blank
+  // text, the pending part of which starts at blank_start in buffer;
+  // word holds the record of the lexical unit being written and tags
+  // the ids of the tags defined so far
+  bool binary;
+  size_t blank_start;
+  std::string word;
+  std::map<UString, unsigned int> tags;
+  // frame the pending blank text as a record
+  void closeBlank();
+  // hand buffer to the target without flushing the target
+  void drain();
+  // write to the target and flush it, from the thread of the pipeline
+  // if there is one
+  void writeOut(std::string const& data);
+  void flushOut();
+  // with a pipeline, buffers are written by a thread of its own, which
+  // alone touches the target; handOff() passes buffer on to it and, if
+  // flush_after, waits until it is written and flushed
+  struct Pipeline;
+  std::unique_ptr<Pipeline> pipeline;
+  void handOff(bool flush_after);
+  // put() for characters outside ASCII
+  void encode(UChar32 c);
+  // encode the UTF-16 text in [p, limit)
+  void append(UChar const* p, UChar const* limit);
+public:
+  // ASCII characters that writeEscaped() puts a backslash before
+  typedef std::bitset<128> EscapeTable;
+
+  OutputFile();
+  ~OutputFile();
+  bool open(const char* fname = nullptr);
+  void open_or_exit(const char* fname = nullptr);
+  void close();
+  // write to a file, stdout by default
+  void wrap(FILE* newoutfile);
+  // write through ICU, for callers that already have a UFILE
+  void wrap(UFILE* newufile);
+  // append the UTF-8 text to a string
+  void wrap(std::string& newmemory);
+  void put(UChar32 c)
+  {
+    if (c >= 0 && c < 0x80) {
+      buffer += static_cast<char>(c);
+      if (buffer.size() >= BLOCK_SIZE) {
+        drain();
+      }
+    } else {
+      encode(c);
+    }
+  }
+  void write(UString const& str);
+  // write str with a backslash before each character set in escape
+  void writeEscaped(UString const& str, EscapeTable const& escape);
+  // write UTF-8 text as it is
+  void writeUtf8(std::string const& str);
+  // write the null character that ends a chunk of null-flushed text,
+  // without flushing
+  void putNull();
+
+  // write to a file or UFILE in a thread of its own, which takes over
+  // the buffer each time it fills up; flush() waits for the thread
+  void setPipeline(bool value);
+
+  // write the binary stream format of stream_format.h instead of text,
+  // to be set before anything is written; a stream cannot be written
+  // in binary through a UFILE
+  void setBinaryStream(bool value);
+  bool binaryStream() const { return binary; }
+  // write a lexical unit to a binary stream as records, its contents
+  // given in pieces between beginWord() and endWord()
+  void beginWord();
+  // characters of the lexical unit, taken as they are
+  void wordChars(UString const& str);
+  // part of the lexical unit in the syntax of the text format, with
+  // backslash escapes and <tags>
+  void wordText(UString const& str);
+  void endWord();
+  // pass everything written so far on to the target and flush it
+  void flush();
+};
+
+#endif
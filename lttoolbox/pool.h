@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LT_POOL_H_
+#define _LT_POOL_H_
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Bump allocator for small trivially destructible objects that are
+ * released all at once.  The memory blocks are kept on clear(), so a
+ * pool that is reused for every token stops allocating once it has
+ * grown to the size of the largest one.
+ */
+template<typename T>
+class Pool
+{
+private:
+  static constexpr size_t BLOCK_SIZE = 256;
+
+  /**
+   * Blocks of BLOCK_SIZE objects
+   */
+  std::vector<T *> blocks;
+
+  /**
+   * Block being filled and number of objects used in it
+   */
+  size_t current = 0;
+  size_t used = 0;
+
+public:
+  Pool() {}
+
+  ~Pool()
+  {
+    for(auto b : blocks)
+    {
+      delete[] b;
+    }
+  }
+
+  Pool(Pool const &) = delete;
+  Pool & operator=(Pool const &) = delete;
+
+  /**
+   * Get room for one object, valid until the next clear()
+   */
+  T * alloc()
+  {
+    if(used == BLOCK_SIZE)
+    {
+      current++;
+      used = 0;
+    }
+    if(current == blocks.size())
+    {
+      blocks.push_back(new T[BLOCK_SIZE]);
+    }
+    return &blocks[current][used++];
+  }
+
+  /**
+   * Release every object in constant time
+   */
+  void clear()
+  {
+    current = 0;
+    used = 0;
+  }
+};
+
+#endif
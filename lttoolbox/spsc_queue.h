@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LT_SPSC_QUEUE_H_
+#define _LT_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Bounded queue between one producer thread and one consumer thread.
+ * Pushing and popping take no lock while the queue is neither full nor
+ * empty; a side that finds it so yields for a while and then sleeps
+ * until the other side wakes it.
+ */
+template<typename T>
+class SPSCQueue
+{
+private:
+  static constexpr int SPINS = 64;
+
+  std::vector<T> slots;
+
+  /**
+   * Number of values popped and pushed so far, written by the consumer
+   * and the producer respectively, on cache lines of their own
+   */
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+
+  /**
+   * Whether each side is sleeping on 'wake', and whether cancel() was
+   * called
+   */
+  std::atomic<bool> producer_waiting;
+  std::atomic<bool> consumer_waiting;
+  std::atomic<bool> cancelled;
+  std::mutex mutex;
+  std::condition_variable wake;
+
+  /**
+   * Wait until ready() or cancel()
+   * @param waiting the flag of the calling side
+   * @return false if cancelled
+   */
+  template<typename Ready>
+  bool await(Ready ready, std::atomic<bool> &waiting)
+  {
+    for(int i = 0; i < SPINS; i++)
+    {
+      if(cancelled.load())
+      {
+        return false;
+      }
+      if(ready())
+      {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    // the other side sets head or tail before it reads this flag
+    waiting.store(true);
+    wake.wait(lock, [&]() { return cancelled.load() || ready(); });
+    waiting.store(false);
+    return !cancelled.load();
+  }
+
+  /**
+   * Wake the other side if it is sleeping
+   */
+  void notify(std::atomic<bool> &waiting)
+  {
+    if(waiting.load())
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      wake.notify_all();
+    }
+  }
+
+public:
+  /**
+   * Constructor
+   * @param capacity the number of values the queue holds at most
+   */
+  explicit SPSCQueue(size_t capacity)
+  : slots(capacity), head(0), tail(0), producer_waiting(false),
+    consumer_waiting(false), cancelled(false)
+  {
+  }
+
+  /**
+   * Add a value, waiting for room if the queue is full
+   * @return false if the queue was cancelled
+   */
+  bool push(T &&value)
+  {
+    size_t const t = tail.load(std::memory_order_relaxed);
+    if(!await([&]() { return t - head.load() < slots.size(); },
+              producer_waiting))
+    {
+      return false;
+    }
+    slots[t % slots.size()] = std::move(value);
+    tail.store(t + 1);
+    notify(consumer_waiting);
+    return true;
+  }
+
+  /**
+   * Take the oldest value, waiting for one if the queue is empty
+   * @return false if the queue was cancelled
+   */
+  bool pop(T &value)
+  {
+    size_t const h = head.load(std::memory_order_relaxed);
+    if(!await([&]() { return tail.load() != h; }, consumer_waiting))
+    {
+      return false;
+    }
+    value = std::move(slots[h % slots.size()]);
+    head.store(h + 1);
+    notify(producer_waiting);
+    return true;
+  }
+
+  /**
+   * Take the oldest value if there is one, without waiting
+   * @return whether there was one
+   */
+  bool tryPop(T &value)
+  {
+    size_t const h = head.load(std::memory_order_relaxed);
+    if(tail.load() == h)
+    {
+      return false;
+    }
+    value = std::move(slots[h % slots.size()]);
+    head.store(h + 1);
+    notify(producer_waiting);
+    return true;
+  }
+
+  /**
+   * Make every call to push() and pop() from now on, including those
+   * waiting, return false
+   */
+  void cancel()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled.store(true);
+    wake.notify_all();
+  }
+};
+
+#endif
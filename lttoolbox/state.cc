@@ -15,10 +15,13 @@
  * along with this program; if not, see <https://www.gnu.org/licenses/>.
  */
 #include <lttoolbox/state.h>
+#include <lttoolbox/string_utils.h>
 
 #include <cstring>
 #include <climits>
 #include <algorithm>
+#include <functional>
+#include <tuple>
 
 //debug//
 //#include <iostream>
@@ -53,97 +56,424 @@ State::operator =(State const &s)
 void
 State::destroy()
 {
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
-  {
-    delete state[i].sequence;
-  }
-
   state.clear();
+  releaseHistory();
+  dfa_subset = -1;
+  dfa_anchor = -1;
+  lazy_steps.clear();
+  single = false;
+  cursor = nullptr;
+  cursor_dirty = false;
+  cursor_output.clear();
 }
 
 void
-State::copy(State const &s)
+State::releaseHistory()
 {
-  // release references
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  inherited.clear();
+  if(history && history.use_count() == 1)
+  {
+    history->clear();
+  }
+  else
   {
-    delete state[i].sequence;
+    history.reset();
   }
+}
 
+void
+State::copy(State const &s)
+{
+  // the paths keep pointing to the output histories of s, which stay
+  // alive as long as this state needs them
   state = s.state;
-
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  releaseHistory();
+  inherited = s.inherited;
+  if(s.history)
   {
-    std::vector<std::pair<int, double>> *tmp = new std::vector<std::pair<int, double>>();
-    *tmp = *(state[i].sequence);
-    state[i].sequence = tmp;
+    inherited.push_back(s.history);
   }
+
+  dfa = s.dfa;
+  pruning = s.pruning;
+  beam_analyses = s.beam_analyses;
+  beam_weight_classes = s.beam_weight_classes;
+  dfa_subset = s.dfa_subset;
+  dfa_anchor = s.dfa_anchor;
+  lazy_steps = s.lazy_steps;
+
+  single = s.single;
+  cursor = s.cursor;
+  cursor_dirty = s.cursor_dirty;
+  cursor_output = s.cursor_output;
 }
 
 int
 State::size() const
 {
+  if(single)
+  {
+    return cursor == nullptr ? 0 : 1;
+  }
+  const_cast<State *>(this)->catchUp();
   return state.size();
 }
 
+bool
+State::isEmpty() const
+{
+  if(dfa_subset >= 0)
+  {
+    return dfa->empty(dfa_subset);
+  }
+  if(single)
+  {
+    return cursor == nullptr;
+  }
+  return state.empty();
+}
+
+void
+State::setDFACache(DFACache *cache)
+{
+  materialize();
+  dfa = cache;
+  enterDFACache();
+}
+
+void
+State::setPruning(bool value, int max_analyses, int max_weight_classes)
+{
+  materialize();
+  pruning = value;
+  beam_analyses = max_analyses;
+  beam_weight_classes = max_weight_classes;
+}
+
+void
+State::prune()
+{
+  if(!pruning || state.size() < 2)
+  {
+    return;
+  }
+
+  // paths that branched from one path by the same step hold equal
+  // outputs on top of the same history; sorting them by node and by
+  // that step puts them together, with the first of them in front
+  prune_keys.clear();
+  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  {
+    TOutput const *o = state[i].output;
+    if(o == nullptr)
+    {
+      prune_keys.push_back({state[i].where, state[i].dirty, nullptr, INT_MIN, 0.0000, 0.0000, i});
+    }
+    else
+    {
+      prune_keys.push_back({state[i].where, state[i].dirty, o->prev, o->symbol, o->weight, o->cost, i});
+    }
+  }
+  std::sort(prune_keys.begin(), prune_keys.end(), [](PruneKey const &a, PruneKey const &b) {
+    return std::tie(a.where, a.dirty, a.prev, a.symbol, a.weight, a.index) <
+           std::tie(b.where, b.dirty, b.prev, b.symbol, b.weight, b.index);
+  });
+
+  // a merged path counts for as many analyses as the paths it stands
+  // for, as they would have before filterFinals() removes repeated
+  // ones; dropped paths get a NULL node
+  size_t const n = prune_keys.size();
+  for(size_t first = 0; first != n;)
+  {
+    PruneKey const &k = prune_keys[first];
+    TNodeState &kept = state[k.index];
+    size_t last = first + 1;
+    for(; last != n; last++)
+    {
+      PruneKey const &other = prune_keys[last];
+      if(other.where != k.where || other.dirty != k.dirty || other.prev != k.prev ||
+         other.symbol != k.symbol || other.weight != k.weight)
+      {
+        break;
+      }
+      kept.copies += state[other.index].copies;
+      state[other.index].where = nullptr;
+    }
+    first = last;
+  }
+
+  if(beam_analyses != INT_MAX || beam_weight_classes != INT_MAX)
+  {
+    // the paths at a node share every continuation, so one with
+    // beam_analyses cheaper paths, or more than beam_weight_classes
+    // cheaper costs, beside it can never make it into NFinals()
+    prune_keys.erase(std::remove_if(prune_keys.begin(), prune_keys.end(), [this](PruneKey const &k) {
+      return state[k.index].where == nullptr;
+    }), prune_keys.end());
+    std::sort(prune_keys.begin(), prune_keys.end(), [](PruneKey const &a, PruneKey const &b) {
+      return std::tie(a.where, a.cost) < std::tie(b.where, b.cost);
+    });
+
+    for(size_t first = 0, limit = prune_keys.size(); first != limit;)
+    {
+      size_t copies = 0;
+      size_t cheaper = 0;
+      int classes = 0;
+      size_t i = first;
+      for(; i != limit && prune_keys[i].where == prune_keys[first].where; i++)
+      {
+        if(i != first && prune_keys[i].cost != prune_keys[i-1].cost)
+        {
+          cheaper = copies;
+          classes++;
+        }
+        copies += state[prune_keys[i].index].copies;
+        if(cheaper >= static_cast<size_t>(beam_analyses) || classes > beam_weight_classes)
+        {
+          state[prune_keys[i].index].where = nullptr;
+        }
+      }
+      first = i;
+    }
+  }
+
+  state.erase(std::remove_if(state.begin(), state.end(), [](TNodeState const &path) {
+    return path.where == nullptr;
+  }), state.end());
+}
+
+void
+State::enterDFACache()
+{
+  if(dfa == nullptr || !dfa->enabled() || single || pruning)
+  {
+    return;
+  }
+  std::vector<Node *> nodes;
+  for(auto& it : state)
+  {
+    nodes.push_back(it.where);
+  }
+  dfa_subset = dfa->find(nodes);
+  dfa_anchor = dfa_subset;
+}
+
+void
+State::catchUp()
+{
+  leaveSingle();
+
+  // the steps replayed below see dfa_subset as -1 and do not recurse
+  if(dfa_subset < 0 || lazy_steps.empty())
+  {
+    return;
+  }
+  int const subset = dfa_subset;
+  dfa_subset = -1;
+  for(auto& it : lazy_steps)
+  {
+    step_case(it.val, it.caseSensitive);
+  }
+  lazy_steps.clear();
+  dfa_subset = subset;
+  dfa_anchor = subset;
+}
+
+void
+State::materialize()
+{
+  catchUp();
+  dfa_subset = -1;
+  dfa_anchor = -1;
+}
+
 void
 State::init(Node *initial)
 {
-  state.clear();
-  state.push_back(TNodeState(initial, new std::vector<std::pair<int, double>>(), false));
-  state[0].sequence->clear();
+  destroy();
+  state.push_back(TNodeState(initial, nullptr, false));
   epsilonClosure();
+  enterDFACache();
+}
+
+void
+State::initDeterministic(Node *initial)
+{
+  destroy();
+  single = true;
+  cursor = initial;
 }
 
 bool
-State::apply_into(std::vector<TNodeState>* new_state, int const input, int index, bool dirty)
+State::stepSingle(int const input, int const alt, int const old_sym, int const new_sym)
 {
-  std::map<int, Dest>::const_iterator it;
-  it = state[index].where->transitions.find(input);
-  if(it != state[index].where->transitions.end())
+  if(cursor == nullptr)
+  {
+    return true;
+  }
+  if(input == 0 || alt == 0)
+  {
+    cursor = nullptr;
+    cursor_output.clear();
+    return true;
+  }
+
+  int j, limit;
+  bool dirty = false;
+  if(alt != input)
   {
-    for(int j = 0; j != it->second.size; j++)
+    int k, k_limit;
+    if(input > 0 && alt == StringUtils::tolower(input))
+    {
+      cursor->findCaseTransitions(input, alt, j, limit, k, k_limit);
+    }
+    else
+    {
+      limit = cursor->findTransitions(input, j);
+      k_limit = cursor->findTransitions(alt, k);
+    }
+    if(k != k_limit)
     {
-      std::vector<std::pair<int, double>> *new_v = new std::vector<std::pair<int, double>>();
-      *new_v = *(state[index].sequence);
-      if(it->first != 0)
+      if(j != limit)
       {
-        new_v->push_back(std::make_pair(it->second.out_tag[j], it->second.out_weight[j]));
+        leaveSingle();
+        return false;
       }
-      new_state->push_back(TNodeState(it->second.dest[j], new_v, state[index].dirty||dirty));
+      j = k;
+      limit = k_limit;
+      dirty = true;
     }
+  }
+  else
+  {
+    limit = cursor->findTransitions(input, j);
+  }
+
+  if(j == limit)
+  {
+    cursor = nullptr;
+    cursor_output.clear();
     return true;
   }
-  return false;
+  if(limit - j > 1)
+  {
+    leaveSingle();
+    return false;
+  }
+
+  int const output = cursor->arc_output[j];
+  cursor_output.push_back(std::make_pair(output == old_sym ? new_sym : output,
+                                         cursor->arc_weight[j]));
+  cursor_dirty = cursor_dirty || dirty;
+  cursor = cursor->arc_dest[j];
+  return true;
+}
+
+void
+State::leaveSingle()
+{
+  if(!single)
+  {
+    return;
+  }
+  single = false;
+  if(cursor != nullptr)
+  {
+    TOutput const *output = nullptr;
+    for(auto& it : cursor_output)
+    {
+      output = extend(output, it.first, it.second);
+    }
+    state.push_back(TNodeState(cursor, output, cursor_dirty));
+  }
+  cursor = nullptr;
+  cursor_dirty = false;
+  cursor_output.clear();
+}
+
+State::TOutput const *
+State::extend(TOutput const *prev, int const symbol, double const weight)
+{
+  if(!history)
+  {
+    history = std::make_shared<Pool<TOutput>>();
+  }
+  TOutput *output = history->alloc();
+  output->prev = prev;
+  output->symbol = symbol;
+  output->weight = weight;
+  output->cost = (prev == nullptr ? 0.0000 : prev->cost) + weight;
+  return output;
+}
+
+void
+State::sequence(TOutput const *output, std::vector<std::pair<int, double>> &seq)
+{
+  seq.clear();
+  for(; output != nullptr; output = output->prev)
+  {
+    seq.push_back(std::make_pair(output->symbol, output->weight));
+  }
+  std::reverse(seq.begin(), seq.end());
+}
+
+bool
+State::apply_into(std::vector<TNodeState>* new_state, int const input, int index, bool dirty)
+{
+  int j;
+  int const limit = state[index].where->findTransitions(input, j);
+  return apply_range(new_state, input != 0, j, limit, index, dirty);
+}
+
+bool
+State::apply_range(std::vector<TNodeState>* new_state, bool consume, int j, int const limit, int index, bool dirty)
+{
+  if(j == limit)
+  {
+    return false;
+  }
+
+  Node const *where = state[index].where;
+  for(; j != limit; j++)
+  {
+    TOutput const *output = state[index].output;
+    if(consume)
+    {
+      output = extend(output, where->arc_output[j], where->arc_weight[j]);
+    }
+    new_state->push_back(TNodeState(where->arc_dest[j], output, state[index].dirty||dirty, state[index].copies));
+  }
+  return true;
 }
 
 bool
 State::apply_into_override(std::vector<TNodeState>* new_state, int const input, int const old_sym, int const new_sym, int index, bool dirty)
 {
-  std::map<int, Dest>::const_iterator it;
-  it = state[index].where->transitions.find(input);
-  if(it != state[index].where->transitions.end())
+  Node const *where = state[index].where;
+  int j;
+  int const limit = where->findTransitions(input, j);
+  if(j == limit)
   {
-    for(int j = 0; j != it->second.size; j++)
+    return false;
+  }
+
+  for(; j != limit; j++)
+  {
+    TOutput const *output = state[index].output;
+    if(input != 0)
     {
-      std::vector<std::pair<int, double>> *new_v = new std::vector<std::pair<int, double>>();
-      *new_v = *(state[index].sequence);
-      if(it->first != 0)
+      if(where->arc_output[j] == old_sym)
       {
-        if(it->second.out_tag[j] == old_sym)
-        {
-          new_v->push_back(std::make_pair(new_sym, it->second.out_weight[j]));
-        }
-        else
-        {
-          new_v->push_back(std::make_pair(it->second.out_tag[j], it->second.out_weight[j]));
-        }
+        output = extend(output, new_sym, where->arc_weight[j]);
+      }
+      else
+      {
+        output = extend(output, where->arc_output[j], where->arc_weight[j]);
       }
-      new_state->push_back(TNodeState(it->second.dest[j], new_v, state[index].dirty||dirty));
     }
-    return true;
+    new_state->push_back(TNodeState(where->arc_dest[j], output, state[index].dirty||dirty, state[index].copies));
   }
-  return false;
+  return true;
 }
 
 void
@@ -155,14 +485,13 @@ State::apply(int const input)
     return;
   }
 
-  std::vector<TNodeState> new_state;
+  next_state.clear();
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
-    apply_into(&new_state, input, i, false);
-    delete state[i].sequence;
+    apply_into(&next_state, input, i, false);
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
@@ -174,15 +503,14 @@ State::apply_override(int const input, int const old_sym, int const new_sym)
     return;
   }
 
-  std::vector<TNodeState> new_state;
+  next_state.clear();
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
-    apply_into_override(&new_state, input, old_sym, new_sym, i, false);
-    apply_into_override(&new_state, old_sym, old_sym, new_sym, i, true);
-    delete state[i].sequence;
+    apply_into_override(&next_state, input, old_sym, new_sym, i, false);
+    apply_into_override(&next_state, old_sym, old_sym, new_sym, i, true);
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
@@ -200,16 +528,15 @@ State::apply_override(int const input, int const alt, int const old_sym, int con
     return;
   }
 
-  std::vector<TNodeState> new_state;
+  next_state.clear();
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
-    apply_into_override(&new_state, input, old_sym, new_sym, i, false);
-    apply_into_override(&new_state, alt, old_sym, new_sym, i, true);
-    apply_into_override(&new_state, old_sym, old_sym, new_sym, i, true);
-    delete state[i].sequence;
+    apply_into_override(&next_state, input, old_sym, new_sym, i, false);
+    apply_into_override(&next_state, alt, old_sym, new_sym, i, true);
+    apply_into_override(&next_state, old_sym, old_sym, new_sym, i, true);
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
@@ -221,21 +548,34 @@ State::apply(int const input, int const alt)
     return;
   }
 
-  std::vector<TNodeState> new_state;
   if(input == alt)
   {
     apply(input);
     return;
   }
 
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  next_state.clear();
+  if(input > 0 && alt == StringUtils::tolower(input))
+  {
+    // both case variants in one probe of the case index
+    for(size_t i = 0, limit = state.size(); i != limit; i++)
+    {
+      int first, last, lower_first, lower_last;
+      state[i].where->findCaseTransitions(input, alt, first, last, lower_first, lower_last);
+      apply_range(&next_state, true, first, last, i, false);
+      apply_range(&next_state, true, lower_first, lower_last, i, true);
+    }
+  }
+  else
   {
-    apply_into(&new_state, input, i, false);
-    apply_into(&new_state, alt, i, true);
-    delete state[i].sequence;
+    for(size_t i = 0, limit = state.size(); i != limit; i++)
+    {
+      apply_into(&next_state, input, i, false);
+      apply_into(&next_state, alt, i, true);
+    }
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
@@ -247,48 +587,111 @@ State::apply_careful(int const input, int const alt)
     return;
   }
 
-  std::vector<TNodeState> new_state;
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  next_state.clear();
+  if(alt != input && input > 0 && alt == StringUtils::tolower(input))
   {
-    if(!apply_into(&new_state, input, i, false))
+    for(size_t i = 0, limit = state.size(); i != limit; i++)
     {
-      apply_into(&new_state, alt, i, true);
+      int first, last, lower_first, lower_last;
+      state[i].where->findCaseTransitions(input, alt, first, last, lower_first, lower_last);
+      if(!apply_range(&next_state, true, first, last, i, false))
+      {
+        apply_range(&next_state, true, lower_first, lower_last, i, true);
+      }
+    }
+  }
+  else
+  {
+    for(size_t i = 0, limit = state.size(); i != limit; i++)
+    {
+      if(!apply_into(&next_state, input, i, false))
+      {
+        apply_into(&next_state, alt, i, true);
+      }
     }
-    delete state[i].sequence;
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
 State::epsilonClosure()
 {
-  for(size_t i = 0; i != state.size(); i++)
+  size_t const limit = state.size();
+  int levels = 0;
+  size_t entries = 0;
+  closure_base.resize(limit);
+  for(size_t i = 0; i != limit; i++)
+  {
+    int const l = state[i].where->closure_levels;
+    if(l < 0)
+    {
+      epsilonWalk();
+      return;
+    }
+    levels = std::max(levels, l);
+    closure_base[i] = entries;
+    if(l > 0)
+    {
+      entries += state[i].where->closure->level[l];
+    }
+  }
+  closure_output.resize(entries);
+
+  // adding the closures level by level keeps the paths in the same
+  // order as walking the epsilon transitions breadth-first; each entry
+  // extends the output of an entry of an earlier level
+  for(int l = 0; l != levels; l++)
   {
-    auto it2 = state[i].where->transitions.find(0);
-    if(it2 != state[i].where->transitions.end())
+    for(size_t i = 0; i != limit; i++)
     {
-      for(int j = 0 ; j != it2->second.size; j++)
+      Node const *where = state[i].where;
+      if(l >= where->closure_levels)
+      {
+        continue;
+      }
+      EpsilonClosure const &c = *where->closure;
+      TOutput const **outputs = closure_output.data() + closure_base[i];
+      for(unsigned int k = c.level[l], k_limit = c.level[l+1]; k != k_limit; k++)
       {
-        std::vector<std::pair<int, double>> *tmp = new std::vector<std::pair<int, double>>();
-        *tmp = *(state[i].sequence);
-        if(it2->second.out_tag[j] != 0)
+        TOutput const *output = c.parent[k] < 0 ? state[i].output : outputs[c.parent[k]];
+        if(c.symbol[k] != 0)
         {
-          tmp->push_back(std::make_pair(it2->second.out_tag[j], it2->second.out_weight[j]));
+          output = extend(output, c.symbol[k], c.weight[k]);
         }
-        state.push_back(TNodeState(it2->second.dest[j], tmp, state[i].dirty));
+        outputs[k] = output;
+        state.push_back(TNodeState(c.dest[k], output, state[i].dirty, state[i].copies));
       }
     }
   }
 }
 
+void
+State::epsilonWalk()
+{
+  for(size_t i = 0; i != state.size(); i++)
+  {
+    Node const *where = state[i].where;
+    int j;
+    int const limit = where->findTransitions(0, j);
+    for(; j != limit; j++)
+    {
+      TOutput const *output = state[i].output;
+      if(where->arc_output[j] != 0)
+      {
+        output = extend(output, where->arc_output[j], where->arc_weight[j]);
+      }
+      state.push_back(TNodeState(where->arc_dest[j], output, state[i].dirty, state[i].copies));
+    }
+  }
+}
+
 void
 State::apply(int const input, int const alt1, int const alt2)
 {
-  std::vector<TNodeState> new_state;
   if(input == 0 || alt1 == 0 || alt2 == 0)
   {
-    state = new_state;
+    destroy();
     return;
   }
 
@@ -303,21 +706,20 @@ State::apply(int const input, int const alt1, int const alt2)
     return;
   }
 
+  next_state.clear();
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
-    apply_into(&new_state, input, i, false);
-    apply_into(&new_state, alt1, i, true);
-    apply_into(&new_state, alt2, i, true);
-    delete state[i].sequence;
+    apply_into(&next_state, input, i, false);
+    apply_into(&next_state, alt1, i, true);
+    apply_into(&next_state, alt2, i, true);
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
 State::apply(int const input, std::set<int> const alts)
 {
-  std::vector<TNodeState> new_state;
   bool has_null = false;
   for(auto sit = alts.begin(); sit != alts.end(); sit++)
   {
@@ -328,81 +730,115 @@ State::apply(int const input, std::set<int> const alts)
   }
   if(input == 0 || has_null)
   {
-    state = new_state;
+    destroy();
     return;
   }
 
+  next_state.clear();
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
-    apply_into(&new_state, input, i, false);
+    apply_into(&next_state, input, i, false);
     for(auto sit = alts.begin(); sit != alts.end(); sit++)
     {
       if(*sit == input) continue;
-      apply_into(&new_state, *sit, i, true);
+      apply_into(&next_state, *sit, i, true);
     }
 
-    delete state[i].sequence;
   }
 
-  state = new_state;
+  state.swap(next_state);
 }
 
 void
 State::step(int const input)
 {
+  if(single && stepSingle(input, input, 0, 0))
+  {
+    return;
+  }
+  materialize();
   apply(input);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step(int const input, int const alt)
 {
+  if(single && stepSingle(input, alt, 0, 0))
+  {
+    return;
+  }
+  materialize();
   apply(input, alt);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step_override(int const input, int const old_sym, int const new_sym)
 {
+  if(single && input != old_sym && stepSingle(input, old_sym, old_sym, new_sym))
+  {
+    return;
+  }
+  materialize();
   apply_override(input, old_sym, new_sym);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step_override(int const input, int const alt, int const old_sym, int const new_sym)
 {
+  // apply_override follows old_sym twice when it is alt, which makes
+  // the same path twice
+  if(single && (input == alt || alt == old_sym) && input != old_sym &&
+     stepSingle(input, old_sym, old_sym, new_sym))
+  {
+    return;
+  }
+  materialize();
   apply_override(input, alt, old_sym, new_sym);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step_careful(int const input, int const alt)
 {
+  materialize();
   apply_careful(input, alt);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step(int const input, int const alt1, int const alt2)
 {
+  materialize();
   apply(input, alt1, alt2);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step(int const input, std::set<int> const alts)
 {
+  materialize();
   apply(input, alts);
   epsilonClosure();
+  prune();
 }
 
 void
 State::step_case(UChar32 val, UChar32 val2, bool caseSensitive)
 {
-  if (!u_isupper(val) || caseSensitive) {
+  materialize();
+  if (!StringUtils::isupper(val) || caseSensitive) {
     step(val, val2);
-  } else if(val != u_tolower(val)) {
-    step(val, u_tolower(val), val2);
+  } else if(val != StringUtils::tolower(val)) {
+    step(val, StringUtils::tolower(val), val2);
   } else {
     step(val, val2);
   }
@@ -412,10 +848,23 @@ State::step_case(UChar32 val, UChar32 val2, bool caseSensitive)
 void
 State::step_case(UChar32 val, bool caseSensitive)
 {
-  if (!u_isupper(val) || caseSensitive) {
+  if(dfa_subset >= 0)
+  {
+    int const next = dfa->next(dfa_subset, val, caseSensitive);
+    if(next >= 0)
+    {
+      lazy_steps.push_back({val, caseSensitive, next});
+      dfa_subset = next;
+      return;
+    }
+    // the cache is full
+    materialize();
+  }
+
+  if (!StringUtils::isupper(val) || caseSensitive) {
     step(val);
   } else {
-    step(val, u_tolower(val));
+    step(val, StringUtils::tolower(val));
   }
 }
 
@@ -423,10 +872,11 @@ State::step_case(UChar32 val, bool caseSensitive)
 void
 State::step_case_override(UChar32 val, bool caseSensitive)
 {
-  if (!u_isupper(val) || caseSensitive) {
+  if (!StringUtils::isupper(val) || caseSensitive) {
     step(val);
   } else {
-    step_override(val, u_tolower(val), u_tolower(val), val);
+    UChar32 const lower = StringUtils::tolower(val);
+    step_override(val, lower, lower, val);
   }
 }
 
@@ -434,6 +884,22 @@ State::step_case_override(UChar32 val, bool caseSensitive)
 bool
 State::isFinal(std::map<Node *, double> const &finals) const
 {
+  if(dfa_subset >= 0)
+  {
+    for(Node * const *n = dfa->begin(dfa_subset), * const *limit = dfa->end(dfa_subset); n != limit; n++)
+    {
+      if(finals.find(*n) != finals.end())
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+  if(single)
+  {
+    return cursor != nullptr && finals.find(cursor) != finals.end();
+  }
+
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
     if(finals.find(state[i].where) != finals.end())
@@ -445,6 +911,29 @@ State::isFinal(std::map<Node *, double> const &finals) const
   return false;
 }
 
+bool
+State::isFinal(unsigned int const final_class) const
+{
+  if(dfa_subset >= 0)
+  {
+    return dfa->finalClass(dfa_subset) & final_class;
+  }
+  if(single)
+  {
+    return cursor != nullptr && (cursor->final_class & final_class);
+  }
+
+  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  {
+    if(state[i].where->final_class & final_class)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 
 std::vector<std::pair< UString, double >>
 State::NFinals(std::vector<std::pair<UString, double>> lf, int maxAnalyses, int maxWeightClasses) const
@@ -477,61 +966,113 @@ State::filterFinals(std::map<Node *, double> const &finals,
                     std::set<UChar32> const &escaped_chars,
                     bool display_weights, int max_analyses, int max_weight_classes,
                     bool uppercase, bool firstupper, int firstchar) const
+{
+  auto final_weight = [&finals](Node const *where) -> double const * {
+    auto it = finals.find(const_cast<Node *>(where));
+    return it == finals.end() ? nullptr : &it->second;
+  };
+  return filterFinalsBy(final_weight, alphabet, escaped_chars, display_weights,
+                        max_analyses, max_weight_classes,
+                        uppercase, firstupper, firstchar);
+}
+
+UString
+State::filterFinals(unsigned int const final_class,
+                    Alphabet const &alphabet,
+                    std::set<UChar32> const &escaped_chars,
+                    bool display_weights, int max_analyses, int max_weight_classes,
+                    bool uppercase, bool firstupper, int firstchar) const
+{
+  auto final_weight = [final_class](Node const *where) -> double const * {
+    return (where->final_class & final_class) ? &where->final_weight : nullptr;
+  };
+  return filterFinalsBy(final_weight, alphabet, escaped_chars, display_weights,
+                        max_analyses, max_weight_classes,
+                        uppercase, firstupper, firstchar);
+}
+
+template<typename FinalWeight>
+UString
+State::filterFinalsBy(FinalWeight const &final_weight,
+                      Alphabet const &alphabet,
+                      std::set<UChar32> const &escaped_chars,
+                      bool display_weights, int max_analyses, int max_weight_classes,
+                      bool uppercase, bool firstupper, int firstchar) const
 {
   std::vector<std::pair< UString, double >> response;
 
   UString result;
   double cost = 0.0000;
 
-  for(size_t i = 0, limit = state.size(); i != limit; i++)
+  auto spell = [&](std::vector<std::pair<int, double>> const &seq, bool dirty, double weight,
+                   unsigned int copies)
   {
-    if(finals.find(state[i].where) != finals.end())
+    result.clear();
+    cost = 0.0000;
+    if(dirty)
     {
-      if(state[i].dirty)
+      unsigned int const first_char = result.size() + firstchar;
+      for(size_t j = 0, limit2 = seq.size(); j != limit2; j++)
       {
-        result.clear();
-        cost = 0.0000;
-        unsigned int const first_char = result.size() + firstchar;
-        for(size_t j = 0, limit2 = state[i].sequence->size(); j != limit2; j++)
+        if(escaped_chars.find((seq[j]).first) != escaped_chars.end())
         {
-          if(escaped_chars.find(((*(state[i].sequence))[j]).first) != escaped_chars.end())
-          {
-            result += '\\';
-          }
-          alphabet.getSymbol(result, ((*(state[i].sequence))[j]).first, uppercase);
-          cost += ((*(state[i].sequence))[j]).second;
+          result += '\\';
         }
-        if(firstupper)
+        alphabet.getSymbol(result, (seq[j]).first, uppercase);
+        cost += (seq[j]).second;
+      }
+      if(firstupper)
+      {
+        if(result[first_char] == '~')
         {
-          if(result[first_char] == '~')
-          {
-            // skip post-generation mark
-            result[first_char+1] = u_toupper(result[first_char+1]);
-          }
-          else
-          {
-            result[first_char] = u_toupper(result[first_char]);
-          }
+          // skip post-generation mark
+          result[first_char+1] = u_toupper(result[first_char+1]);
+        }
+        else
+        {
+          result[first_char] = u_toupper(result[first_char]);
         }
       }
-      else
+    }
+    else
+    {
+      for(size_t j = 0, limit2 = seq.size(); j != limit2; j++)
       {
-        result.clear();
-        cost = 0.0000;
-        for(size_t j = 0, limit2 = state[i].sequence->size(); j != limit2; j++)
+        if(escaped_chars.find((seq[j]).first) != escaped_chars.end())
         {
-          if(escaped_chars.find(((*(state[i].sequence))[j]).first) != escaped_chars.end())
-          {
-            result += '\\';
-          }
-          alphabet.getSymbol(result, ((*(state[i].sequence))[j]).first);
-          cost += ((*(state[i].sequence))[j]).second;
+          result += '\\';
         }
+        alphabet.getSymbol(result, (seq[j]).first);
+        cost += (seq[j]).second;
       }
+    }
 
-      // Add the weight of the final state
-      cost += (*(finals.find(state[i].where))).second;
-      response.push_back(make_pair(result, cost));
+    // Add the weight of the final state
+    cost += weight;
+    response.insert(response.end(), copies, make_pair(result, cost));
+  };
+
+  if(single)
+  {
+    double const *weight = cursor == nullptr ? nullptr : final_weight(cursor);
+    if(weight != nullptr)
+    {
+      spell(cursor_output, cursor_dirty, *weight, 1);
+    }
+  }
+  else
+  {
+    const_cast<State *>(this)->catchUp();
+
+    std::vector<std::pair<int, double>> seq;
+    for(size_t i = 0, limit = state.size(); i != limit; i++)
+    {
+      double const *weight = final_weight(state[i].where);
+      if(weight != nullptr)
+      {
+        sequence(state[i].output, seq);
+        spell(seq, state[i].dirty, *weight, state[i].copies);
+      }
     }
   }
 
@@ -566,26 +1107,31 @@ State::filterFinalsLRX(std::map<Node *, double> const &finals,
                        std::set<UChar32> const &escaped_chars,
                        bool uppercase, bool firstupper, int firstchar) const
 {
+  const_cast<State *>(this)->catchUp();
+
   std::set<std::pair<UString, std::vector<UString> > > results;
 
   std::vector<UString> current_result;
   UString rule_id;
 
+  std::vector<std::pair<int, double>> seq;
+
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
     if(finals.find(state[i].where) != finals.end())
     {
+      sequence(state[i].output, seq);
       current_result.clear();
       rule_id.clear();
       UString current_word;
-      for(size_t j = 0, limit2 = state[i].sequence->size(); j != limit2; j++)
+      for(size_t j = 0, limit2 = seq.size(); j != limit2; j++)
       {
-        if(escaped_chars.find(((*(state[i].sequence))[j]).first) != escaped_chars.end())
+        if(escaped_chars.find((seq[j]).first) != escaped_chars.end())
         {
           current_word += '\\';
         }
         UString sym;
-        alphabet.getSymbol(sym, ((*(state[i].sequence))[j]).first, uppercase);
+        alphabet.getSymbol(sym, (seq[j]).first, uppercase);
         if(sym == "<$>"_u)
         {
           if(!current_word.empty())
@@ -614,32 +1160,37 @@ State::filterFinalsSAO(std::map<Node *, double> const &finals,
                        std::set<UChar32> const &escaped_chars,
                        bool uppercase, bool firstupper, int firstchar) const
 {
+  const_cast<State *>(this)->catchUp();
+
   UString result;
   UString annot;
 
+  std::vector<std::pair<int, double>> seq;
+
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
     if(finals.find(state[i].where) != finals.end())
     {
+      sequence(state[i].output, seq);
       result += '/';
       unsigned int const first_char = result.size() + firstchar;
-      for(size_t j = 0, limit2 = state[i].sequence->size(); j != limit2; j++)
+      for(size_t j = 0, limit2 = seq.size(); j != limit2; j++)
       {
-        if(escaped_chars.find(((*(state[i].sequence))[j]).first) != escaped_chars.end())
+        if(escaped_chars.find((seq[j]).first) != escaped_chars.end())
         {
           result += '\\';
         }
-        if(alphabet.isTag(((*(state[i].sequence))[j]).first))
+        if(alphabet.isTag((seq[j]).first))
         {
           annot.clear();
-          alphabet.getSymbol(annot, ((*(state[i].sequence))[j]).first);
+          alphabet.getSymbol(annot, (seq[j]).first);
           result += '&';
           result += annot.substr(1,annot.length()-2);
           result += ';';
         }
         else
         {
-          alphabet.getSymbol(result, ((*(state[i].sequence))[j]).first, uppercase);
+          alphabet.getSymbol(result, (seq[j]).first, uppercase);
         }
       }
       if(firstupper)
@@ -666,20 +1217,25 @@ State::filterFinalsTM(std::map<Node *, double> const &finals,
                       std::set<UChar32> const &escaped_chars,
                       std::queue<UString> &blankqueue, std::vector<UString> &numbers) const
 {
+  const_cast<State *>(this)->catchUp();
+
   UString result;
 
+  std::vector<std::pair<int, double>> seq;
+
   for(size_t i = 0, limit = state.size(); i != limit; i++)
   {
     if(finals.find(state[i].where) != finals.end())
     {
+      sequence(state[i].output, seq);
       result += '/';
-      for(size_t j = 0, limit2 = state[i].sequence->size(); j != limit2; j++)
+      for(size_t j = 0, limit2 = seq.size(); j != limit2; j++)
       {
-        if(escaped_chars.find((*(state[i].sequence))[j].first) != escaped_chars.end())
+        if(escaped_chars.find(seq[j].first) != escaped_chars.end())
         {
           result += '\\';
         }
-        alphabet.getSymbol(result, (*(state[i].sequence))[j].first);
+        alphabet.getSymbol(result, seq[j].first);
       }
     }
   }
@@ -772,14 +1328,16 @@ State::filterFinalsTM(std::map<Node *, double> const &finals,
 void
 State::pruneCompounds(int requiredSymbol, int separationSymbol, int compound_max_elements)
 {
+  materialize();
   int minNoOfCompoundElements = compound_max_elements;
   int *noOfCompoundElements = new int[state.size()];
+  std::vector<std::pair<int, double>> seq;
 
   for(unsigned int i = 0; i<state.size(); i++)
   {
-    std::vector<std::pair<int, double>> seq = *state.at(i).sequence;
+    sequence(state.at(i).output, seq);
 
-    if(lastPartHasRequiredSymbol(seq, requiredSymbol, separationSymbol))
+    if(lastPartHasRequiredSymbol(state.at(i).output, requiredSymbol, separationSymbol))
     {
       int this_noOfCompoundElements = 0;
       for (int j = seq.size()-2; j>0; j--) if ((seq.at(j)).first==separationSymbol) this_noOfCompoundElements++;
@@ -800,7 +1358,6 @@ State::pruneCompounds(int requiredSymbol, int separationSymbol, int compound_max
   {
     if(noOfCompoundElements[i] > minNoOfCompoundElements)
     {
-      delete (*it).sequence;
       it = state.erase(it);
     }
     else
@@ -818,19 +1375,18 @@ State::pruneCompounds(int requiredSymbol, int separationSymbol, int compound_max
 void
 State::pruneStatesWithForbiddenSymbol(int forbiddenSymbol)
 {
+  materialize();
   auto it = state.begin();
   while(it != state.end())
   {
-    std::vector<std::pair<int, double>> *seq = (*it).sequence;
     bool found = false;
-    for(int i = seq->size()-1; i>=0; i--)
+    for(TOutput const *o = (*it).output; o != nullptr; o = o->prev)
     {
-      if((seq->at(i)).first == forbiddenSymbol)
+      if(o->symbol == forbiddenSymbol)
       {
-        i=-1;
-        delete (*it).sequence;
         it = state.erase(it);
         found = true;
+        break;
       }
     }
     if(!found)
@@ -844,14 +1400,13 @@ State::pruneStatesWithForbiddenSymbol(int forbiddenSymbol)
 bool
 State::hasSymbol(int requiredSymbol)
 {
+  catchUp();
   for(size_t i = 0; i<state.size(); i++)
   {
     // loop through sequence – we can't just check that the last tag is cp-L, there may be other tags after it:
-    std::vector<std::pair<int, double>>* seq = state.at(i).sequence;
-    if(seq != NULL) for (unsigned int j=0; j<seq->size(); j++)
+    for(TOutput const *o = state.at(i).output; o != nullptr; o = o->prev)
     {
-      int symbol=(seq->at(j)).first;
-      if(symbol == requiredSymbol)
+      if(o->symbol == requiredSymbol)
       {
         return true;
       }
@@ -862,13 +1417,13 @@ State::hasSymbol(int requiredSymbol)
 
 
 bool
-State::lastPartHasRequiredSymbol(const std::vector<std::pair<int, double>> &seq, int requiredSymbol, int separationSymbol)
+State::lastPartHasRequiredSymbol(TOutput const *output, int requiredSymbol, int separationSymbol)
 {
   // state is final - it should be restarted it with all elements in stateset restart_state, with old symbols conserved
   bool restart=false;
-  for(int n=seq.size()-1; n>=0; n--)
+  for(; output != nullptr; output = output->prev)
   {
-    int symbol=(seq.at(n)).first;
+    int symbol=output->symbol;
     if(symbol==requiredSymbol)
     {
       restart=true;
@@ -886,6 +1441,11 @@ State::lastPartHasRequiredSymbol(const std::vector<std::pair<int, double>> &seq,
 void
 State::restartFinals(const std::map<Node *, double> &finals, int requiredSymbol, State *restart_state, int separationSymbol)
 {
+  materialize();
+  if(restart_state != NULL)
+  {
+    restart_state->catchUp();
+  }
 
   for(unsigned int i=0;  i<state.size(); i++)
   {
@@ -894,7 +1454,7 @@ State::restartFinals(const std::map<Node *, double> &finals, int requiredSymbol,
 
     if(finals.count(state_i.where) > 0)
     {
-      bool restart = lastPartHasRequiredSymbol(*(state_i.sequence), requiredSymbol, separationSymbol);
+      bool restart = lastPartHasRequiredSymbol(state_i.output, requiredSymbol, separationSymbol);
       if(restart)
       {
         if(restart_state != NULL)
@@ -902,14 +1462,7 @@ State::restartFinals(const std::map<Node *, double> &finals, int requiredSymbol,
           for(unsigned int j=0; j<restart_state->state.size(); j++)
           {
             TNodeState initst = restart_state->state.at(j);
-            std::vector<std::pair<int, double>> *tnvec = new std::vector<std::pair<int, double>>;
-
-            for(unsigned int k=0; k < state_i.sequence->size(); k++)
-            {
-              tnvec->push_back(state_i.sequence->at(k));
-            }
-            TNodeState tn(initst.where, tnvec, state_i.dirty);
-            tn.sequence->push_back(std::make_pair(separationSymbol, 0.0000));
+            TNodeState tn(initst.where, extend(state_i.output, separationSymbol, 0.0000), state_i.dirty);
             state.push_back(tn);
           }
         }
@@ -923,16 +1476,18 @@ State::restartFinals(const std::map<Node *, double> &finals, int requiredSymbol,
 UString
 State::getReadableString(const Alphabet &a)
 {
+  catchUp();
   UString retval;
+  std::vector<std::pair<int, double>> seq;
   retval += '[';
 
   for(unsigned int i=0; i<state.size(); i++)
   {
-    std::vector<std::pair<int, double>>* seq = state.at(i).sequence;
-    if(seq != NULL) for (unsigned int j=0; j<seq->size(); j++)
+    sequence(state.at(i).output, seq);
+    for (unsigned int j=0; j<seq.size(); j++)
     {
       UString ws;
-      a.getSymbol(ws, (seq->at(j)).first);
+      a.getSymbol(ws, (seq.at(j)).first);
       retval.append(ws);
     }
 
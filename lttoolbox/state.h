@@ -18,6 +18,7 @@
 #define _STATE_
 
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
@@ -25,7 +26,9 @@
 #include <climits>
 
 #include <lttoolbox/alphabet.h>
+#include <lttoolbox/dfa_cache.h>
 #include <lttoolbox/node.h>
+#include <lttoolbox/pool.h>
 #include <lttoolbox/match_exe.h>
 #include <lttoolbox/match_state.h>
 #include <lttoolbox/transducer.h>
@@ -39,35 +42,183 @@
 class State
 {
 private:
+  /**
+   * One output symbol of a path, linked to the output produced before
+   * it.  Paths that branch from the same node share everything they
+   * had produced so far.
+   */
+  struct TOutput
+  {
+    TOutput const *prev;
+    int symbol;
+    double weight;
+    // weight of the path so far, summed in the order filterFinals does
+    double cost;
+  };
+
   /**
    * The current state of transducer processing
    */
   struct TNodeState
   {
     Node *where;
-    std::vector<std::pair<int, double>> *sequence;
+    TOutput const *output;
     // a state is "dirty" if it was introduced at runtime (case variants, etc.)
     bool dirty;
+    // how many equal paths this one stands for, once prune() merged them
+    unsigned int copies;
 
-    TNodeState(Node * const &w, std::vector<std::pair<int, double>> * const &s, bool const &d): where(w), sequence(s), dirty(d){}
-
-    TNodeState(const TNodeState& other)
-      : where(other.where)
-      , sequence(other.sequence)
-      , dirty(other.dirty)
-    {}
-
-    TNodeState & operator=(TNodeState const &other)
-    {
-      where = other.where;
-      sequence = other.sequence;
-      dirty = other.dirty;
-      return *this;
-    }
+    TNodeState(Node * const &w, TOutput const * const &o, bool const &d, unsigned int const &c = 1): where(w), output(o), dirty(d), copies(c){}
   };
 
   std::vector<TNodeState> state;
 
+  /**
+   * Scratch space for the paths being built by apply(), swapped with
+   * 'state' so that stepping reuses the same two vectors
+   */
+  std::vector<TNodeState> next_state;
+
+  /**
+   * Scratch space for epsilonClosure(): where the entries of the
+   * closure of each path start in closure_output, and the output of
+   * each entry
+   */
+  std::vector<size_t> closure_base;
+  std::vector<TOutput const *> closure_output;
+
+  /**
+   * Output histories created by this state.  They are released in
+   * constant time when the state is initialised or assigned, unless
+   * a copy of this state still points into them.
+   */
+  std::shared_ptr<Pool<TOutput>> history;
+
+  /**
+   * Pools of the states this one was copied from, which the histories
+   * of the paths may still point into
+   */
+  std::vector<std::shared_ptr<Pool<TOutput>>> inherited;
+
+  /**
+   * Stop using the current output histories
+   */
+  void releaseHistory();
+
+  /**
+   * Cache of subsets used by step_case(), NULL if the paths are always
+   * stepped
+   */
+  DFACache *dfa = nullptr;
+
+  /**
+   * Subset of the nodes reached, -1 if the state is not being stepped
+   * through the cache.  While it is, 'state' holds the paths as they
+   * were when the subset dfa_anchor was reached and lazy_steps the
+   * steps taken since, which are replayed when the paths are needed.
+   */
+  int dfa_subset = -1;
+  int dfa_anchor = -1;
+
+  struct LazyStep
+  {
+    UChar32 val;
+    bool caseSensitive;
+    int subset;
+  };
+  std::vector<LazyStep> lazy_steps;
+
+  /**
+   * Whether the state follows the one path of an input-deterministic
+   * transducer, see initDeterministic().  The path is then held by
+   * 'cursor', 'cursor_dirty' and 'cursor_output' instead of 'state',
+   * and 'cursor' is NULL once it has died.
+   */
+  bool single = false;
+  Node *cursor = nullptr;
+  bool cursor_dirty = false;
+  std::vector<std::pair<int, double>> cursor_output;
+
+  /**
+   * Make a transition of the single path, with the same meaning as
+   * apply_override(input, old_sym, new_sym) when alt is old_sym, and
+   * apply(input, alt) when old_sym is new_sym
+   * @return false if the step branches, after leaving single mode
+   */
+  bool stepSingle(int const input, int const alt, int const old_sym, int const new_sym);
+
+  /**
+   * Turn the single path into an ordinary one
+   */
+  void leaveSingle();
+
+  /**
+   * Whether the paths are merged and pruned after each step, and the
+   * limits they are pruned against, see setPruning()
+   */
+  bool pruning = false;
+  int beam_analyses = INT_MAX;
+  int beam_weight_classes = INT_MAX;
+
+  /**
+   * Scratch space for prune(): the paths by node and by their last
+   * output symbol, weight and the history before it, then by cost
+   */
+  struct PruneKey
+  {
+    Node *where;
+    bool dirty;
+    TOutput const *prev;
+    int symbol;
+    double weight;
+    double cost;
+    size_t index;
+  };
+  std::vector<PruneKey> prune_keys;
+
+  /**
+   * Merge the paths that repeat an earlier one into it, then drop those
+   * that cannot be among the best analyses, keeping the order of the
+   * rest
+   */
+  void prune();
+
+  /**
+   * Start stepping through the cache from the current paths, if there
+   * is a cache
+   */
+  void enterDFACache();
+
+  /**
+   * Replay the steps taken through the cache, or leave single mode, so
+   * that 'state' holds the current paths.  The paths are only a delayed
+   * form of the steps, so the const methods that need them also call
+   * this.
+   */
+  void catchUp();
+
+  /**
+   * Bring the paths up to date and stop using the cache, before
+   * changing them in a way the cache does not follow
+   */
+  void materialize();
+
+  /**
+   * Append a symbol to an output history
+   * @param prev the history so far
+   * @param symbol the output symbol
+   * @param weight the weight of the transition
+   * @return the extended history
+   */
+  TOutput const * extend(TOutput const *prev, int const symbol, double const weight);
+
+  /**
+   * Write out an output history in order
+   * @param output the last output of the path
+   * @param seq the vector to fill
+   */
+  static void sequence(TOutput const *output, std::vector<std::pair<int, double>> &seq);
+
   /**
    * Destroy function
    */
@@ -79,6 +230,13 @@ private:
    */
   bool apply_into(std::vector<TNodeState>* new_state, int const input, int index, bool dirty);
 
+  /**
+   * Follow the transitions [first, limit) of a path
+   * @param consume whether the transitions read a symbol and produce
+   *                output, false for epsilon transitions
+   */
+  bool apply_range(std::vector<TNodeState>* new_state, bool consume, int first, int const limit, int index, bool dirty);
+
   bool apply_into_override(std::vector<TNodeState>* new_state, int const input, int const old_sym, int const new_sym, int index, bool dirty);
 
   /**
@@ -127,7 +285,29 @@ private:
    */
   void epsilonClosure();
 
-  bool lastPartHasRequiredSymbol(const std::vector<std::pair<int, double>> &seq, int requiredSymbol, int separationSymbol);
+  /**
+   * Calculate the epsilon closure by following the epsilon transitions,
+   * for nodes without a precomputed closure
+   */
+  void epsilonWalk();
+
+  bool lastPartHasRequiredSymbol(TOutput const *output, int requiredSymbol, int separationSymbol);
+
+  /**
+   * Common part of the filterFinals() methods
+   * @param final_weight function giving a pointer to the weight of a
+   *                     node as a final node, or NULL if it is not final
+   */
+  template<typename FinalWeight>
+  UString filterFinalsBy(FinalWeight const &final_weight,
+                         Alphabet const &a,
+                         std::set<UChar32> const &escaped_chars,
+                         bool display_weights,
+                         int max_analyses,
+                         int max_weight_classes,
+                         bool uppercase,
+                         bool firstupper,
+                         int firstchar) const;
 
 public:
 
@@ -167,6 +347,38 @@ public:
    */
   int size() const;
 
+  /**
+   * Whether there are no alive transductions, cheaper than size() when
+   * stepping through a DFACache
+   */
+  bool isEmpty() const;
+
+  /**
+   * Step through a cache of subsets in step_case() from the next call
+   * to init(), or right away if there are no steps to replay.  The
+   * paths are only followed when the outputs are needed.
+   * @param cache the cache, NULL to always step the paths
+   */
+  void setDFACache(DFACache *cache);
+
+  /**
+   * Merge the paths that reach the same node with the same output after
+   * each step, and drop those that NFinals() would never choose with
+   * the same limits: the paths at a node have the same continuations,
+   * so only the cheapest ones at each node can end up among the best.
+   * A merged path still counts for as many analyses as it stands for,
+   * so the analyses output are those given without pruning.
+   * Pruning assumes the paths are not filtered by their output later
+   * on, as pruneCompounds() does.  The cache of subsets is not used
+   * while pruning, as it does not follow it.
+   * @param value whether to merge and prune the paths
+   * @param max_analyses analyses kept, INT_MAX not to prune by number
+   * @param max_weight_classes weight classes kept, INT_MAX not to prune
+   *                           by weight
+   */
+  void setPruning(bool value, int max_analyses = INT_MAX,
+                  int max_weight_classes = INT_MAX);
+
   /**
    * step = apply + epsilonClosure
    * @param input the input symbol
@@ -207,6 +419,16 @@ public:
    */
   void init(Node *initial);
 
+  /**
+   * Init the state with the initial node of an input-deterministic
+   * transducer (see TransExe::isDeterministic), whose one path is
+   * stepped without keeping a vector of paths.  Steps that would
+   * branch, such as case variants that both match, or the methods that
+   * need the paths, turn it into an ordinary state.
+   * @param initial the initial node of the transducer
+   */
+  void initDeterministic(Node *initial);
+
   /**
     * Remove states not containing a specific symbol in their last 'part', and states
     * with more than a number of 'parts'
@@ -271,6 +493,21 @@ public:
                        bool firstupper = false,
                        int firstchar = 0) const;
 
+  /**
+   * Same as previous one, but testing the final classes set on the
+   * nodes with Node::setFinal instead of looking them up in a set
+   * @param final_class bits of the classes of final nodes to accept
+   */
+  UString filterFinals(unsigned int const final_class,
+                       Alphabet const &a,
+                       std::set<UChar32> const &escaped_chars,
+                       bool display_weights = false,
+                       int max_analyses = INT_MAX,
+                       int max_weight_classes = INT_MAX,
+                       bool uppercase = false,
+                       bool firstupper = false,
+                       int firstchar = 0) const;
+
   /**
    * Same as previous one, but  the output is adapted to the SAO system
    * @param finals the set of final nodes
@@ -332,6 +569,14 @@ public:
    */
   bool isFinal(std::map<Node *, double> const &finals) const;
 
+  /**
+   * Returns true if at least one record of the state references a
+   * node marked final in one of the given classes
+   * @param final_class bits of the classes of final nodes to accept
+   * @return true if the state is final
+   */
+  bool isFinal(unsigned int const final_class) const;
+
   /**
    * Return the full states string (to allow debuging...) using a Java ArrayList.toString style
    */
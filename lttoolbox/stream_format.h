@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2022 Apertium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LT_STREAM_FORMAT_H_
+#define _LT_STREAM_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Binary format of the stream between lt-proc stages, an alternative
+ * to the ^surface/lexical<tags>$ text format that needs no escaping
+ * and no parsing.  The stream starts with HEADER_STREAM, followed by
+ * records of a type byte, a byte length (as a varint) and a payload:
+ *
+ *   SR_BLANK  the UTF-8 text between two lexical units, superblanks
+ *             and wordbound blanks included, exactly as in the text
+ *             format; it is copied, never parsed
+ *   SR_TAG    a tag, <n> in UTF-8; the tags of a stream are numbered
+ *             from 0 in the order of their records
+ *   SR_WORD   the contents of a lexical unit in UTF-8, unescaped, with
+ *             each tag as the byte WORD_TAG, which UTF-8 never uses,
+ *             followed by its number as a varint
+ *   SR_NULL   the null character of a null-flushed stream, which has
+ *             neither length nor payload
+ *
+ * Varints hold 7 bits per byte, lowest first, with the high bit set on
+ * all bytes but the last.
+ */
+
+constexpr char HEADER_STREAM[4]{'L', 'T', 'B', 'S'};
+
+enum StreamRecord : unsigned char {
+  SR_NULL = 0,
+  SR_BLANK = 'b',
+  SR_TAG = 't',
+  SR_WORD = 'w',
+};
+
+constexpr unsigned char WORD_TAG = 0xFF;
+
+inline void
+writeVarint(std::string& out, uint32_t value)
+{
+  while (value >= 0x80) {
+    out += static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+// returns nullptr if [p, limit) ends before the varint does
+inline char const*
+readVarint(char const* p, char const* limit, uint32_t& value)
+{
+  value = 0;
+  for (int shift = 0; p != limit && shift < 35; shift += 7) {
+    unsigned char const byte = *p++;
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+#endif
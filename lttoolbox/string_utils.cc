@@ -138,6 +138,16 @@ StringUtils::stod(const UString& str)
   return ret;
 }
 
+StringUtils::CaseTable::CaseTable()
+{
+  for (UChar32 c = 0; c < SIZE; c++) {
+    lower[c] = u_tolower(c);
+    upper[c] = u_isupper(c);
+  }
+}
+
+StringUtils::CaseTable const StringUtils::case_table;
+
 UString
 StringUtils::tolower(const UString& str)
 {
@@ -2,6 +2,7 @@
 #define __LT_STRING_UTILS_H__
 
 #include <lttoolbox/ustring.h>
+#include <unicode/uchar.h>
 #include <vector>
 
 class StringUtils {
@@ -29,6 +30,11 @@ public:
   static UString toupper(const UString& str);
   static UString totitle(const UString& str);
 
+  // u_isupper and u_tolower of a single character, looked up in a table
+  // for Latin, Greek, Cyrillic and the other scripts below U+0800
+  static bool isupper(UChar32 c);
+  static UChar32 tolower(UChar32 c);
+
   static UString getcase(const UString& str);
   static UString copycase(const UString& source, const UString& target);
 
@@ -37,6 +43,34 @@ public:
   static bool endswith(const UString& str, const UString& suffix);
 
   static UString merge_wblanks(const UString& w1, const UString& w2);
+
+private:
+  struct CaseTable
+  {
+    static constexpr UChar32 SIZE = 0x800;
+    UChar32 lower[SIZE];
+    bool upper[SIZE];
+    CaseTable();
+  };
+  static CaseTable const case_table;
 };
 
+inline bool
+StringUtils::isupper(UChar32 c)
+{
+  if (c >= 0 && c < CaseTable::SIZE) {
+    return case_table.upper[c];
+  }
+  return u_isupper(c);
+}
+
+inline UChar32
+StringUtils::tolower(UChar32 c)
+{
+  if (c >= 0 && c < CaseTable::SIZE) {
+    return case_table.lower[c];
+  }
+  return u_tolower(c);
+}
+
 #endif // __LT_STRING_UTILS_H__
@@ -18,11 +18,27 @@
 #include <lttoolbox/trans_exe.h>
 #include <lttoolbox/compression.h>
 #include <lttoolbox/my_stdio.h>
+#include <lttoolbox/string_utils.h>
+#include <lttoolbox/transducer.h>
+#include <algorithm>
 #include <cstring>
+#include <new>
+#include <sstream>
+#include <type_traits>
 
 TransExe::TransExe():
 initial_id(0),
-default_weight(0.0000)
+default_weight(0.0000),
+node_list(nullptr),
+node_count(0),
+arc_total(0),
+arc_offset(nullptr),
+arc_input(nullptr),
+arc_output(nullptr),
+arc_target(nullptr),
+arc_weight(nullptr),
+indices(nullptr),
+deterministic(false)
 {
 }
 
@@ -52,113 +68,1237 @@ TransExe::copy(TransExe const &te)
 {
   initial_id = te.initial_id;
   default_weight = te.default_weight;
-  node_list = te.node_list;
-  finals = te.finals;
+  own_offset = te.own_offset;
+  own_input = te.own_input;
+  own_output = te.own_output;
+  own_target = te.own_target;
+  own_weight = te.own_weight;
+  mapping = te.mapping;
+  if(mapping)
+  {
+    arc_total = te.arc_total;
+    arc_offset = te.arc_offset;
+    arc_input = te.arc_input;
+    arc_output = te.arc_output;
+    arc_target = te.arc_target;
+    arc_weight = te.arc_weight;
+  }
+  else
+  {
+    useOwned();
+  }
+  own_indices = te.own_indices;
+  node_count = te.node_count;
+
+  std::map<unsigned int, double> final_ids;
+  for(auto& it : te.finals)
+  {
+    final_ids[it.first - te.node_list] = it.second;
+  }
+  // mapped indices are shared like the arrays, but the nodes are not,
+  // since they are marked as final
+  link(own_indices.empty() ? te.indices : reinterpret_cast<char const *>(own_indices.data()),
+       nullptr, final_ids);
 }
 
 void
 TransExe::destroy()
 {
+  finals.clear();
+  if(!own_links.empty())
+  {
+    for(unsigned int i = 0; i != node_count; i++)
+    {
+      node_list[i].~Node();
+    }
+  }
+  own_links.clear();
+  node_list = nullptr;
+  node_count = 0;
+  own_offset.clear();
+  own_input.clear();
+  own_output.clear();
+  own_target.clear();
+  own_weight.clear();
+  mapping.reset();
+  useOwned();
+  own_indices.clear();
+  indices = nullptr;
+}
+
+void
+TransExe::useOwned()
+{
+  arc_total = own_input.size();
+  arc_offset = own_offset.data();
+  arc_input = own_input.data();
+  arc_output = own_output.data();
+  arc_target = own_target.data();
+  arc_weight = own_weight.data();
+}
+
+/**
+ * Transitions with a given input symbol among count transitions sorted
+ * by input symbol, as found by Node::findTransitions
+ */
+static int
+findArcs(int const *input, int count, int symbol, int &first)
+{
+  first = std::lower_bound(input, input + count, symbol) - input;
+  int last = first;
+  while(last != count && input[last] == symbol)
+  {
+    last++;
+  }
+  return last;
+}
+
+/*
+ * Layout of the indices, in native byte order, which can follow the
+ * layout of writeRaw:
+ *   letter limit l, letters c, dense nodes d, nodes n, case entries e,
+ *     closures k, closure levels v, closure entries t, whether
+ *     deterministic, 0, 0, INDEX_VERSION (4 bytes each)
+ *   letter_id (l), dense nodes (d), their ranges (2*c each),
+ *     case entry offset of each node (n+1), case entries (5 each),
+ *     for each closure its node, number of levels, first level and
+ *     first entry (4 each), levels (v), and the destination, parent
+ *     entry and output symbol of each closure entry (t each), 4 bytes
+ *     each, padded to 8 bytes
+ *   output weight of each closure entry (t), 8 bytes each
+ */
+
+/**
+ * Version of the layout of the indices, to be increased whenever it
+ * changes; indices of another version are computed again
+ */
+static unsigned int const INDEX_VERSION = 2;
+
+// case entries are read from the indices as they are
+static_assert(sizeof(CaseEntry) == 5 * sizeof(int), "CaseEntry has padding");
+
+enum IndexHeader
+{
+  IH_LETTER_LIMIT, IH_LETTERS, IH_DENSE, IH_NODES, IH_CASE, IH_CLOSURES,
+  IH_LEVELS, IH_DESTS, IH_DETERMINISTIC, IH_VERSION = 11, IH_SIZE = 12
+};
+
+// the sizes are computed in size_t, as those read from a file may be
+// anything
+
+static size_t
+indexInts(unsigned int const *h)
+{
+  return IH_SIZE + size_t(h[IH_LETTER_LIMIT]) +
+         size_t(h[IH_DENSE]) * (1 + 2 * size_t(h[IH_LETTERS])) +
+         size_t(h[IH_NODES]) + 1 + 5 * size_t(h[IH_CASE]) +
+         4 * size_t(h[IH_CLOSURES]) + size_t(h[IH_LEVELS]) +
+         3 * size_t(h[IH_DESTS]);
+}
+
+static size_t
+indexSize(unsigned int const *h)
+{
+  size_t const ints = 4 * indexInts(h);
+  return ints + (8 - ints % 8) % 8 + 8 * size_t(h[IH_DESTS]);
 }
 
-#include <iostream>
+/**
+ * The arrays of the indices at some memory, as laid out by
+ * computeIndices
+ */
+struct IndexArrays
+{
+  unsigned int const *h;
+  int const *letter_id;
+  unsigned int const *dense_node;
+  int const *dense_range;
+  unsigned int const *case_offset;
+  CaseEntry const *case_entry;
+  unsigned int const *closure_head;
+  unsigned int const *closure_level;
+  unsigned int const *closure_target;
+  int const *closure_parent;
+  int const *closure_symbol;
+  double const *closure_weight;
+
+  IndexArrays(char const *indices)
+  {
+    h = reinterpret_cast<unsigned int const *>(indices);
+    letter_id = reinterpret_cast<int const *>(h + IH_SIZE);
+    dense_node = reinterpret_cast<unsigned int const *>(letter_id + h[IH_LETTER_LIMIT]);
+    dense_range = reinterpret_cast<int const *>(dense_node + h[IH_DENSE]);
+    case_offset = reinterpret_cast<unsigned int const *>(dense_range + size_t(h[IH_DENSE]) * 2 * h[IH_LETTERS]);
+    case_entry = reinterpret_cast<CaseEntry const *>(case_offset + h[IH_NODES] + 1);
+    closure_head = reinterpret_cast<unsigned int const *>(case_entry + h[IH_CASE]);
+    closure_level = closure_head + 4 * size_t(h[IH_CLOSURES]);
+    closure_target = closure_level + h[IH_LEVELS];
+    closure_parent = reinterpret_cast<int const *>(closure_target + h[IH_DESTS]);
+    closure_symbol = closure_parent + h[IH_DESTS];
+    size_t const ints = 4 * indexInts(h);
+    closure_weight = reinterpret_cast<double const *>(indices + ints + (8 - ints % 8) % 8);
+  }
+
+  int const * range(unsigned int k) const
+  {
+    return dense_range + size_t(k) * 2 * h[IH_LETTERS];
+  }
+
+  unsigned int const * head(unsigned int k) const
+  {
+    return closure_head + 4 * size_t(k);
+  }
+};
 
 void
-TransExe::read(FILE *input, Alphabet const &alphabet)
+TransExe::computeIndices()
 {
-  bool read_weights = false;
+  std::vector<unsigned int> h(IH_SIZE, 0);
+  h[IH_NODES] = node_count;
 
-  fpos_t pos;
-  if (fgetpos(input, &pos) == 0) {
-      char header[4]{};
-      fread_unlocked(header, 1, 4, input);
-      if (strncmp(header, HEADER_TRANSDUCER, 4) == 0) {
-          auto features = read_le<uint64_t>(input);
-          if (features >= TDF_UNKNOWN) {
-              throw std::runtime_error("Transducer has features that are unknown to this version of lttoolbox - upgrade!");
-          }
-          read_weights = (features & TDF_WEIGHTS);
+  bool det = true;
+  for(size_t i = 0; i != node_count && det; i++)
+  {
+    for(unsigned int a = arc_offset[i], a_limit = arc_offset[i+1]; a != a_limit; a++)
+    {
+      // the transitions are sorted by input symbol
+      if(arc_input[a] == 0 || (a != arc_offset[i] && arc_input[a] == arc_input[a-1]))
+      {
+        det = false;
+        break;
+      }
+    }
+  }
+  h[IH_DETERMINISTIC] = det;
+
+  // compact numbering of the letters in the BMP, so that it stays a
+  // small array
+  int const max_letter = 0xFFFF;
+  int letter_limit = 0;
+  for(unsigned int a = 0; a != arc_total; a++)
+  {
+    if(arc_input[a] > 0 && arc_input[a] <= max_letter && arc_input[a] >= letter_limit)
+    {
+      letter_limit = arc_input[a] + 1;
+    }
+  }
+  std::vector<int> letter_id(letter_limit, -1);
+  int letter_count = 0;
+  for(unsigned int a = 0; a != arc_total; a++)
+  {
+    if(arc_input[a] > 0 && arc_input[a] < letter_limit && letter_id[arc_input[a]] < 0)
+    {
+      letter_id[arc_input[a]] = letter_count++;
+    }
+  }
+  h[IH_LETTER_LIMIT] = letter_limit;
+  h[IH_LETTERS] = letter_count;
+
+  std::vector<unsigned int> dense_node;
+  std::vector<int> dense_range;
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    if(arc_offset[i+1] - arc_offset[i] <= DENSE_THRESHOLD)
+    {
+      continue;
+    }
+    size_t const base = dense_range.size();
+    dense_range.resize(base + 2 * letter_count, 0);
+    int const count = arc_offset[i+1] - arc_offset[i];
+    int const *input = arc_input + arc_offset[i];
+    for(int j = 0; j != count;)
+    {
+      int k = j + 1;
+      while(k != count && input[k] == input[j])
+      {
+        k++;
       }
-      else {
-          // Old binary format
-          fsetpos(input, &pos);
+      if(input[j] > 0 && input[j] < letter_limit)
+      {
+        dense_range[base + 2 * letter_id[input[j]]] = j;
+        dense_range[base + 2 * letter_id[input[j]] + 1] = k;
       }
+      j = k;
+    }
+    dense_node.push_back(i);
+  }
+  h[IH_DENSE] = dense_node.size();
+
+  std::vector<unsigned int> case_offset(1, 0);
+  std::vector<int> case_entry;
+  for(size_t i = 0; i != node_count; i++)
+  {
+    int const count = arc_offset[i+1] - arc_offset[i];
+    int const *arcs = arc_input + arc_offset[i];
+    for(int j = 0; j != count;)
+    {
+      int const input = arcs[j];
+      int k = j;
+      while(k != count && arcs[k] == input)
+      {
+        k++;
+      }
+      int const lower = input > 0 ? StringUtils::tolower(input) : input;
+      if(lower != input)
+      {
+        int lower_first;
+        int const lower_limit = findArcs(arcs, count, lower, lower_first);
+        case_entry.insert(case_entry.end(), {input, j, k, lower_first, lower_limit});
+      }
+      j = k;
+    }
+    case_offset.push_back(case_entry.size() / 5);
+  }
+  h[IH_CASE] = case_entry.size() / 5;
+
+  // budget on the closure entries of all the nodes together, so that
+  // long epsilon chains do not make loading slow; the nodes whose
+  // closure does not fit in what is left are walked at runtime like in
+  // transducers built in memory
+  size_t budget = std::max<size_t>(1 << 12, 4 * static_cast<size_t>(arc_total));
+
+  struct Step
+  {
+    unsigned int node;
+    int parent;
+    int symbol;
+    double weight;
+  };
+  std::vector<Step> walk;
+  std::vector<unsigned int> closure_head, closure_level, closure_target;
+  std::vector<int> closure_parent, closure_symbol;
+  std::vector<double> closure_weight;
+
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    int j;
+    int const j_limit = findArcs(arc_input + arc_offset[i], arc_offset[i+1] - arc_offset[i], 0, j);
+    if(j_limit == j)
+    {
+      continue;
+    }
+
+    // the entries of the closure, each with the entry whose path it
+    // extends by one transition, -1 for the node itself
+    walk.clear();
+    for(unsigned int a = arc_offset[i] + j, a_limit = arc_offset[i] + j_limit; a != a_limit; a++)
+    {
+      walk.push_back({arc_target[a], -1, arc_output[a], arc_weight[a]});
+    }
+    size_t const level_base = closure_level.size();
+    closure_level.push_back(0);
+    size_t begin = 0;
+    bool over = walk.size() > budget;
+    // each round records where the level it expands ends, so the final
+    // round, which finds nothing new, closes the last level
+    while(begin != walk.size() && !over)
+    {
+      size_t const end = walk.size();
+      closure_level.push_back(end);
+      for(size_t k = begin; k != end && !over; k++)
+      {
+        unsigned int const from = walk[k].node;
+        int first;
+        int const last = findArcs(arc_input + arc_offset[from], arc_offset[from+1] - arc_offset[from], 0, first);
+        for(unsigned int a = arc_offset[from] + first, a_limit = arc_offset[from] + last; a != a_limit; a++)
+        {
+          walk.push_back({arc_target[a], static_cast<int>(k), arc_output[a], arc_weight[a]});
+        }
+        over = walk.size() > budget;
+      }
+      begin = end;
+    }
+    if(over)
+    {
+      // recorded without levels to be walked at runtime
+      budget = 0;
+      closure_level.resize(level_base);
+      closure_head.insert(closure_head.end(), {i, 0, 0, 0});
+      continue;
+    }
+    budget -= walk.size();
+
+    closure_head.insert(closure_head.end(), {
+      i, static_cast<unsigned int>(closure_level.size() - level_base),
+      static_cast<unsigned int>(level_base),
+      static_cast<unsigned int>(closure_target.size())});
+    for(auto const &step : walk)
+    {
+      closure_target.push_back(step.node);
+      closure_parent.push_back(step.parent);
+      closure_symbol.push_back(step.symbol);
+      closure_weight.push_back(step.weight);
+    }
+  }
+  h[IH_CLOSURES] = closure_head.size() / 4;
+  h[IH_LEVELS] = closure_level.size();
+  h[IH_DESTS] = closure_target.size();
+  h[IH_VERSION] = INDEX_VERSION;
+
+  own_indices.assign(indexSize(h.data()) / 8, 0);
+  char *out = reinterpret_cast<char *>(own_indices.data());
+  auto put = [&out](void const *data, size_t size) {
+    memcpy(out, data, size);
+    out += size;
+  };
+  put(h.data(), 4 * h.size());
+  put(letter_id.data(), 4 * letter_id.size());
+  put(dense_node.data(), 4 * dense_node.size());
+  put(dense_range.data(), 4 * dense_range.size());
+  put(case_offset.data(), 4 * case_offset.size());
+  put(case_entry.data(), 4 * case_entry.size());
+  put(closure_head.data(), 4 * closure_head.size());
+  put(closure_level.data(), 4 * closure_level.size());
+  put(closure_target.data(), 4 * closure_target.size());
+  put(closure_parent.data(), 4 * closure_parent.size());
+  put(closure_symbol.data(), 4 * closure_symbol.size());
+  out += (8 - (4 * indexInts(h.data())) % 8) % 8;
+  put(closure_weight.data(), 8 * closure_weight.size());
+  indices = reinterpret_cast<char const *>(own_indices.data());
+}
+
+void
+TransExe::link(char const *index_data, char const *link_data,
+               std::map<unsigned int, double> const &final_ids)
+{
+  indices = index_data;
+  if(index_data == nullptr || link_data == nullptr || !useLinks(link_data))
+  {
+    if(index_data == nullptr)
+    {
+      computeIndices();
+    }
+    own_links.assign(linkSize() / 8, 0);
+    node_list = layOutLinks(reinterpret_cast<char *>(own_links.data()));
+  }
+  deterministic = reinterpret_cast<unsigned int const *>(indices)[IH_DETERMINISTIC];
+
+  finals.clear();
+  for(auto& it : final_ids)
+  {
+    finals.insert(std::make_pair(&node_list[it.first], it.second));
+  }
+}
+
+/*
+ * Layout of the links, in native byte order, which can follow the
+ * indices:
+ *   LINK_VERSION, the sizes of Node, EpsilonClosure and DenseIndex,
+ *     number of nodes n, of arcs a, of closure destinations t, of dense
+ *     nodes d and of closures k, 0 (4 bytes each)
+ *   the destination of each arc (a) and of each closure (t), as RelPtr
+ *   the dense indices (d), the closures (k) and the nodes (n)
+ * Every pointer is a RelPtr, so the whole layout can be mapped.
+ */
+
+/**
+ * Version of the layout of the links, to be increased whenever it or
+ * the members of Node, EpsilonClosure or DenseIndex change; links of
+ * another version are laid out again
+ */
+static unsigned int const LINK_VERSION = 1;
+
+// the links are used in place, as they were written
+static_assert(std::is_standard_layout<Node>::value, "Node is not standard-layout");
+static_assert(std::is_standard_layout<EpsilonClosure>::value, "EpsilonClosure is not standard-layout");
+static_assert(std::is_standard_layout<DenseIndex>::value, "DenseIndex is not standard-layout");
+
+enum LinkHeader
+{
+  LH_VERSION, LH_NODE, LH_CLOSURE, LH_DENSE, LH_NODES, LH_ARCS, LH_DESTS,
+  LH_DENSE_NODES, LH_CLOSURES, LH_PADDING, LH_SIZE
+};
+
+static size_t
+linkSize(unsigned int const *h)
+{
+  return 4 * LH_SIZE + sizeof(RelPtr<Node>) * (h[LH_ARCS] + h[LH_DESTS]) +
+         h[LH_DENSE] * h[LH_DENSE_NODES] + h[LH_CLOSURE] * h[LH_CLOSURES] +
+         h[LH_NODE] * h[LH_NODES];
+}
+
+void
+TransExe::linkHeader(unsigned int *h) const
+{
+  unsigned int const *ih = reinterpret_cast<unsigned int const *>(indices);
+  h[LH_VERSION] = LINK_VERSION;
+  h[LH_NODE] = sizeof(Node);
+  h[LH_CLOSURE] = sizeof(EpsilonClosure);
+  h[LH_DENSE] = sizeof(DenseIndex);
+  h[LH_NODES] = node_count;
+  h[LH_ARCS] = arc_total;
+  h[LH_DESTS] = ih[IH_DESTS];
+  h[LH_DENSE_NODES] = ih[IH_DENSE];
+  h[LH_CLOSURES] = ih[IH_CLOSURES];
+  h[LH_PADDING] = 0;
+}
+
+size_t
+TransExe::linkSize() const
+{
+  unsigned int h[LH_SIZE];
+  linkHeader(h);
+  return ::linkSize(h);
+}
+
+bool
+TransExe::validArcs() const
+{
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    if(arc_offset[i] > arc_offset[i+1])
+    {
+      return false;
+    }
+  }
+  for(unsigned int a = 0; a != arc_total; a++)
+  {
+    if(arc_target[a] >= node_count)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+TransExe::validIndices() const
+{
+  IndexArrays const ix(indices);
+  unsigned int const *h = ix.h;
+
+  auto arcs = [this](unsigned int i) { return int(arc_offset[i+1] - arc_offset[i]); };
+  auto range = [](int first, int limit, int count) {
+    return 0 <= first && first <= limit && limit <= count;
+  };
+
+  for(unsigned int c = 0; c != h[IH_LETTER_LIMIT]; c++)
+  {
+    if(ix.letter_id[c] >= 0 && unsigned(ix.letter_id[c]) >= h[IH_LETTERS])
+    {
+      return false;
+    }
+  }
+  for(unsigned int k = 0; k != h[IH_DENSE]; k++)
+  {
+    if(ix.dense_node[k] >= node_count)
+    {
+      return false;
+    }
+    int const *r = ix.range(k);
+    for(unsigned int j = 0; j != h[IH_LETTERS]; j++)
+    {
+      if(!range(r[2*j], r[2*j+1], arcs(ix.dense_node[k])))
+      {
+        return false;
+      }
+    }
+  }
+
+  if(ix.case_offset[node_count] > h[IH_CASE])
+  {
+    return false;
+  }
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    if(ix.case_offset[i] > ix.case_offset[i+1])
+    {
+      return false;
+    }
+    for(unsigned int e = ix.case_offset[i]; e != ix.case_offset[i+1]; e++)
+    {
+      CaseEntry const &c = ix.case_entry[e];
+      if(!range(c.upper_first, c.upper_limit, arcs(i)) ||
+         !range(c.lower_first, c.lower_limit, arcs(i)))
+      {
+        return false;
+      }
+    }
+  }
+
+  for(unsigned int k = 0; k != h[IH_CLOSURES]; k++)
+  {
+    unsigned int const *head = ix.head(k);
+    if(head[0] >= node_count)
+    {
+      return false;
+    }
+    if(head[1] == 0)
+    {
+      continue;
+    }
+    // levels head[2] to head[2] + head[1] - 1, the last one being the
+    // number of destinations from head[3] on
+    if(head[2] > h[IH_LEVELS] || head[1] > h[IH_LEVELS] - head[2])
+    {
+      return false;
+    }
+    unsigned int const *level = ix.closure_level + head[2];
+    unsigned int const count = level[head[1] - 1];
+    if(head[3] > h[IH_DESTS] || count > h[IH_DESTS] - head[3])
+    {
+      return false;
+    }
+    // a destination extends the path to one of an earlier level
+    int const *parent = ix.closure_parent + head[3];
+    for(unsigned int l = 0; l + 1 < head[1]; l++)
+    {
+      if(level[l] > level[l+1])
+      {
+        return false;
+      }
+      for(unsigned int d = level[l]; d != level[l+1]; d++)
+      {
+        if(parent[d] < -1 || parent[d] >= int(level[l]))
+        {
+          return false;
+        }
+      }
+    }
+  }
+  for(unsigned int k = 0; k != h[IH_DESTS]; k++)
+  {
+    if(ix.closure_target[k] >= node_count)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+Node *
+TransExe::layOutLinks(char *out) const
+{
+  IndexArrays const ix(indices);
+  unsigned int const *h = ix.h;
+
+  unsigned int *lh = reinterpret_cast<unsigned int *>(out);
+  linkHeader(lh);
+  RelPtr<Node> *arc_dest = reinterpret_cast<RelPtr<Node> *>(out + 4 * LH_SIZE);
+  RelPtr<Node> *closure_dest = arc_dest + arc_total;
+  DenseIndex *dense = reinterpret_cast<DenseIndex *>(closure_dest + h[IH_DESTS]);
+  EpsilonClosure *closures = reinterpret_cast<EpsilonClosure *>(dense + h[IH_DENSE]);
+  Node *nodes = reinterpret_cast<Node *>(closures + h[IH_CLOSURES]);
+
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    new (&nodes[i]) Node();
+  }
+  for(unsigned int a = 0; a != arc_total; a++)
+  {
+    new (&arc_dest[a]) RelPtr<Node>(&nodes[arc_target[a]]);
+  }
+  for(unsigned int k = 0; k != h[IH_DESTS]; k++)
+  {
+    new (&closure_dest[k]) RelPtr<Node>(&nodes[ix.closure_target[k]]);
+  }
+
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    unsigned int const first = arc_offset[i];
+    Node &node = nodes[i];
+    node.usePacked(arc_offset[i+1] - first, arc_input + first,
+                   arc_output + first, arc_dest + first,
+                   arc_weight + first);
+    node.case_count = ix.case_offset[i+1] - ix.case_offset[i];
+    node.case_index = ix.case_entry + ix.case_offset[i];
+    node.closure_levels = 0;
+  }
+
+  for(unsigned int k = 0; k != h[IH_DENSE]; k++)
+  {
+    new (&dense[k]) DenseIndex();
+    dense[k].letter_id = ix.letter_id;
+    dense[k].letter_limit = h[IH_LETTER_LIMIT];
+    dense[k].range = ix.range(k);
+    nodes[ix.dense_node[k]].dense = &dense[k];
+  }
+
+  for(unsigned int k = 0; k != h[IH_CLOSURES]; k++)
+  {
+    unsigned int const *head = ix.head(k);
+    Node &node = nodes[head[0]];
+    new (&closures[k]) EpsilonClosure();
+    if(head[1] == 0)
+    {
+      node.closure_levels = -1;
+      continue;
+    }
+    closures[k].level = ix.closure_level + head[2];
+    closures[k].dest = closure_dest + head[3];
+    closures[k].parent = ix.closure_parent + head[3];
+    closures[k].symbol = ix.closure_symbol + head[3];
+    closures[k].weight = ix.closure_weight + head[3];
+    node.closure_levels = head[1] - 1;
+    node.closure = &closures[k];
+  }
+
+  return nodes;
+}
+
+/**
+ * Position of p in the array of count elements at base, or count if it
+ * does not point to one of them
+ */
+template<typename T>
+static size_t
+positionIn(T const *p, T const *base, size_t count)
+{
+  uintptr_t const d = reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(base);
+  if(p < base || d % sizeof(T) != 0 || d / sizeof(T) >= count)
+  {
+    return count;
+  }
+  return d / sizeof(T);
+}
+
+bool
+TransExe::validLinks(char const *data) const
+{
+  // every pointer must be the one layOutLinks would store
+  IndexArrays const ix(indices);
+  unsigned int const *h = ix.h;
+  RelPtr<Node> const *arc_dest = reinterpret_cast<RelPtr<Node> const *>(data + 4 * LH_SIZE);
+  RelPtr<Node> const *closure_dest = arc_dest + arc_total;
+  DenseIndex const *dense = reinterpret_cast<DenseIndex const *>(closure_dest + h[IH_DESTS]);
+  EpsilonClosure const *closures = reinterpret_cast<EpsilonClosure const *>(dense + h[IH_DENSE]);
+  Node const *nodes = reinterpret_cast<Node const *>(closures + h[IH_CLOSURES]);
+
+  for(unsigned int a = 0; a != arc_total; a++)
+  {
+    if(arc_dest[a].get() != &nodes[arc_target[a]])
+    {
+      return false;
+    }
+  }
+  for(unsigned int k = 0; k != h[IH_DESTS]; k++)
+  {
+    if(closure_dest[k].get() != &nodes[ix.closure_target[k]])
+    {
+      return false;
+    }
+  }
+
+  for(unsigned int k = 0; k != h[IH_DENSE]; k++)
+  {
+    if(dense[k].letter_id.get() != ix.letter_id ||
+       dense[k].letter_limit != int(h[IH_LETTER_LIMIT]) ||
+       dense[k].range.get() != ix.range(k) ||
+       nodes[ix.dense_node[k]].dense.get() != &dense[k])
+    {
+      return false;
+    }
+  }
+  for(unsigned int k = 0; k != h[IH_CLOSURES]; k++)
+  {
+    unsigned int const *head = ix.head(k);
+    if(head[1] == 0)
+    {
+      continue;
+    }
+    EpsilonClosure const &c = closures[k];
+    if(c.level.get() != ix.closure_level + head[2] ||
+       c.dest.get() != closure_dest + head[3] ||
+       c.parent.get() != ix.closure_parent + head[3] ||
+       c.symbol.get() != ix.closure_symbol + head[3] ||
+       c.weight.get() != ix.closure_weight + head[3])
+    {
+      return false;
+    }
+  }
+
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    unsigned int const first = arc_offset[i];
+    Node const &node = nodes[i];
+    if(node.local != nullptr ||
+       node.arc_count != int(arc_offset[i+1] - first) ||
+       node.arc_input.get() != arc_input + first ||
+       node.arc_output.get() != arc_output + first ||
+       node.arc_dest.get() != arc_dest + first ||
+       node.arc_weight.get() != arc_weight + first ||
+       node.case_count != int(ix.case_offset[i+1] - ix.case_offset[i]) ||
+       node.case_index.get() != ix.case_entry + ix.case_offset[i])
+    {
+      return false;
+    }
+    if(node.dense != nullptr)
+    {
+      size_t const k = positionIn(node.dense.get(), dense, h[IH_DENSE]);
+      if(k == h[IH_DENSE] || ix.dense_node[k] != i)
+      {
+        return false;
+      }
+    }
+    if(node.closure == nullptr)
+    {
+      if(node.closure_levels != 0 && node.closure_levels != -1)
+      {
+        return false;
+      }
+      continue;
+    }
+    size_t const k = positionIn(node.closure.get(), closures, h[IH_CLOSURES]);
+    if(k == h[IH_CLOSURES] || ix.head(k)[0] != i || ix.head(k)[1] == 0 ||
+       node.closure_levels != int(ix.head(k)[1] - 1))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+TransExe::useLinks(char const *data)
+{
+  unsigned int h[LH_SIZE];
+  linkHeader(h);
+  if(memcmp(data, h, sizeof(h)) != 0 || !validLinks(data))
+  {
+    // laid out by a build with another layout, not for these arrays,
+    // or damaged
+    return false;
+  }
+  // the nodes are marked as final in place, the memory is writable
+  // like a private mapping, see readBlock
+  node_list = reinterpret_cast<Node *>(const_cast<char *>(data) + ::linkSize(h) - sizeof(Node) * node_count);
+  return true;
+}
+
+void
+TransExe::read(FILE *input, Alphabet const &alphabet)
+{
+  CompressedInput in(input);
+  read(in, alphabet);
+}
+
+void
+TransExe::read(CompressedInput &input, Alphabet const &alphabet)
+{
+  bool read_weights = false;
+
+  if(input.header(HEADER_TRANSDUCER))
+  {
+    auto features = input.read_u64_le();
+    if (features >= TDF_UNKNOWN) {
+      throw std::runtime_error("Transducer has features that are unknown to this version of lttoolbox - upgrade!");
+    }
+    read_weights = (features & TDF_WEIGHTS);
   }
 
   TransExe &new_t = *this;
   new_t.destroy();
-  new_t.initial_id = Compression::multibyte_read(input);
-  int finals_size = Compression::multibyte_read(input);
+  new_t.initial_id = input.multibyte_read();
+  int finals_size = input.multibyte_read();
 
   int base = 0;
   double base_weight = default_weight;
 
-  std::map<int, double> myfinals;
+  std::map<unsigned int, double> myfinals;
 
   while(finals_size > 0)
   {
     finals_size--;
 
-    base += Compression::multibyte_read(input);
+    base += input.multibyte_read();
     if(read_weights)
     {
-      base_weight = Compression::long_multibyte_read(input);
+      base_weight = input.long_multibyte_read();
     }
     myfinals.insert(std::make_pair(base, base_weight));
   }
 
 
-  base = Compression::multibyte_read(input);
+  base = input.multibyte_read();
 
   int number_of_states = base;
   int current_state = 0;
-  new_t.node_list.resize(number_of_states);
+  new_t.node_count = number_of_states;
 
-  for(auto it = myfinals.begin(), limit = myfinals.end();
-      it != limit; it++)
+  struct Arc
   {
-    new_t.finals.insert(std::make_pair(&new_t.node_list[it->first], it->second));
-  }
+    int input;
+    int output;
+    unsigned int target;
+    double weight;
+  };
+  std::vector<Arc> local_arcs;
+  std::vector<unsigned int> values;
+
+  new_t.own_offset.reserve(number_of_states + 1);
+  new_t.own_offset.push_back(0);
 
   while(number_of_states > 0)
   {
-    int number_of_local_transitions = Compression::multibyte_read(input);
+    int number_of_local_transitions = input.multibyte_read();
     int tagbase = 0;
-    Node &mynode = new_t.node_list[current_state];
+    local_arcs.clear();
 
-    while(number_of_local_transitions > 0)
+    if(!read_weights)
     {
-      number_of_local_transitions--;
-      tagbase += Compression::multibyte_read(input);
-      int state = (current_state + Compression::multibyte_read(input)) % base;
+      // (symbol, target) pairs with nothing in between
+      values.resize(2 * number_of_local_transitions);
+      input.multibyte_read(values.data(), values.size());
+    }
+    for(int i = 0; i != number_of_local_transitions; i++)
+    {
+      int state;
       if(read_weights)
       {
-        base_weight = Compression::long_multibyte_read(input);
+        tagbase += input.multibyte_read();
+        state = (current_state + input.multibyte_read()) % base;
+        base_weight = input.long_multibyte_read();
+      }
+      else
+      {
+        tagbase += values[2*i];
+        state = (current_state + values[2*i+1]) % base;
       }
       int i_symbol = alphabet.decode(tagbase).first;
       int o_symbol = alphabet.decode(tagbase).second;
 
-      mynode.addTransition(i_symbol, o_symbol, &new_t.node_list[state], base_weight);
+      local_arcs.push_back({i_symbol, o_symbol, static_cast<unsigned int>(state), base_weight});
+    }
+
+    // transitions sharing an input symbol keep their order in the file
+    std::stable_sort(local_arcs.begin(), local_arcs.end(),
+                     [](Arc const &a, Arc const &b) { return a.input < b.input; });
+    for(auto& arc : local_arcs)
+    {
+      new_t.own_input.push_back(arc.input);
+      new_t.own_output.push_back(arc.output);
+      new_t.own_target.push_back(arc.target);
+      new_t.own_weight.push_back(arc.weight);
     }
+    new_t.own_offset.push_back(new_t.own_input.size());
+
     number_of_states--;
     current_state++;
   }
+
+  new_t.useOwned();
+  new_t.link(nullptr, nullptr, myfinals);
 }
 
 void
-TransExe::unifyFinals()
+TransExe::read(Transducer &t, Alphabet const &alphabet)
+{
+  destroy();
+
+  // weights go through the same lossy encoding as in a file
+  bool const weighted = t.weighted();
+  auto stored = [weighted](double weight) {
+    if(!weighted)
+    {
+      return 0.0000;
+    }
+    std::stringstream buffer;
+    Compression::long_multibyte_write(weight, buffer);
+    return Compression::long_multibyte_read(buffer);
+  };
+
+  initial_id = t.initial;
+  int const base = t.transitions.size();
+  node_count = base;
+  std::map<unsigned int, double> final_ids;
+  for(auto& it : t.finals)
+  {
+    final_ids[it.first] = stored(it.second);
+  }
+
+  struct Arc
+  {
+    int input;
+    int output;
+    unsigned int target;
+    double weight;
+  };
+  std::vector<Arc> local_arcs;
+
+  own_offset.reserve(base + 1);
+  own_offset.push_back(0);
+  int current_state = 0;
+  for(auto& it : t.transitions)
+  {
+    local_arcs.clear();
+    for(auto& it2 : it.second)
+    {
+      int const target = it2.second.first;
+      int const state = (current_state + (target >= it.first ? target - it.first : target + base - it.first)) % base;
+      local_arcs.push_back({alphabet.decode(it2.first).first, alphabet.decode(it2.first).second,
+                            static_cast<unsigned int>(state), stored(it2.second.second)});
+    }
+    std::stable_sort(local_arcs.begin(), local_arcs.end(),
+                     [](Arc const &a, Arc const &b) { return a.input < b.input; });
+    for(auto& arc : local_arcs)
+    {
+      own_input.push_back(arc.input);
+      own_output.push_back(arc.output);
+      own_target.push_back(arc.target);
+      own_weight.push_back(arc.weight);
+    }
+    own_offset.push_back(own_input.size());
+    current_state++;
+  }
+
+  useOwned();
+  link(nullptr, nullptr, final_ids);
+}
+
+/*
+ * Layout of writeRaw, in native byte order:
+ *   initial node, number of nodes n, of arcs a and of finals f (4 bytes each)
+ *   arc_offset (n+1), arc_input, arc_output, arc_target (a each) and
+ *     final nodes (f), 4 bytes each, padded to 8 bytes
+ *   arc_weight (a) and final weights (f), 8 bytes each
+ *   the indices, if written, see computeIndices
+ *   the node list, if written, see layOutLinks
+ */
+
+static size_t
+rawPadding(size_t size)
+{
+  return (8 - size % 8) % 8;
+}
+
+/**
+ * Number of bytes of the arrays of the layout of writeRaw, before the
+ * indices, from its header
+ */
+static size_t
+rawArraysSize(unsigned int const *header)
+{
+  size_t const nodes = header[1];
+  size_t const arcs = header[2];
+  size_t const finals = header[3];
+  size_t const ints = 4 * (4 + nodes + 1 + 3 * arcs + finals);
+  return ints + rawPadding(ints) + 8 * (arcs + finals);
+}
+
+size_t
+TransExe::rawSize(bool with_indices, bool with_links) const
+{
+  size_t const ints = 4 * (4 + node_count + 1 + 3 * arc_total + finals.size());
+  size_t size = ints + rawPadding(ints) + 8 * (arc_total + finals.size());
+  if(with_indices)
+  {
+    size += indexSize(reinterpret_cast<unsigned int const *>(indices));
+    if(with_links)
+    {
+      size += linkSize();
+    }
+  }
+  return size;
+}
+
+char const *
+TransExe::useRaw(char const *data, std::map<unsigned int, double> &final_ids)
+{
+  unsigned int const *header = reinterpret_cast<unsigned int const *>(data);
+  initial_id = header[0];
+  node_count = header[1];
+  arc_total = header[2];
+  unsigned int const final_count = header[3];
+
+  arc_offset = header + 4;
+  arc_input = reinterpret_cast<int const *>(arc_offset + node_count + 1);
+  arc_output = arc_input + arc_total;
+  arc_target = reinterpret_cast<unsigned int const *>(arc_output + arc_total);
+  unsigned int const *final_nodes = arc_target + arc_total;
+  size_t const ints = 4 * (4 + size_t(node_count) + 1 + 3 * size_t(arc_total) + final_count);
+  arc_weight = reinterpret_cast<double const *>(data + ints + rawPadding(ints));
+  double const *final_weights = arc_weight + arc_total;
+
+  for(unsigned int i = 0; i != final_count; i++)
+  {
+    final_ids[final_nodes[i]] = final_weights[i];
+  }
+  return reinterpret_cast<char const *>(final_weights + final_count);
+}
+
+void
+TransExe::readRaw(char const *data, size_t size,
+                  std::shared_ptr<char const> const &storage,
+                  bool with_indices, bool with_links)
+{
+  destroy();
+  unsigned int const *header = reinterpret_cast<unsigned int const *>(data);
+  if(size < 16 || rawArraysSize(header) > size)
+  {
+    throw std::runtime_error("Transducer section is truncated");
+  }
+  mapping = storage;
+
+  std::map<unsigned int, double> final_ids;
+  char const *index_data = useRaw(data, final_ids);
+  if(initial_id < 0 || unsigned(initial_id) >= node_count ||
+     arc_offset[node_count] != arc_total ||
+     (!final_ids.empty() && final_ids.rbegin()->first >= node_count) ||
+     !validArcs())
+  {
+    destroy();
+    throw std::runtime_error("Transducer section is corrupt");
+  }
+
+  size_t const index_room = data + size - index_data;
+  unsigned int const *h = reinterpret_cast<unsigned int const *>(index_data);
+  if(!with_indices || (index_room >= 4 * IH_SIZE && h[IH_VERSION] != INDEX_VERSION))
+  {
+    // none stored, or laid out by a build with another layout
+    link(nullptr, nullptr, final_ids);
+    return;
+  }
+  if(index_room < 4 * IH_SIZE || indexSize(h) > index_room ||
+     h[IH_NODES] != node_count)
+  {
+    destroy();
+    throw std::runtime_error("Transducer section is corrupt");
+  }
+  indices = index_data;
+  if(!validIndices())
+  {
+    destroy();
+    throw std::runtime_error("Transducer section is corrupt");
+  }
+
+  // stored links too short for this build are laid out again, like
+  // those of another layout
+  char const *link_data = index_data + indexSize(h);
+  if(!with_links || linkSize() > index_room - indexSize(h))
+  {
+    link_data = nullptr;
+  }
+  link(index_data, link_data, final_ids);
+}
+
+void
+TransExe::writeRaw(FILE *output, bool with_indices, bool with_links) const
 {
-  node_list.resize(node_list.size()+1);
+  // the layout is built in memory, since the node list points into it
+  std::vector<uint64_t> image(rawSize(with_indices, with_links) / 8, 0);
+  char *out = reinterpret_cast<char *>(image.data());
+
+  unsigned int *header = reinterpret_cast<unsigned int *>(out);
+  header[0] = initial_id;
+  header[1] = node_count;
+  header[2] = arc_total;
+  header[3] = finals.size();
+  unsigned int *ints = header + 4;
+  ints = std::copy(arc_offset, arc_offset + node_count + 1, ints);
+  ints = reinterpret_cast<unsigned int *>(std::copy(arc_input, arc_input + arc_total, reinterpret_cast<int *>(ints)));
+  ints = reinterpret_cast<unsigned int *>(std::copy(arc_output, arc_output + arc_total, reinterpret_cast<int *>(ints)));
+  ints = std::copy(arc_target, arc_target + arc_total, ints);
+  for(auto& it : finals)
+  {
+    *ints++ = it.first - node_list;
+  }
+  size_t const int_bytes = reinterpret_cast<char *>(ints) - out;
+  double *doubles = reinterpret_cast<double *>(out + int_bytes + rawPadding(int_bytes));
+  doubles = std::copy(arc_weight, arc_weight + arc_total, doubles);
+  for(auto& it : finals)
+  {
+    *doubles++ = it.second;
+  }
+
+  if(with_indices)
+  {
+    char *index_out = reinterpret_cast<char *>(doubles);
+    size_t const index_size = indexSize(reinterpret_cast<unsigned int const *>(indices));
+    memcpy(index_out, indices, index_size);
+    if(with_links)
+    {
+      // a transducer on the copy, so that the nodes point into it
+      TransExe view;
+      std::map<unsigned int, double> final_ids;
+      view.useRaw(out, final_ids);
+      view.indices = index_out;
+      view.layOutLinks(index_out + index_size);
+    }
+  }
 
-  Node *newfinal = &node_list[node_list.size()-1];
+  fwrite_unlocked(image.data(), 8, image.size(), output);
+}
 
+void
+TransExe::buildTransducer(Transducer &t, Alphabet &alphabet) const
+{
+  t.finals.clear();
+  t.transitions.clear();
+  t.initial = initial_id;
+  for(unsigned int i = 0; i != node_count; i++)
+  {
+    auto& local = t.transitions[i];
+    for(unsigned int a = arc_offset[i], a_limit = arc_offset[i+1]; a != a_limit; a++)
+    {
+      local.insert(std::make_pair(alphabet(arc_input[a], arc_output[a]),
+                                  std::make_pair(static_cast<int>(arc_target[a]), arc_weight[a])));
+    }
+  }
   for(auto& it : finals)
   {
-    it.first->addTransition(0, 0, newfinal, it.second);
+    t.finals.insert(std::make_pair(static_cast<int>(it.first - node_list), it.second));
   }
+}
 
-  finals.clear();
-  finals.insert(std::make_pair(newfinal, default_weight));
+void
+TransExe::unifyFinals()
+{
+  unsigned int const newfinal = node_count;
+
+  std::map<unsigned int, double> final_ids;
+  for(auto& it : finals)
+  {
+    final_ids[it.first - node_list] = it.second;
+  }
+
+  std::vector<unsigned int> offset(1, 0);
+  std::vector<int> input, output;
+  std::vector<unsigned int> target;
+  std::vector<double> weight;
+
+  for(unsigned int i = 0; i != newfinal; i++)
+  {
+    unsigned int j = arc_offset[i];
+    unsigned int const limit = arc_offset[i+1];
+    auto fit = final_ids.find(i);
+    if(fit != final_ids.end())
+    {
+      // the new epsilon goes after the existing ones
+      for(; j != limit && arc_input[j] <= 0; j++)
+      {
+        input.push_back(arc_input[j]);
+        output.push_back(arc_output[j]);
+        target.push_back(arc_target[j]);
+        weight.push_back(arc_weight[j]);
+      }
+      input.push_back(0);
+      output.push_back(0);
+      target.push_back(newfinal);
+      weight.push_back(fit->second);
+    }
+    for(; j != limit; j++)
+    {
+      input.push_back(arc_input[j]);
+      output.push_back(arc_output[j]);
+      target.push_back(arc_target[j]);
+      weight.push_back(arc_weight[j]);
+    }
+    offset.push_back(input.size());
+  }
+  offset.push_back(input.size());
+
+  destroy();
+  own_offset.swap(offset);
+  own_input.swap(input);
+  own_output.swap(output);
+  own_target.swap(target);
+  own_weight.swap(weight);
+  useOwned();
+
+  node_count = newfinal + 1;
+  final_ids.clear();
+  final_ids[newfinal] = default_weight;
+  link(nullptr, nullptr, final_ids);
 }
 
 Node *
@@ -172,3 +1312,15 @@ TransExe::getFinals()
 {
   return finals;
 }
+
+bool
+TransExe::isDeterministic() const
+{
+  return deterministic;
+}
+
+bool
+TransExe::usesStoredLinks() const
+{
+  return node_list != nullptr && own_links.empty();
+}
@@ -18,15 +18,20 @@
 #ifndef _TRANSEXE_
 #define _TRANSEXE_
 
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
 #include <lttoolbox/alphabet.h>
 #include <lttoolbox/node.h>
 
+class CompressedInput;
+class Transducer;
+
 
 /**
  * Transducer class for execution of lexical processing algorithms
@@ -45,15 +50,134 @@ private:
   double default_weight;
 
   /**
-   * Node list
+   * Node list, laid out by layOutLinks either in own_links or in the
+   * memory given to readRaw
    */
-  std::vector<Node> node_list;
+  Node *node_list;
+  unsigned int node_count;
+  std::vector<uint64_t> own_links;
 
   /**
    * Final node set mapped to its weight walues
    */
   std::map<Node *, double> finals;
 
+  /**
+   * Transitions of all the nodes packed in compressed sparse row form:
+   * the transitions of node n are at positions
+   * [arc_offset[n], arc_offset[n+1]) of the arc_* arrays, sorted by
+   * input symbol
+   */
+  unsigned int arc_total;
+  unsigned int const *arc_offset;
+  int const *arc_input;
+  int const *arc_output;
+  unsigned int const *arc_target;
+  double const *arc_weight;
+
+  /**
+   * Storage of the arc_* arrays: either these vectors, or the memory
+   * given to readRaw, which 'mapping' keeps alive
+   */
+  std::vector<unsigned int> own_offset;
+  std::vector<int> own_input;
+  std::vector<int> own_output;
+  std::vector<unsigned int> own_target;
+  std::vector<double> own_weight;
+  std::shared_ptr<char const> mapping;
+
+  /**
+   * Point the arc_* arrays to the own_* vectors
+   */
+  void useOwned();
+
+  /**
+   * Point the arc_* arrays to the layout of writeRaw
+   * @param data the layout
+   * @param final_ids filled with the final nodes and their weights
+   * @return the end of the arrays, where the indices can follow
+   */
+  char const * useRaw(char const *data, std::map<unsigned int, double> &final_ids);
+
+  /**
+   * Direct, case and epsilon indices of the nodes in the flat layout
+   * of writeIndices, either computed into own_indices or in the memory
+   * given to readRaw.  Transitions on symbols that have a lowercase
+   * version get a case entry, nodes with more than DENSE_THRESHOLD
+   * transitions a direct index of their letters, and nodes with
+   * epsilon transitions their epsilon closure.
+   */
+  static int const DENSE_THRESHOLD = 24;
+  std::vector<uint64_t> own_indices;
+  char const *indices;
+
+  /**
+   * Whether no node has epsilon transitions or two transitions with
+   * the same input symbol
+   */
+  bool deterministic;
+
+  /**
+   * Set up the indices and the node list, and mark the final nodes
+   * @param index_data the indices, nullptr to compute them
+   * @param link_data the node list laid out by layOutLinks, nullptr
+   *        to lay it out in own_links
+   * @param final_ids the final nodes, by number, and their weights
+   */
+  void link(char const *index_data, char const *link_data,
+            std::map<unsigned int, double> const &final_ids);
+
+  /**
+   * Compute the indices into own_indices
+   */
+  void computeIndices();
+
+  /**
+   * Whether the arcs of the arc_* arrays, which may come from a file,
+   * are those of node_count nodes
+   */
+  bool validArcs() const;
+
+  /**
+   * Whether the node numbers and the positions in the indices, which
+   * may come from a file, are in range, so that layOutLinks and State
+   * stay inside the arrays; needs validArcs()
+   */
+  bool validIndices() const;
+
+  /**
+   * Header of the layout of layOutLinks
+   */
+  void linkHeader(unsigned int *h) const;
+
+  /**
+   * Number of bytes written by layOutLinks, a multiple of 8
+   */
+  size_t linkSize() const;
+
+  /**
+   * Lay out the nodes, resolving the transition targets and pointing
+   * every node to its slice of the packed arrays and to the indices
+   * @param out linkSize() zeroed bytes, aligned to 8 bytes
+   * @return the node list in out
+   */
+  Node * layOutLinks(char *out) const;
+
+  /**
+   * Whether the node list laid out by layOutLinks in data, which may
+   * come from a file, holds the pointers layOutLinks would store there;
+   * needs validIndices() and a header matching linkHeader()
+   */
+  bool validLinks(char const *data) const;
+
+  /**
+   * Use the node list laid out by layOutLinks
+   * @param data the layout, writable, since final nodes are marked
+   * @return false if the layout does not match this build or
+   *         transducer, or is damaged
+   */
+  bool useLinks(char const *data);
+
   /**
    * Copy function
    * @param te the transducer to be copied
@@ -97,6 +221,57 @@ public:
    */
   void read(FILE *input, Alphabet const &alphabet);
 
+  /**
+   * Read method decoding from memory
+   * @param input the bytes
+   * @param alphabet the alphabet object to decode the symbols
+   */
+  void read(CompressedInput &input, Alphabet const &alphabet);
+
+  /**
+   * Build the transducer from a Transducer, as if it had been written
+   * and read back
+   * @param t the transducer
+   * @param alphabet the alphabet object to decode the symbols
+   */
+  void read(Transducer &t, Alphabet const &alphabet);
+
+  /**
+   * Use the transducer laid out by writeRaw, without copying it; throws
+   * std::runtime_error if the layout does not fit in size bytes
+   * @param data the start of the layout, aligned to 8 bytes
+   * @param size the number of bytes from data that the layout may use
+   * @param storage keeps data valid while the transducer uses it
+   * @param with_indices whether the layout includes the indices
+   * @param with_links whether the layout includes the node list after
+   *        the indices
+   */
+  void readRaw(char const *data, size_t size,
+               std::shared_ptr<char const> const &storage,
+               bool with_indices, bool with_links);
+
+  /**
+   * Write the packed arrays in the layout read by readRaw
+   * @param output the stream
+   * @param with_indices whether to write the indices after the arrays,
+   *        so that readRaw does not compute them
+   * @param with_links whether to write the node list after the
+   *        indices, so that readRaw does not lay it out
+   */
+  void writeRaw(FILE *output, bool with_indices, bool with_links) const;
+
+  /**
+   * Number of bytes written by writeRaw, a multiple of 8
+   */
+  size_t rawSize(bool with_indices, bool with_links) const;
+
+  /**
+   * Rebuild the Transducer this transducer was read from
+   * @param t the transducer to fill
+   * @param alphabet the alphabet to encode the symbol pairs
+   */
+  void buildTransducer(Transducer &t, Alphabet &alphabet) const;
+
   /**
    * Reduces all the final states to one
    */
@@ -113,6 +288,20 @@ public:
    * @return the set of final nodes
    */
   std::map<Node *, double> & getFinals();
+
+  /**
+   * Whether every input string is read by at most one path, which can
+   * then be followed with State::initDeterministic
+   * @return true if no node has epsilon transitions or two transitions
+   *         with the same input symbol
+   */
+  bool isDeterministic() const;
+
+  /**
+   * Whether the node list is the one stored with the transducer by
+   * writeRaw, rather than one laid out when it was read
+   */
+  bool usesStoredLinks() const;
 };
 
 #endif
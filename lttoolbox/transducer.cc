@@ -598,30 +598,28 @@ Transducer::write(FILE *output, int const decalage)
 
 void
 Transducer::read(FILE *input, int const decalage)
+{
+  CompressedInput in(input);
+  read(in, decalage);
+}
+
+void
+Transducer::read(CompressedInput &input, int const decalage)
 {
   Transducer new_t;
 
   bool read_weights = false;
 
-  fpos_t pos;
-  if (fgetpos(input, &pos) == 0) {
-      char header[4]{};
-      fread_unlocked(header, 1, 4, input);
-      if (strncmp(header, HEADER_TRANSDUCER, 4) == 0) {
-          auto features = read_le<uint64_t>(input);
-          if (features >= TDF_UNKNOWN) {
-              throw std::runtime_error("Transducer has features that are unknown to this version of lttoolbox - upgrade!");
-          }
-          read_weights = (features & TDF_WEIGHTS);
-      }
-      else {
-          // Old binary format
-          fsetpos(input, &pos);
+  if (input.header(HEADER_TRANSDUCER)) {
+      auto features = input.read_u64_le();
+      if (features >= TDF_UNKNOWN) {
+          throw std::runtime_error("Transducer has features that are unknown to this version of lttoolbox - upgrade!");
       }
+      read_weights = (features & TDF_WEIGHTS);
   }
 
-  new_t.initial = Compression::multibyte_read(input);
-  int finals_size = Compression::multibyte_read(input);
+  new_t.initial = input.multibyte_read();
+  int finals_size = input.multibyte_read();
 
   int base = 0;
   double base_weight = default_weight;
@@ -629,29 +627,41 @@ Transducer::read(FILE *input, int const decalage)
   {
     finals_size--;
 
-    base += Compression::multibyte_read(input);
+    base += input.multibyte_read();
     if(read_weights)
     {
-      base_weight = Compression::long_multibyte_read(input);
+      base_weight = input.long_multibyte_read();
     }
     new_t.finals.insert(std::make_pair(base, base_weight));
   }
 
-  base = Compression::multibyte_read(input);
+  base = input.multibyte_read();
   int number_of_states = base;
   int current_state = 0;
+  std::vector<unsigned int> values;
   while(number_of_states > 0)
   {
-    int number_of_local_transitions = Compression::multibyte_read(input);
+    int number_of_local_transitions = input.multibyte_read();
     int tagbase = 0;
-    while(number_of_local_transitions > 0)
+    if(!read_weights)
     {
-      number_of_local_transitions--;
-      tagbase += Compression::multibyte_read(input) - decalage;
-      int state = (current_state + Compression::multibyte_read(input)) % base;
+      // (symbol, target) pairs with nothing in between
+      values.resize(2 * number_of_local_transitions);
+      input.multibyte_read(values.data(), values.size());
+    }
+    for(int i = 0; i != number_of_local_transitions; i++)
+    {
+      int state;
       if(read_weights)
       {
-        base_weight = Compression::long_multibyte_read(input);
+        tagbase += input.multibyte_read() - decalage;
+        state = (current_state + input.multibyte_read()) % base;
+        base_weight = input.long_multibyte_read();
+      }
+      else
+      {
+        tagbase += values[2*i] - decalage;
+        state = (current_state + values[2*i+1]) % base;
       }
       if(new_t.transitions.find(state) == new_t.transitions.end())
       {
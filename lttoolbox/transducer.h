@@ -30,7 +30,9 @@
   */
 constexpr double default_weight = 0;
 
+class CompressedInput;
 class MatchExe;
+class TransExe;
 
 /**
  * Class to represent a letter transducer during the dictionary compilation
@@ -39,6 +41,7 @@ class Transducer
 {
 private:
   friend class MatchExe;
+  friend class TransExe;
 
   /**
    * Initial state
@@ -336,6 +339,13 @@ public:
    */
   void read(FILE *input, int const decalage = 0);
 
+  /**
+   * Read method decoding from memory
+   * @param input the bytes to read from
+   * @param decalage offset to sum to the tags
+   */
+  void read(CompressedInput &input, int const decalage = 0);
+
   void serialise(std::ostream &serialised) const;
   void deserialise(std::istream &serialised);
 
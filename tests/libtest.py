@@ -0,0 +1,30 @@
+# -*- coding: utf-8 -*-
+
+from basictest import BasicTest, TempDir
+
+class LibTest(BasicTest):
+    """See lt_lib test for how to use this. Runs a check of lt-lib-test
+    on a compiled dictionary."""
+
+    libdix = "data/minimal-mono.dix"
+    libdir = "lr"
+    libfile = None      # a file to check as it is, instead of libdix
+    compflags = []
+    libflags = ["links"]
+    libargs = []        # after the file
+    expectedOutput = ""
+
+    def runTest(self):
+        with TempDir() as tmpd:
+            libfile = self.libfile
+            if libfile is None:
+                libfile = tmpd+'/compiled.bin'
+                self.compileDix(self.libdir, self.libdix,
+                                flags=self.compflags, binName=libfile)
+            self.libresult = self.openPipe('lt-lib-test',
+                                           self.libflags + [libfile]
+                                           + self.libargs)
+
+            self.assertEqual(self.communicateFlush(None, self.libresult), self.expectedOutput)
+
+            self.closePipe(self.libresult)
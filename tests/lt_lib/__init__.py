@@ -0,0 +1,67 @@
+# -*- coding: utf-8 -*-
+import unittest
+from libtest import LibTest
+
+
+class MappedLinks(unittest.TestCase, LibTest):
+    libdix = "data/sections.dix"
+    compflags = ["-M"]
+    expectedOutput = "final@inconditional 1\nmain@standard 1\n"
+
+
+class DecodedLinks(unittest.TestCase, LibTest):
+    libdix = "data/sections.dix"
+    expectedOutput = "final@inconditional 0\nmain@standard 0\n"
+
+
+class WrappedStream(unittest.TestCase, LibTest):
+    libfile = "data/wrap.txt"
+    libflags = ["wrap"]
+    expectedOutput = "second line\nthird ℂ line\n"
+
+
+class ConcurrentSessions(unittest.TestCase, LibTest):
+    libflags = ["sessions"]
+    libargs = ["data/sessions.txt"]
+    expectedOutput = ("^abc/ab<n><def>$ ^ab/ab<n><ind>$ ^y/y<n><ind>$ ^n/n<n><ind>$"
+                      " ^jg/j<pr>+g<n>$ ^kg/k<pr>+g<n>$ ^xyz/*xyz$ ^Abc/Ab<n><def>$\n"
+                      "^ab/ab<n><ind>$, ^Y/Y<n><ind>$; ^abc/ab<n><def>$\n"
+                      "differing rounds: 0 0\n")
+
+
+class InitialiseAgain(unittest.TestCase, LibTest):
+    libflags = ["reinit"]
+    libargs = ["data/sessions.txt"]
+    expectedOutput = ("^abc/ab<n><def>$ ^ab/ab<n><ind>$ ^y/y<n><ind>$ ^n/n<n><ind>$"
+                      " ^jg/j<pr>+g<n>$ ^kg/k<pr>+g<n>$ ^xyz/*xyz$ ^Abc/Ab<n><def>$\n"
+                      "^ab/ab<n><ind>$, ^Y/Y<n><ind>$; ^abc/ab<n><def>$\n"
+                      "same after initialising again: 1 1\n"
+                      "generation on a copy: The dictionaries are shared with a copy or session initialised for another mode\n"
+                      "same after that: 1\n")
+
+
+class RestartedBinaryStream(unittest.TestCase, LibTest):
+    libdir = "rl"
+    libflags = ["restart"]
+    expectedOutput = "ab\nab\n"
+
+
+class CachedResults(unittest.TestCase, LibTest):
+    libflags = ["caches"]
+    libargs = ["data/sessions.txt"]
+    expectedOutput = ("^abc/ab<n><def>$ ^ab/ab<n><ind>$ ^y/y<n><ind>$ ^n/n<n><ind>$"
+                      " ^jg/j<pr>+g<n>$ ^kg/k<pr>+g<n>$ ^xyz/*xyz$ ^Abc/Ab<n><def>$\n"
+                      "^ab/ab<n><ind>$, ^Y/Y<n><ind>$; ^abc/ab<n><def>$\n"
+                      "analysis cache: same 1, hits 1\n"
+                      "^ab<n><ind>$\n"
+                      "biltrans cache: same 1, hits 1\n")
+
+
+class DamagedSections(unittest.TestCase, LibTest):
+    # several sections are decoded at once, the error of one is thrown
+    # once they are done
+    libdix = "data/sections.dix"
+    compflags = ["-I"]
+    libflags = ["damaged"]
+    expectedOutput = ("not loaded: Transducer has features that are unknown"
+                      " to this version of lttoolbox - upgrade!\n")
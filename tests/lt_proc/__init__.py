@@ -1,5 +1,7 @@
 # -*- coding: utf-8 -*-
 from proctest import ProcTest
+from basictest import BasicTest, TempDir
+import unittest
 
 class ValidInput(ProcTest):
     inputs = ["ab",
@@ -15,6 +17,12 @@ class BiprocSkipTags(ProcTest):
     inputs = ["^vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>$"]
     expectedOutputs = ["^vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>/vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>$"]
 
+class UndefinedTagInText(ProcTest):
+    # the tag is not in the alphabet, and nothing of it is written
+    procdix = "data/group-after-join-bi.dix"
+    inputs = ["a<vblex> x"]
+    expectedOutputs = ["^a/*a$ ^x/*x$"]
+
 class WeightedTransducer(ProcTest):
     procdix = "data/walk-weight.att"
     inputs = ["walk",
@@ -64,12 +72,48 @@ class PrintWeightsNegative(ProcTest):
     inputs = ["cat"]
     expectedOutputs = ["^cat/cat+n<W:8.828133>/cat+v<W:9.859865>$"]
 
+class MmapLayoutWeights(ProcTest):
+    procdix = "data/cat-weight.att"
+    compflags = ["-M"]
+    procflags = ["-W"]
+    inputs = ["cat"]
+    expectedOutputs = ["^cat/cat+n<W:11.528235>/cat+v<W:12.559967>$"]
+
+class MmapLayoutBilingual(ProcTest):
+    procdix = "data/biproc-skips-tags-mono.dix"
+    compflags = ["-M"]
+    procflags = ["-b", "-z"]
+    inputs = ["^vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>$"]
+    expectedOutputs = ["^vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>/vihki<KEPT><MATCHSOFAR><STILLMATCHING><SOMEHOWKEPT1><@SOMEHOWKEPT2>$"]
+
+class SectionFilter(ProcTest):
+    procdix = "data/sections.dix"
+    procflags = ["-z", "-S", "main@standard"]
+    inputs = ["X."]
+    expectedOutputs = ["^X/X<np>$."]
+
+class SectionFilterIndexed(SectionFilter):
+    compflags = ["-I"]
+
 class PrintNAnalyses(ProcTest):
     procdix = "data/cat-weight.att"
     procflags = ["-N 1"]
     inputs = ["cat"]
     expectedOutputs = ["^cat/cat+n$"]
 
+class PrunedNAnalyses(ProcTest):
+    procdix = "data/entry-weights.dix"
+    procflags = ["-W", "-N", "2", "-P"]
+    inputs = ["nanow"]
+    expectedOutputs = ["^nanow/nan<n><ma><du><gen><W:32.120000>/nan<n><ma><du><acc><W:34.120000>$"]
+
+class PrunedNAnalysesDuplicates(ProcTest):
+    # the two paths to x take up both analyses, as without -P
+    procdix = "data/prune-duplicates.att"
+    procflags = ["-W", "-N", "2", "-P"]
+    inputs = ["a"]
+    expectedOutputs = ["^a/x<W:1.000000>$"]
+
 class LemmaEntryWeights(ProcTest):
     procdix = "data/lemma-entry-weights.dix"
     procflags = ["-W"]
@@ -121,6 +165,9 @@ class GardenPathMweNewlines(ProcTest):
 ]"""
                        ]
 
+class GardenPathMweDFACache(GardenPathMwe):
+    procflags = ["-z", "-D", "1000"]
+
 class CatMultipleFstsTransducer(ProcTest):
     procdix = "data/cat-multiple-fst.att"
     inputs = ["cat", "cats"]
@@ -245,6 +292,15 @@ class NonBMPGeneratorTest(ProcTest):
     procdir = "rl"
 
 
+class CarefulCaseUncasedTest(ProcTest):
+    # ℂ has no lowercase, so it is not uppercase for -C
+    procdix = "data/careful-case.dix"
+    inputs = ['^ℂ<n>$']
+    expectedOutputs = ['xyz']
+    procflags = ['-z', '-C']
+    procdir = "rl"
+
+
 class AlphabeticMultibyteTest(ProcTest):
     procdix = "data/minimal-mono.dix"
     inputs = ["𝜊"]  # code point >65535, needs two bytes in utf-8, isAlphabetic
@@ -427,5 +483,65 @@ class BufferIndex(ProcTest):
                        "^ab/*ab$",
                        ]
 
+class BinaryStream(unittest.TestCase, BasicTest):
+    "A pipeline in the binary stream format gives the output of the text one"
+    inputs = ["ab y [<b>] abc, \\^ ab\0ABC n\0"]
+    pipelines = [[["-z"], ["-z", "-g"]],
+                 [["-z"], ["-z", "-n"]],
+                 [["-z"], ["-z", "-b"], ["-z", "-g"]]]
+
+    def runPipeline(self, tmpd, stages, text, binary):
+        data = text.encode('utf-8')
+        for flags in stages:
+            bin = {"-g": "gen", "-n": "gen", "-b": "bi"}.get(flags[-1], "ana")
+            proc = self.openPipe('lt-proc', flags + (["-B"] if binary else [])
+                                 + [tmpd+'/'+bin+'.bin'])
+            data = proc.communicate(input=data)[0]
+            self.assertEqual(proc.returncode, 0)
+        return data
+
+    def runTest(self):
+        with TempDir() as tmpd:
+            self.compileDix('lr', 'data/minimal-mono.dix', binName=tmpd+'/ana.bin')
+            self.compileDix('rl', 'data/minimal-mono.dix', binName=tmpd+'/gen.bin')
+            self.compileDix('lr', 'data/minimal-bi.dix', binName=tmpd+'/bi.bin')
+            for stages in self.pipelines:
+                for text in self.inputs:
+                    self.assertEqual(self.runPipeline(tmpd, stages, text, True),
+                                     self.runPipeline(tmpd, stages, text, False))
+
+class Threads(unittest.TestCase, BasicTest):
+    "Processing in threads gives the output of processing in one"
+    inputs = [(["-z"], "ab y [<b>] abc, \\^ ab\0ABC n\0\0y [x]\0y"),
+              ([], "ab y [<b>] abc, ab\n\nABC [n\n\n] n\n\n\\\n\ny\n" * 5000),
+              # analysis stops at a tag it does not know
+              ([], "ab y\n\n" * 20000 + "ab <unknown> y\n\n" + "ab\n\n" * 20000)]
+    extraFlags = ["-j", "3"]
+
+    def runProc(self, flags, data):
+        proc = self.openPipe('lt-proc', flags)
+        out = proc.communicate(input=data)[0]
+        self.assertEqual(proc.returncode, 0)
+        return out
+
+    def runTest(self):
+        with TempDir() as tmpd:
+            self.compileDix('lr', 'data/minimal-mono.dix', binName=tmpd+'/ana.bin')
+            for flags, text in self.inputs:
+                data = text.encode('utf-8')
+                self.assertEqual(self.runProc(flags + self.extraFlags + [tmpd+'/ana.bin'], data),
+                                 self.runProc(flags + [tmpd+'/ana.bin'], data))
+
+class Pipeline(Threads):
+    "Reading and writing in threads of their own changes no output"
+    extraFlags = ["-T"]
+
+class AnalysisCache(Threads):
+    "Reusing the analyses and translations of earlier words changes no output"
+    inputs = Threads.inputs + [
+        (["-b"], "^ab$ ^abc<n>$ ^ABC<n><pl>$ ^*y$ ^abc<n>$ ^abc$ ^ab$ ^ABC<n><pl>$\n" * 3),
+        (["-b", "-z"], "^abc<n>$ ^Abc<n>$\0^abc<n>$ ^Abc<n>$\0")]
+    extraFlags = ["-A", "2"]
+
 # These fail on some systems:
 #from null_flush_invalid_stream_format import *
@@ -10,6 +10,7 @@ class ProcTest(unittest.TestCase, BasicTest):
     procdix = "data/minimal-mono.dix"
     procdir = "lr"
     procflags = ["-z"]
+    compflags = []
     inputs = [""]
     expectedOutputs = [""]
     expectedRetCodeFail = False
@@ -18,6 +19,7 @@ class ProcTest(unittest.TestCase, BasicTest):
 
     def compileTest(self, tmpd):
         return self.compileDix(self.procdir, self.procdix,
+                               flags=self.compflags,
                                binName=tmpd+'/compiled.bin',
                                expectFail=self.expectedCompRetCodeFail)
 
@@ -11,6 +11,7 @@ import lt_print
 import lt_comp
 import lt_append
 import lt_paradigm
+import lt_lib
 
 os.environ['LTTOOLBOX_PATH'] = '../lttoolbox'
 if len(sys.argv) > 1:
@@ -19,7 +20,7 @@ if len(sys.argv) > 1:
 if __name__ == "__main__":
     os.chdir(os.path.dirname(__file__))
     failures = 0
-    for module in [lt_trim, lt_proc, lt_print, lt_comp, lt_append, lt_paradigm]:
+    for module in [lt_trim, lt_proc, lt_print, lt_comp, lt_append, lt_paradigm, lt_lib]:
         suite = unittest.TestLoader().loadTestsFromModule(module)
         res = unittest.TextTestRunner(verbosity = 2).run(suite)
         failures += len(res.failures)